@@ -0,0 +1,369 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+#include "xdg-shell-client-protocol.h"
+#include "ivi-application-client-protocol.h"
+
+#include "bench.h"
+
+struct bench_buffer {
+	struct wl_buffer *buffer;
+	uint32_t *data;
+	bool busy;
+};
+
+struct bench_client {
+	const struct bench_client_options *options;
+	struct wl_display *display;
+	struct wl_compositor *compositor;
+	struct wl_shm *shm;
+	struct xdg_wm_base *wm_base;
+	struct ivi_application *ivi_application;
+
+	struct wl_surface *surface;
+	struct xdg_surface *xdg_surface;
+	struct xdg_toplevel *toplevel;
+	struct ivi_surface *ivi_surface;
+	bool configured;
+	int pending_width, pending_height;
+
+	int width, height;
+	void *data;
+	size_t size;
+	struct bench_buffer buffers[2];
+	uint32_t frame;
+};
+
+static void buffer_release(void *data, struct wl_buffer *wl_buffer)
+{
+	struct bench_buffer *buffer = data;
+
+	buffer->busy = false;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	.release = buffer_release,
+};
+
+static void xdg_wm_base_ping(void *data, struct xdg_wm_base *wm_base,
+		uint32_t serial)
+{
+	xdg_wm_base_pong(wm_base, serial);
+}
+
+static const struct xdg_wm_base_listener wm_base_listener = {
+	.ping = xdg_wm_base_ping,
+};
+
+static bool create_buffers(struct bench_client *client, int width,
+		int height);
+
+static void xdg_surface_configure(void *data, struct xdg_surface *xdg_surface,
+		uint32_t serial)
+{
+	struct bench_client *client = data;
+
+	/* Only fullscreen clients follow the configured size, the buffers are
+	 * replaced before the ack so the next commit matches it */
+	if (client->options->fullscreen && client->pending_width > 0 &&
+			client->pending_height > 0 &&
+			(client->pending_width != client->width ||
+			 client->pending_height != client->height))
+		create_buffers(client, client->pending_width,
+			client->pending_height);
+
+	xdg_surface_ack_configure(xdg_surface, serial);
+	client->configured = true;
+}
+
+static const struct xdg_surface_listener xdg_surface_listener = {
+	.configure = xdg_surface_configure,
+};
+
+static void xdg_toplevel_configure(void *data, struct xdg_toplevel *toplevel,
+		int32_t width, int32_t height, struct wl_array *states)
+{
+	/* Windowed bench clients keep their size, resizing is not what we
+	 * measure. */
+	struct bench_client *client = data;
+
+	client->pending_width = width;
+	client->pending_height = height;
+}
+
+static void xdg_toplevel_close(void *data, struct xdg_toplevel *toplevel)
+{
+}
+
+static const struct xdg_toplevel_listener xdg_toplevel_listener = {
+	.configure = xdg_toplevel_configure,
+	.close = xdg_toplevel_close,
+};
+
+static void ivi_surface_configure(void *data, struct ivi_surface *ivi_surface,
+		int32_t width, int32_t height)
+{
+	/* No ack in ivi-application, the next commit has the new size */
+	struct bench_client *client = data;
+
+	if (width > 0 && height > 0 &&
+			(width != client->width || height != client->height))
+		create_buffers(client, width, height);
+}
+
+static const struct ivi_surface_listener ivi_surface_listener = {
+	.configure = ivi_surface_configure,
+};
+
+static void registry_global(void *data, struct wl_registry *registry,
+		uint32_t name, const char *interface, uint32_t version)
+{
+	struct bench_client *client = data;
+
+	if (strcmp(interface, wl_compositor_interface.name) == 0) {
+		client->compositor = wl_registry_bind(registry, name,
+			&wl_compositor_interface, 4);
+	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
+		client->shm = wl_registry_bind(registry, name,
+			&wl_shm_interface, 1);
+	} else if (strcmp(interface, xdg_wm_base_interface.name) == 0) {
+		client->wm_base = wl_registry_bind(registry, name,
+			&xdg_wm_base_interface, 1);
+		xdg_wm_base_add_listener(client->wm_base, &wm_base_listener,
+			client);
+	} else if (strcmp(interface, ivi_application_interface.name) == 0) {
+		client->ivi_application = wl_registry_bind(registry, name,
+			&ivi_application_interface, 1);
+	}
+}
+
+static void registry_global_remove(void *data, struct wl_registry *registry,
+		uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+	.global = registry_global,
+	.global_remove = registry_global_remove,
+};
+
+static void destroy_buffers(struct bench_client *client)
+{
+	int i;
+
+	/* The compositor keeps its own reference to busy buffers */
+	for (i = 0; i < 2; i++) {
+		if (client->buffers[i].buffer)
+			wl_buffer_destroy(client->buffers[i].buffer);
+		client->buffers[i] = (struct bench_buffer){ 0 };
+	}
+	if (client->data)
+		munmap(client->data, client->size * 2);
+	client->data = NULL;
+}
+
+static bool create_buffers(struct bench_client *client, int width,
+		int height)
+{
+	int stride = width * 4;
+	size_t size = (size_t)stride * height;
+	struct wl_shm_pool *pool;
+	void *data;
+	int fd, i;
+
+	destroy_buffers(client);
+
+	fd = memfd_create("weston-pro-bench", MFD_CLOEXEC);
+	if (fd < 0)
+		return false;
+	if (ftruncate(fd, size * 2) < 0) {
+		close(fd);
+		return false;
+	}
+	data = mmap(NULL, size * 2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+
+	pool = wl_shm_create_pool(client->shm, fd, size * 2);
+	for (i = 0; i < 2; i++) {
+		struct bench_buffer *buffer = &client->buffers[i];
+
+		buffer->data = (uint32_t *)((char *)data + size * i);
+		buffer->buffer = wl_shm_pool_create_buffer(pool, size * i,
+			width, height, stride, WL_SHM_FORMAT_XRGB8888);
+		wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+		memset(buffer->data, 0x40, size);
+	}
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	client->data = data;
+	client->size = size;
+	client->width = width;
+	client->height = height;
+	return true;
+}
+
+/* Repaints a horizontal band that walks down the window and commits only
+ * that band as damage, like a typical partially updating client. */
+static void client_draw(struct bench_client *client)
+{
+	int width = client->width;
+	int height = client->height;
+	int band = height / 8 > 0 ? height / 8 : 1;
+	struct bench_buffer *buffer = NULL;
+	int y, x, i;
+
+	for (i = 0; i < 2; i++) {
+		if (!client->buffers[i].busy) {
+			buffer = &client->buffers[i];
+			break;
+		}
+	}
+	/* The compositor still holds both buffers, skip this tick */
+	if (!buffer)
+		return;
+
+	y = (client->frame * band) % height;
+	if (y + band > height)
+		band = height - y;
+	for (i = y; i < y + band; i++)
+		for (x = 0; x < width; x++)
+			buffer->data[i * width + x] = 0xff000000 |
+				(client->frame * 0x010203);
+
+	wl_surface_attach(client->surface, buffer->buffer, 0, 0);
+	wl_surface_damage_buffer(client->surface, 0, y, width, band);
+	wl_surface_commit(client->surface);
+	buffer->busy = true;
+	client->frame++;
+}
+
+int bench_client_run(const struct bench_client_options *options)
+{
+	struct bench_client client = { .options = options };
+	struct itimerspec its = { 0 };
+	struct wl_registry *registry;
+	struct pollfd fds[2];
+	uint64_t expirations;
+	char title[32];
+	int timer;
+
+	client.display = wl_display_connect(NULL);
+	if (!client.display) {
+		fprintf(stderr, "bench client %d: failed to connect\n",
+			options->id);
+		return EXIT_FAILURE;
+	}
+
+	registry = wl_display_get_registry(client.display);
+	wl_registry_add_listener(registry, &registry_listener, &client);
+	wl_display_roundtrip(client.display);
+	if (!client.compositor || !client.shm || (options->ivi_id ?
+			!client.ivi_application : !client.wm_base)) {
+		fprintf(stderr, "bench client %d: missing globals\n",
+			options->id);
+		return EXIT_FAILURE;
+	}
+
+	if (!create_buffers(&client, options->width, options->height))
+		return EXIT_FAILURE;
+
+	client.surface = wl_compositor_create_surface(client.compositor);
+	if (options->ivi_id) {
+		/* The configure comes right away, draw at that size */
+		client.ivi_surface = ivi_application_surface_create(
+			client.ivi_application, options->ivi_id, client.surface);
+		ivi_surface_add_listener(client.ivi_surface,
+			&ivi_surface_listener, &client);
+		if (wl_display_roundtrip(client.display) < 0)
+			return EXIT_FAILURE;
+	} else {
+		client.xdg_surface = xdg_wm_base_get_xdg_surface(
+			client.wm_base, client.surface);
+		xdg_surface_add_listener(client.xdg_surface,
+			&xdg_surface_listener, &client);
+		client.toplevel = xdg_surface_get_toplevel(client.xdg_surface);
+		xdg_toplevel_add_listener(client.toplevel,
+			&xdg_toplevel_listener, &client);
+		snprintf(title, sizeof(title), "bench-%d", options->id);
+		xdg_toplevel_set_title(client.toplevel, title);
+		if (options->fullscreen)
+			xdg_toplevel_set_fullscreen(client.toplevel, NULL);
+		wl_surface_commit(client.surface);
+
+		while (!client.configured)
+			if (wl_display_dispatch(client.display) < 0)
+				return EXIT_FAILURE;
+	}
+
+	timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (timer < 0)
+		return EXIT_FAILURE;
+	its.it_interval.tv_nsec = 1000000000L / (options->rate > 0 ?
+		options->rate : 1);
+	its.it_value = its.it_interval;
+	timerfd_settime(timer, 0, &its, NULL);
+
+	client_draw(&client);
+
+	fds[0].fd = wl_display_get_fd(client.display);
+	fds[0].events = POLLIN;
+	fds[1].fd = timer;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		while (wl_display_prepare_read(client.display) != 0)
+			wl_display_dispatch_pending(client.display);
+		if (wl_display_flush(client.display) < 0 && errno != EAGAIN) {
+			wl_display_cancel_read(client.display);
+			break;
+		}
+
+		if (poll(fds, 2, -1) < 0) {
+			wl_display_cancel_read(client.display);
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			if (wl_display_read_events(client.display) < 0)
+				break;
+		} else {
+			wl_display_cancel_read(client.display);
+		}
+		if (fds[0].revents & (POLLERR | POLLHUP))
+			break;
+		if (wl_display_dispatch_pending(client.display) < 0)
+			break;
+
+		if (fds[1].revents & POLLIN) {
+			if (read(timer, &expirations, sizeof(expirations)) > 0)
+				client_draw(&client);
+		}
+	}
+
+	close(timer);
+	wl_display_disconnect(client.display);
+
+	return EXIT_SUCCESS;
+}
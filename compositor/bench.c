@@ -0,0 +1,964 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <wlr/backend/headless.h>
+#include <wlr/backend/multi.h>
+
+#include <weston-pro.h>
+#include "bench.h"
+
+/*
+ * weston-pro-bench runs the regular compositor on the headless backend with
+ * the pixman renderer, feeds it with synthetic clients and reports how fast
+ * the scene and input paths go. It needs neither a GPU nor a display, so it
+ * can run in CI.
+ */
+
+#define INPUT_RING_SIZE 256
+
+enum bench_input_type {
+	BENCH_INPUT_MOTION,
+	BENCH_INPUT_BUTTON,
+	BENCH_INPUT_FRAME,
+};
+
+struct bench_input_event {
+	enum bench_input_type type;
+	/* CLOCK_MONOTONIC */
+	uint64_t time_nsec;
+	double dx, dy;
+	uint32_t button;
+	bool pressed;
+};
+
+/*
+ * Pointer events produced on another thread, handed to the main loop
+ * through a single-producer single-consumer ring and an eventfd. The main
+ * loop emits them on the synthetic pointer, so they take the same
+ * wlr_cursor path as any other device. It measures how long events from
+ * another thread wait behind a busy main loop; the compositor itself has
+ * no use for it, wlroots reads libinput on the main loop.
+ */
+struct bench_input_ring {
+	struct wlr_input_device *device;
+	int fd;
+	struct wl_event_source *source;
+	/* head is only written by the producer, tail by the main loop */
+	uint32_t head;
+	uint32_t tail;
+	uint64_t dropped;
+	uint64_t events;
+	/* From an event to the pointer frame clients saw it in */
+	struct wet_histogram latency;
+	struct bench_input_event ring[INPUT_RING_SIZE];
+};
+
+struct bench_options {
+	int clients;
+	int rate;
+	int width, height;
+	int outputs;
+	int duration;
+	int motion_rate;
+	/* Same motion from a thread, through an input ring */
+	int thread_motion_rate;
+	int hit_tests;
+	bool fullscreen;
+	/* Milliseconds between HMI mode switches, 0 for xdg clients */
+	int hmi_switch_interval;
+	/* wet_output_spec, replaces the -o outputs when not empty */
+	struct wl_array output_specs;
+};
+
+struct bench {
+	struct wet_server server;
+	struct bench_options options;
+
+	struct wl_listener new_output;
+	struct wl_listener new_xdg_surface;
+	struct wl_list outputs;
+	struct wl_list surfaces;
+	int placed;
+
+	/* uint64_t nanoseconds */
+	struct wl_array latencies;
+	struct wl_array input_latencies;
+
+	struct wlr_input_device *pointer;
+	struct wl_event_source *motion_timer;
+	uint32_t motion_step;
+	struct bench_input_ring *input_ring;
+	pthread_t input_thread;
+	bool input_thread_running;
+	int input_thread_stop;
+
+	/* HMI mode switches, see bench_switch_timer() */
+	struct wl_event_source *switch_timer;
+	uint32_t hmi_mode;
+	/* Switch waiting for an output commit, then for its presentation */
+	struct timespec switch_time;
+	bool switch_latched;
+	struct wl_array switch_latencies;
+	struct wl_array switch_dispatch;
+	uint64_t switch_late;
+
+	struct wl_event_source *end_timer;
+	struct timespec start;
+	struct rusage start_usage;
+	pid_t *pids;
+};
+
+struct bench_output {
+	struct wl_list link;
+	struct bench *bench;
+	struct wlr_output *wlr_output;
+	struct wl_listener commit;
+	struct wl_listener present;
+	struct wl_listener destroy;
+	uint64_t frames;
+};
+
+struct bench_surface {
+	struct wl_list link;
+	struct bench *bench;
+	struct wlr_surface *surface;
+	struct wl_listener commit;
+	struct wl_listener destroy;
+	/* Oldest commit not yet picked up by an output commit */
+	struct timespec pending;
+	/* Oldest commit picked up by an output commit, not yet presented */
+	struct timespec latched;
+};
+
+static int64_t timespec_sub_to_nsec(const struct timespec *a,
+		const struct timespec *b) {
+	return (int64_t)(a->tv_sec - b->tv_sec) * 1000000000LL +
+		(a->tv_nsec - b->tv_nsec);
+}
+
+static bool surface_on_output(struct wlr_surface *surface,
+		struct wlr_output *output) {
+	struct wlr_surface_output *surface_output;
+
+	wl_list_for_each(surface_output, &surface->current_outputs, link) {
+		if (surface_output->output == output)
+			return true;
+	}
+	return false;
+}
+
+static void bench_output_commit(struct wl_listener *listener, void *data)
+{
+	struct bench_output *output = wl_container_of(listener, output, commit);
+	struct bench_surface *surface;
+	struct bench *bench = output->bench;
+
+	/* The ivi screens are on the first output */
+	if (bench->switch_time.tv_sec != 0 &&
+			output->link.prev == &bench->outputs)
+		bench->switch_latched = true;
+
+	/* Whatever the clients committed so far is now on its way to scanout */
+	wl_list_for_each(surface, &output->bench->surfaces, link) {
+		if (surface->pending.tv_sec == 0 ||
+				!surface_on_output(surface->surface, output->wlr_output))
+			continue;
+		if (surface->latched.tv_sec == 0)
+			surface->latched = surface->pending;
+		surface->pending.tv_sec = 0;
+	}
+}
+
+static void bench_output_present(struct wl_listener *listener, void *data)
+{
+	struct bench_output *output = wl_container_of(listener, output, present);
+	struct wlr_output_event_present *event = data;
+	struct bench *bench = output->bench;
+	struct bench_surface *surface;
+	uint64_t *latency;
+
+	if (event->when == NULL)
+		return;
+
+	output->frames++;
+	if (bench->switch_latched && output->link.prev == &bench->outputs) {
+		latency = wl_array_add(&bench->switch_latencies,
+			sizeof(*latency));
+		if (latency)
+			*latency = timespec_sub_to_nsec(event->when,
+				&bench->switch_time);
+		/* The switch missed the first vblank after it */
+		if (event->refresh > 0 && timespec_sub_to_nsec(event->when,
+				&bench->switch_time) > event->refresh)
+			bench->switch_late++;
+		bench->switch_time.tv_sec = 0;
+		bench->switch_latched = false;
+	}
+	wl_list_for_each(surface, &output->bench->surfaces, link) {
+		if (surface->latched.tv_sec == 0 ||
+				!surface_on_output(surface->surface, output->wlr_output))
+			continue;
+		latency = wl_array_add(&output->bench->latencies,
+			sizeof(*latency));
+		if (latency)
+			*latency = timespec_sub_to_nsec(event->when,
+				&surface->latched);
+		surface->latched.tv_sec = 0;
+	}
+}
+
+static void bench_output_destroy(struct wl_listener *listener, void *data)
+{
+	struct bench_output *output = wl_container_of(listener, output, destroy);
+
+	wl_list_remove(&output->commit.link);
+	wl_list_remove(&output->present.link);
+	wl_list_remove(&output->destroy.link);
+	wl_list_remove(&output->link);
+	free(output);
+}
+
+static void bench_new_output(struct wl_listener *listener, void *data)
+{
+	struct bench *bench = wl_container_of(listener, bench, new_output);
+	struct wlr_output *wlr_output = data;
+	struct bench_output *output = calloc(1, sizeof(*output));
+
+	if (!output)
+		return;
+	output->bench = bench;
+	output->wlr_output = wlr_output;
+	output->commit.notify = bench_output_commit;
+	wl_signal_add(&wlr_output->events.commit, &output->commit);
+	output->present.notify = bench_output_present;
+	wl_signal_add(&wlr_output->events.present, &output->present);
+	output->destroy.notify = bench_output_destroy;
+	wl_signal_add(&wlr_output->events.destroy, &output->destroy);
+	wl_list_insert(bench->outputs.prev, &output->link);
+}
+
+static void bench_surface_commit(struct wl_listener *listener, void *data)
+{
+	struct bench_surface *surface = wl_container_of(listener, surface, commit);
+
+	if (surface->pending.tv_sec == 0)
+		clock_gettime(CLOCK_MONOTONIC, &surface->pending);
+}
+
+static void bench_surface_destroy(struct wl_listener *listener, void *data)
+{
+	struct bench_surface *surface = wl_container_of(listener, surface, destroy);
+
+	wl_list_remove(&surface->commit.link);
+	wl_list_remove(&surface->destroy.link);
+	wl_list_remove(&surface->link);
+	free(surface);
+}
+
+static void bench_place_view(struct bench *bench, struct wet_view *view)
+{
+	struct bench_output *output;
+	struct wlr_box *box;
+	int n = wl_list_length(&bench->outputs);
+	int index, i = 0;
+
+	if (n == 0)
+		return;
+
+	/* Spread the clients over all outputs, cascading on each of them */
+	index = bench->placed % n;
+	wl_list_for_each(output, &bench->outputs, link) {
+		if (i++ == index)
+			break;
+	}
+	box = wlr_output_layout_get_box(bench->server.output_layout,
+		output->wlr_output);
+	if (!box)
+		return;
+
+	view_set_position(view,
+		box->x + (bench->placed / n) * 32 % (box->width / 2 + 1),
+		box->y + (bench->placed / n) * 32 % (box->height / 2 + 1));
+	bench->placed++;
+}
+
+static void bench_new_xdg_surface(struct wl_listener *listener, void *data)
+{
+	/* Runs after server_new_xdg_surface(), so the view already exists */
+	struct bench *bench = wl_container_of(listener, bench, new_xdg_surface);
+	struct wlr_xdg_surface *xdg_surface = data;
+	struct wlr_scene_node *node = xdg_surface->data;
+	struct bench_surface *surface;
+
+	if (xdg_surface->role != WLR_XDG_SURFACE_ROLE_TOPLEVEL)
+		return;
+
+	bench_place_view(bench, node->data);
+
+	surface = calloc(1, sizeof(*surface));
+	if (!surface)
+		return;
+	surface->bench = bench;
+	surface->surface = xdg_surface->surface;
+	surface->commit.notify = bench_surface_commit;
+	wl_signal_add(&xdg_surface->surface->events.commit, &surface->commit);
+	surface->destroy.notify = bench_surface_destroy;
+	wl_signal_add(&xdg_surface->surface->events.destroy, &surface->destroy);
+	wl_list_insert(&bench->surfaces, &surface->link);
+}
+
+static int motion_interval(struct bench *bench)
+{
+	int interval = 1000 / bench->options.motion_rate;
+
+	return interval > 0 ? interval : 1;
+}
+
+/* A small circle of relative motion */
+static const int motion_dx[] = { 4, 3, 0, -3, -4, -3, 0, 3 };
+static const int motion_dy[] = { 0, 3, 4, 3, 0, -3, -4, -3 };
+
+static int bench_motion_timer(void *data)
+{
+	/* Feed the circle through the headless pointer, which walks the same
+	 * wlr_cursor path as a real mouse. */
+	struct bench *bench = data;
+	struct wlr_pointer *pointer = bench->pointer->pointer;
+	struct wlr_event_pointer_motion event = { 0 };
+	struct timespec start, end;
+	uint64_t *latency;
+	int i = bench->motion_step++ % 8, j;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	event.device = bench->pointer;
+	event.time_msec = start.tv_sec * 1000 + start.tv_nsec / 1000000;
+	/* Like high-rate mice, pack several reports into one pointer frame */
+	event.delta_x = event.unaccel_dx = motion_dx[i] / 4.0;
+	event.delta_y = event.unaccel_dy = motion_dy[i] / 4.0;
+	for (j = 0; j < 4; j++)
+		wl_signal_emit(&pointer->events.motion, &event);
+	wl_signal_emit(&pointer->events.frame, pointer);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	latency = wl_array_add(&bench->input_latencies, sizeof(*latency));
+	if (latency)
+		*latency = timespec_sub_to_nsec(&end, &start);
+
+	wl_event_source_timer_update(bench->motion_timer,
+		motion_interval(bench));
+	return 0;
+}
+
+static void input_ring_dispatch(struct bench_input_ring *ring)
+{
+	struct wlr_pointer *pointer = ring->device->pointer;
+	uint32_t tail = ring->tail;
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	struct bench_input_event *event;
+	struct timespec now;
+	uint32_t time_msec;
+
+	while (tail != head) {
+		event = &ring->ring[tail % INPUT_RING_SIZE];
+		time_msec = event->time_nsec / 1000000;
+
+		switch (event->type) {
+		case BENCH_INPUT_MOTION:
+			wl_signal_emit(&pointer->events.motion,
+				&(struct wlr_event_pointer_motion){
+					.device = ring->device,
+					.time_msec = time_msec,
+					.delta_x = event->dx,
+					.delta_y = event->dy,
+					.unaccel_dx = event->dx,
+					.unaccel_dy = event->dy,
+				});
+			break;
+		case BENCH_INPUT_BUTTON:
+			wl_signal_emit(&pointer->events.button,
+				&(struct wlr_event_pointer_button){
+					.device = ring->device,
+					.time_msec = time_msec,
+					.button = event->button,
+					.state = event->pressed ?
+						WLR_BUTTON_PRESSED :
+						WLR_BUTTON_RELEASED,
+				});
+			break;
+		case BENCH_INPUT_FRAME:
+			wl_signal_emit(&pointer->events.frame, pointer);
+			/* A frame is when clients see the motion */
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			histogram_add(&ring->latency,
+				(int64_t)now.tv_sec * 1000000000 +
+				now.tv_nsec - event->time_nsec);
+			break;
+		}
+		ring->events++;
+
+		/* Hand the slot back before the next one, a busy producer
+		 * shouldn't see a full ring because we are slow */
+		__atomic_store_n(&ring->tail, ++tail, __ATOMIC_RELEASE);
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	}
+}
+
+static int input_ring_handle(int fd, uint32_t mask, void *data)
+{
+	struct bench_input_ring *ring = data;
+	uint64_t count;
+
+	if (read(ring->fd, &count, sizeof(count)) < 0)
+		return 0;
+	input_ring_dispatch(ring);
+
+	return 0;
+}
+
+static struct bench_input_ring *input_ring_create(struct wet_server *server,
+		struct wlr_input_device *device)
+{
+	struct bench_input_ring *ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ring->fd < 0) {
+		free(ring);
+		return NULL;
+	}
+	ring->source = wl_event_loop_add_fd(
+		wl_display_get_event_loop(server->wl_display), ring->fd,
+		WL_EVENT_READABLE, input_ring_handle, ring);
+	if (!ring->source) {
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+
+	ring->device = device;
+	return ring;
+}
+
+static bool input_ring_push(struct bench_input_ring *ring,
+		const struct bench_input_event *event)
+{
+	/* Producer side, safe from one thread other than the main one */
+	static const uint64_t one = 1;
+	uint32_t head = ring->head;
+	ssize_t ret;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+			INPUT_RING_SIZE) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	ring->ring[head % INPUT_RING_SIZE] = *event;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	/* Wakes the main loop, further writes just add up. Should it fail,
+	 * the event goes out with the next wakeup. */
+	ret = write(ring->fd, &one, sizeof(one));
+	(void)ret;
+
+	return true;
+}
+
+static void input_ring_destroy(struct bench_input_ring *ring)
+{
+	/* The producer must be stopped by now */
+	wl_event_source_remove(ring->source);
+	close(ring->fd);
+	free(ring);
+}
+
+static void *bench_input_thread(void *data)
+{
+	/* The same circle from a thread standing in for a device. Unlike the
+	 * motion timer, which only fires once the main loop gets to it, this
+	 * also sees the time events wait behind a busy main loop. */
+	struct bench *bench = data;
+	struct bench_input_event event = { 0 };
+	int64_t interval = 1000000000LL / bench->options.thread_motion_rate;
+	struct timespec next, now;
+	uint32_t step = 0;
+	int i, j;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!__atomic_load_n(&bench->input_thread_stop, __ATOMIC_RELAXED)) {
+		next.tv_nsec += interval;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		i = step++ % 8;
+		event.time_nsec = (uint64_t)now.tv_sec * 1000000000 +
+			now.tv_nsec;
+		event.type = BENCH_INPUT_MOTION;
+		event.dx = motion_dx[i] / 4.0;
+		event.dy = motion_dy[i] / 4.0;
+		for (j = 0; j < 4; j++)
+			input_ring_push(bench->input_ring, &event);
+		event.type = BENCH_INPUT_FRAME;
+		input_ring_push(bench->input_ring, &event);
+	}
+
+	return NULL;
+}
+
+static int bench_switch_timer(void *data)
+{
+	/* Cycle through the HMI layout modes once all clients are up. A
+	 * switch still waiting for its frame is left to finish. */
+	struct bench *bench = data;
+	struct wet_server *server = &bench->server;
+	struct timespec start, end;
+	uint64_t *dispatch;
+
+	wl_event_source_timer_update(bench->switch_timer,
+		bench->options.hmi_switch_interval);
+	if (hmi_surface_count(server) < bench->options.clients ||
+			bench->switch_time.tv_sec != 0)
+		return 0;
+
+	bench->hmi_mode = (bench->hmi_mode + 1) % 4;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	hmi_switch_mode(server, bench->hmi_mode);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	bench->switch_time = start;
+	dispatch = wl_array_add(&bench->switch_dispatch, sizeof(*dispatch));
+	if (dispatch)
+		*dispatch = timespec_sub_to_nsec(&end, &start);
+	return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_percentiles(const char *name, struct wl_array *array)
+{
+	uint64_t *values = array->data;
+	size_t n = array->size / sizeof(*values);
+
+	if (n == 0) {
+		printf("%s: no samples\n", name);
+		return;
+	}
+
+	qsort(values, n, sizeof(*values), compare_u64);
+	printf("%s (ms): p50 %.3f p90 %.3f p99 %.3f max %.3f (%zu samples)\n",
+	       name, values[n * 50 / 100] / 1e6, values[n * 90 / 100] / 1e6,
+	       values[n * 99 / 100] / 1e6, values[n - 1] / 1e6, n);
+}
+
+/* Compares the spatial index against walking the whole scene graph on the
+ * same random points of the layout. */
+static void bench_hit_test(struct bench *bench)
+{
+	struct wet_server *server = &bench->server;
+	struct wlr_box *layout = wlr_output_layout_get_box(server->output_layout,
+		NULL);
+	struct wlr_surface *surface;
+	struct wet_view *a, *b;
+	struct timespec t0, t1, t2;
+	int64_t index_nsec = 0, scene_nsec = 0;
+	int mismatches = 0;
+	double x, y, sx, sy;
+	int i, n = bench->options.hit_tests;
+
+	if (!layout || wlr_box_empty(layout))
+		return;
+
+	srand(1);
+	for (i = 0; i < n; i++) {
+		x = layout->x + (double)rand() / RAND_MAX * layout->width;
+		y = layout->y + (double)rand() / RAND_MAX * layout->height;
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		a = desktop_view_at(server, x, y, &surface, &sx, &sy);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		b = desktop_view_at_scene(server, x, y, &surface, &sx, &sy);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		index_nsec += timespec_sub_to_nsec(&t1, &t0);
+		scene_nsec += timespec_sub_to_nsec(&t2, &t1);
+		if (a != b)
+			mismatches++;
+	}
+
+	printf("hit-test over %d views: index %.0f ns, scene walk %.0f ns "
+	       "per lookup, %d mismatches\n",
+	       wl_list_length(&server->views), (double)index_nsec / n,
+	       (double)scene_nsec / n, mismatches);
+}
+
+static void bench_report(struct bench *bench)
+{
+	struct bench_output *output;
+	struct rusage usage;
+	struct timespec now;
+	double elapsed, cpu;
+	uint64_t frames = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	getrusage(RUSAGE_SELF, &usage);
+	elapsed = timespec_sub_to_nsec(&now, &bench->start) / 1e9;
+	cpu = (usage.ru_utime.tv_sec - bench->start_usage.ru_utime.tv_sec) +
+		(usage.ru_stime.tv_sec - bench->start_usage.ru_stime.tv_sec) +
+		((usage.ru_utime.tv_usec - bench->start_usage.ru_utime.tv_usec) +
+		 (usage.ru_stime.tv_usec - bench->start_usage.ru_stime.tv_usec)) / 1e6;
+
+	printf("weston-pro-bench: %d clients at %d Hz, %dx%d, %d outputs, %.1f s\n",
+	       bench->options.clients, bench->options.rate,
+	       bench->options.width, bench->options.height,
+	       bench->options.outputs, elapsed);
+
+	wl_list_for_each(output, &bench->outputs, link) {
+		printf("output %s (%dx%d@%.2f): %.1f frames/s\n",
+		       output->wlr_output->name, output->wlr_output->width,
+		       output->wlr_output->height,
+		       output->wlr_output->refresh / 1000.0,
+		       output->frames / elapsed);
+		frames += output->frames;
+	}
+
+	print_percentiles("commit-to-present latency", &bench->latencies);
+	if (bench->options.motion_rate > 0)
+		print_percentiles("pointer motion dispatch",
+			&bench->input_latencies);
+	if (bench->input_ring) {
+		printf("input ring: %" PRIu64 " events, %" PRIu64 " dropped\n",
+		       bench->input_ring->events,
+		       __atomic_load_n(&bench->input_ring->dropped,
+				__ATOMIC_RELAXED));
+		histogram_print(stdout, "pointer event to frame",
+			&bench->input_ring->latency);
+	}
+	if (bench->options.hmi_switch_interval > 0) {
+		print_percentiles("hmi mode switch dispatch",
+			&bench->switch_dispatch);
+		print_percentiles("hmi mode switch to present",
+			&bench->switch_latencies);
+		printf("hmi mode switches later than one refresh: %" PRIu64
+		       "\n", bench->switch_late);
+	}
+
+	printf("cpu time per frame: %.3f ms\n",
+	       frames > 0 ? cpu * 1e3 / frames : 0.0);
+	/* Wall clock, what the render threads bring down */
+	printf("render time per frame: %.3f ms on %d threads\n",
+	       bench->server.stats.render_time.count > 0 ?
+	       bench->server.stats.render_time.sum_nsec / 1e6 /
+	       bench->server.stats.render_time.count : 0.0,
+	       bench->server.render_pool ? bench->server.render_threads : 1);
+	printf("peak rss: %ld KiB\n", usage.ru_maxrss);
+	server_dump_stats(&bench->server, stdout);
+}
+
+static int bench_end_timer(void *data)
+{
+	struct bench *bench = data;
+
+	bench_report(bench);
+	if (bench->options.hit_tests > 0)
+		bench_hit_test(bench);
+	server_terminate(&bench->server);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options]\n"
+	       "  -n <count>\tnumber of clients (default 4)\n"
+	       "  -r <hz>\tcommits per second per client (default 60)\n"
+	       "  -s <w>x<h>\tclient size (default 256x256)\n"
+	       "  -o <count>\tnumber of headless outputs (default 1)\n"
+	       "  -O <w>x<h>[@<hz>][+<x>,<y>]\n"
+	       "\t\tadd an output with this mode instead, can be repeated\n"
+	       "  -d <seconds>\tduration (default 10)\n"
+	       "  -m <hz>\tsynthetic pointer motion rate (default off)\n"
+	       "  -M <hz>\tthe same from an input thread (default off)\n"
+	       "  -H <count>\trandom hit-tests to time at the end (default off)\n"
+	       "  -w <ms>\trepaint window (default 7)\n"
+	       "  -b <fps>\tframe callback cap for unfocused views (default off)\n"
+	       "  -T\t\ttile the clients\n"
+	       "  -c\t\tcoalesce pointer motion until the pointer frame\n"
+	       "  -F\t\tclients go fullscreen, to exercise direct scanout\n"
+	       "  -I <ms>\tivi clients under the HMI controller, switching\n"
+	       "\t\tlayout mode every <ms>\n"
+	       "  -j <count>\tthreads compositing frames (default 1)\n"
+	       "  -x <file>\twrite a Chrome JSON trace of the run to <file>\n"
+	       "  -W <ms>\treport event loop dispatches taking longer\n",
+	       name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench bench = {
+		.options = {
+			.clients = 4,
+			.rate = 60,
+			.width = 256,
+			.height = 256,
+			.outputs = 1,
+			.duration = 10,
+		},
+	};
+	struct wet_server *server = &bench.server;
+	struct wet_output_spec *spec;
+	struct wl_event_loop *loop;
+	char outputs[16];
+	int i, c;
+
+	server->repaint_window = 7;
+	server->transaction_timeout = 200;
+	wl_array_init(&bench.options.output_specs);
+
+	while ((c = getopt(argc, argv, "n:r:s:o:O:d:m:M:H:w:b:TcFI:j:x:W:h")) != -1) {
+		switch (c) {
+		case 'n':
+			bench.options.clients = atoi(optarg);
+			break;
+		case 'r':
+			bench.options.rate = atoi(optarg);
+			break;
+		case 's':
+			if (sscanf(optarg, "%dx%d", &bench.options.width,
+					&bench.options.height) != 2) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			bench.options.outputs = atoi(optarg);
+			break;
+		case 'O':
+			spec = wl_array_add(&bench.options.output_specs,
+				sizeof(*spec));
+			if (!spec || !output_parse_spec(optarg, spec)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'd':
+			bench.options.duration = atoi(optarg);
+			break;
+		case 'm':
+			bench.options.motion_rate = atoi(optarg);
+			break;
+		case 'M':
+			bench.options.thread_motion_rate = atoi(optarg);
+			break;
+		case 'H':
+			bench.options.hit_tests = atoi(optarg);
+			break;
+		case 'w':
+			server->repaint_window = atoi(optarg);
+			break;
+		case 'b':
+			server->background_fps = atoi(optarg);
+			break;
+		case 'T':
+			server->tiling = true;
+			break;
+		case 'c':
+			server->coalesce_motion = true;
+			break;
+		case 'F':
+			bench.options.fullscreen = true;
+			break;
+		case 'I':
+			bench.options.hmi_switch_interval = atoi(optarg);
+			server->hmi_enabled =
+				bench.options.hmi_switch_interval > 0;
+			break;
+		case 'j':
+			server->render_threads = atoi(optarg);
+			break;
+		case 'x':
+			if (!trace_init(optarg, false))
+				return EXIT_FAILURE;
+			break;
+		case 'W':
+			server->stall_threshold = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		}
+	}
+	if (bench.options.width <= 0 || bench.options.height <= 0 ||
+			bench.options.outputs <= 0 || bench.options.duration <= 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Force the headless backend and the pixman renderer, whatever the
+	 * environment we were started from looks like. */
+	if (bench.options.output_specs.size > 0)
+		bench.options.outputs = 0;
+	snprintf(outputs, sizeof(outputs), "%d", bench.options.outputs);
+	setenv("WLR_BACKENDS", "headless", true);
+	setenv("WLR_RENDERER", "pixman", true);
+	setenv("WLR_HEADLESS_OUTPUTS", outputs, true);
+
+	wl_list_init(&bench.outputs);
+	wl_list_init(&bench.surfaces);
+	wl_array_init(&bench.latencies);
+	wl_array_init(&bench.input_latencies);
+	wl_array_init(&bench.switch_latencies);
+	wl_array_init(&bench.switch_dispatch);
+
+	server->wl_display = wl_display_create();
+	if (!server->wl_display) {
+		printf("fatal: failed to create display\n");
+		return EXIT_FAILURE;
+	}
+	loop = wl_display_get_event_loop(server->wl_display);
+
+	clock_gettime(CLOCK_MONOTONIC, &server->startup.start);
+	if (!server_listen(server, -1) || !server_init(server))
+		return EXIT_FAILURE;
+
+	bench.new_output.notify = bench_new_output;
+	wl_signal_add(&server->backend->events.new_output, &bench.new_output);
+	bench.new_xdg_surface.notify = bench_new_xdg_surface;
+	wl_signal_add(&server->xdg_shell->events.new_surface,
+		&bench.new_xdg_surface);
+
+	if (!server_start(server))
+		return EXIT_FAILURE;
+
+	wl_array_for_each(spec, &bench.options.output_specs) {
+		if (!output_add_virtual(server, spec)) {
+			printf("failed to create a %dx%d output\n",
+			       spec->width, spec->height);
+			return EXIT_FAILURE;
+		}
+		bench.options.outputs++;
+	}
+
+	if (bench.options.motion_rate > 0 ||
+			bench.options.thread_motion_rate > 0) {
+		if (server->headless_backend)
+			bench.pointer = wlr_headless_add_input_device(
+				server->headless_backend,
+				WLR_INPUT_DEVICE_POINTER);
+		if (!bench.pointer) {
+			printf("failed to create the synthetic pointer\n");
+			return EXIT_FAILURE;
+		}
+	}
+	if (bench.options.motion_rate > 0) {
+		bench.motion_timer = wl_event_loop_add_timer(loop,
+			bench_motion_timer, &bench);
+		wl_event_source_timer_update(bench.motion_timer,
+			motion_interval(&bench));
+	}
+	if (bench.options.thread_motion_rate > 0) {
+		bench.input_ring = input_ring_create(server, bench.pointer);
+		if (!bench.input_ring) {
+			printf("failed to create the input ring\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (bench.options.hmi_switch_interval > 0) {
+		bench.switch_timer = wl_event_loop_add_timer(loop,
+			bench_switch_timer, &bench);
+		wl_event_source_timer_update(bench.switch_timer,
+			bench.options.hmi_switch_interval);
+	}
+
+	fflush(stdout);
+	bench.pids = calloc(bench.options.clients, sizeof(pid_t));
+	for (i = 0; i < bench.options.clients; i++) {
+		struct bench_client_options client = {
+			.id = i,
+			.width = bench.options.width,
+			.height = bench.options.height,
+			.rate = bench.options.rate,
+			.fullscreen = bench.options.fullscreen,
+			/* Application ids, nothing places them */
+			.ivi_id = bench.options.hmi_switch_interval > 0 ?
+				0x10000 + i : 0,
+		};
+
+		bench.pids[i] = fork();
+		if (bench.pids[i] == 0)
+			_exit(bench_client_run(&client));
+	}
+
+	/* After forking, the clients don't need a copy of it */
+	if (bench.input_ring) {
+		if (pthread_create(&bench.input_thread, NULL,
+				bench_input_thread, &bench) != 0) {
+			printf("failed to start the input thread\n");
+			return EXIT_FAILURE;
+		}
+		bench.input_thread_running = true;
+	}
+
+	bench.end_timer = wl_event_loop_add_timer(loop, bench_end_timer, &bench);
+	wl_event_source_timer_update(bench.end_timer,
+		bench.options.duration * 1000);
+	clock_gettime(CLOCK_MONOTONIC, &bench.start);
+	getrusage(RUSAGE_SELF, &bench.start_usage);
+
+	server_run(server);
+
+	if (bench.input_thread_running) {
+		__atomic_store_n(&bench.input_thread_stop, 1, __ATOMIC_RELAXED);
+		pthread_join(bench.input_thread, NULL);
+	}
+	if (bench.input_ring)
+		input_ring_destroy(bench.input_ring);
+
+	for (i = 0; i < bench.options.clients; i++) {
+		if (bench.pids[i] > 0) {
+			kill(bench.pids[i], SIGTERM);
+			waitpid(bench.pids[i], NULL, 0);
+		}
+	}
+	free(bench.pids);
+
+	ipc_finish(server);
+	metrics_finish(server);
+	wl_display_destroy_clients(server->wl_display);
+	wl_display_destroy(server->wl_display);
+	render_finish(server);
+	watchdog_finish(server);
+	trace_dump();
+	trace_finish();
+	wl_array_release(&bench.latencies);
+	wl_array_release(&bench.input_latencies);
+	wl_array_release(&bench.switch_latencies);
+	wl_array_release(&bench.switch_dispatch);
+
+	return EXIT_SUCCESS;
+}
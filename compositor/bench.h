@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#ifndef WESTON_BENCH_H
+#define WESTON_BENCH_H
+
+#include <stdbool.h>
+
+struct bench_client_options {
+	int id;
+	int width, height;
+	/* Commits per second */
+	int rate;
+	/* Ask for fullscreen and follow the size the compositor configures */
+	bool fullscreen;
+	/* Non-zero: an ivi surface with this id instead of a toplevel, which
+	 * follows the size the compositor configures */
+	uint32_t ivi_id;
+};
+
+/* Runs a synthetic xdg-shell or ivi-application client against $WAYLAND_DISPLAY until the
+ * compositor goes away. Meant to be called in a forked child. */
+int bench_client_run(const struct bench_client_options *options);
+
+#endif
@@ -0,0 +1,447 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <weston-pro.h>
+
+/*
+ * Every client is accounted for its surfaces, the scene nodes we create for
+ * it, its wl_shm pools and the buffers attached to its surfaces, so a
+ * runaway one can be spotted (stats, "clients" on the control socket) and
+ * stopped. Past the soft limit of a resource we warn once; an increase past
+ * the hard limit disconnects the client with a no_memory error instead of
+ * being honoured.
+ *
+ * wl_shm lives in libwayland, pool sizes are seen through a protocol logger
+ * which returns right away for anything but create_pool and resize. A
+ * logger can't refuse a request: a pool past the hard limit still gets
+ * created and mapped, the client is disconnected right after.
+ */
+
+/* Request opcodes, only the client headers name them */
+#define SHM_CREATE_POOL 0
+#define SHM_POOL_RESIZE 2
+
+static const char *const resource_names[WET_CLIENT_RESOURCE_COUNT] = {
+	[WET_CLIENT_SURFACES] = "surfaces",
+	[WET_CLIENT_NODES] = "nodes",
+	[WET_CLIENT_SHM_BYTES] = "shm",
+	[WET_CLIENT_BUFFER_BYTES] = "buffers",
+};
+
+struct wet_client_pool {
+	struct wet_server *server;
+	int32_t size;
+	struct wl_listener destroy;
+};
+
+struct wet_client_surface {
+	struct wet_server *server;
+	struct wlr_surface *surface;
+	uint64_t buffer_bytes;
+	struct wl_listener commit;
+	struct wl_listener destroy;
+};
+
+static void client_destroy(struct wl_listener *listener, void *data)
+{
+	/* Runs before the client's resources are destroyed, their accounting
+	 * finds no client and is dropped */
+	struct wet_client *client = wl_container_of(listener, client, destroy);
+
+	wl_list_remove(&client->destroy.link);
+	wl_list_remove(&client->resource_created.link);
+	wl_list_remove(&client->link);
+	free(client);
+}
+
+static struct wet_client *client_find(struct wl_client *wl_client)
+{
+	/* Our destroy listener doubles as the lookup key */
+	struct wet_client *client;
+	struct wl_listener *listener;
+
+	listener = wl_client_get_destroy_listener(wl_client, client_destroy);
+	if (!listener)
+		return NULL;
+	return wl_container_of(listener, client, destroy);
+}
+
+static void client_pool_destroy(struct wl_listener *listener, void *data)
+{
+	struct wet_client_pool *pool = wl_container_of(listener, pool, destroy);
+	struct wl_resource *resource = data;
+
+	client_account(pool->server, wl_resource_get_client(resource),
+		WET_CLIENT_SHM_BYTES, -(int64_t)pool->size);
+	wl_list_remove(&pool->destroy.link);
+	free(pool);
+}
+
+static void client_resource_created(struct wl_listener *listener, void *data)
+{
+	/* The size was seen by the logger right before the request ran */
+	struct wet_client *client =
+		wl_container_of(listener, client, resource_created);
+	struct wl_resource *resource = data;
+	struct wet_client_pool *pool;
+
+	if (wl_resource_get_class(resource) != wl_shm_pool_interface.name)
+		return;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return;
+	pool->server = client->server;
+	pool->size = client->pending_pool_size;
+	pool->destroy.notify = client_pool_destroy;
+	wl_resource_add_destroy_listener(resource, &pool->destroy);
+	client->pending_pool_size = 0;
+}
+
+struct wet_client *client_get(struct wet_server *server,
+		struct wl_client *wl_client)
+{
+	struct wet_client *client;
+
+	client = client_find(wl_client);
+	if (client)
+		return client;
+
+	client = calloc(1, sizeof(*client));
+	if (!client)
+		return NULL;
+	client->server = server;
+	client->wl_client = wl_client;
+	wl_client_get_credentials(wl_client, &client->pid, NULL, NULL);
+	client->destroy.notify = client_destroy;
+	wl_client_add_destroy_listener(wl_client, &client->destroy);
+	client->resource_created.notify = client_resource_created;
+	wl_client_add_resource_created_listener(wl_client,
+		&client->resource_created);
+	wl_list_insert(server->clients.prev, &client->link);
+
+	return client;
+}
+
+bool client_account(struct wet_server *server, struct wl_client *wl_client,
+		enum wet_client_resource resource, int64_t delta)
+{
+	const struct wet_client_limit *limit = &server->client_limits[resource];
+	struct wet_client *client;
+	uint64_t usage;
+
+	if (delta == 0)
+		return true;
+	/* A client going away is not looked up again */
+	client = delta > 0 ? client_get(server, wl_client) :
+		client_find(wl_client);
+	if (!client)
+		return true;
+
+	if (delta < 0 && (uint64_t)-delta > client->usage[resource])
+		usage = 0;
+	else
+		usage = client->usage[resource] + delta;
+
+	if (delta > 0 && limit->hard && usage > limit->hard) {
+		printf("client %d: %s over the hard limit of %" PRIu64
+		       ", disconnecting\n", (int)client->pid,
+		       resource_names[resource], limit->hard);
+		ipc_send_event(server, "client-killed %d %s", (int)client->pid,
+			resource_names[resource]);
+		wl_client_post_no_memory(wl_client);
+		return false;
+	}
+
+	client->usage[resource] = usage;
+	if (usage > client->peak[resource])
+		client->peak[resource] = usage;
+
+	if (limit->soft && usage > limit->soft) {
+		if (!client->over_soft[resource]) {
+			client->over_soft[resource] = true;
+			printf("client %d: %s at %" PRIu64 ", over the soft "
+			       "limit of %" PRIu64 "\n", (int)client->pid,
+			       resource_names[resource], usage, limit->soft);
+			ipc_send_event(server, "client-limit %d %s %" PRIu64,
+				(int)client->pid, resource_names[resource],
+				usage);
+		}
+	} else {
+		client->over_soft[resource] = false;
+	}
+	return true;
+}
+
+static void client_shm_logger(void *user_data,
+		enum wl_protocol_logger_type direction,
+		const struct wl_protocol_logger_message *message)
+{
+	/* Called for every request and event, keep the common case short */
+	struct wet_server *server = user_data;
+	const char *class;
+	struct wl_listener *listener;
+	struct wet_client_pool *pool;
+	struct wet_client *client;
+	int32_t size;
+
+	if (direction != WL_PROTOCOL_LOGGER_REQUEST)
+		return;
+	class = wl_resource_get_class(message->resource);
+
+	if (class == wl_shm_interface.name &&
+			message->message_opcode == SHM_CREATE_POOL) {
+		size = message->arguments[2].i;
+		if (size <= 0)
+			return;
+		/* Counted before libwayland runs the request, the resource
+		 * picks it up. Over the limit this only marks the client for
+		 * disconnection, the pool is still created and mapped. */
+		client = client_get(server,
+			wl_resource_get_client(message->resource));
+		if (!client)
+			return;
+		/* The last one never got its resource, it failed */
+		if (client->pending_pool_size) {
+			client_account(server, client->wl_client,
+				WET_CLIENT_SHM_BYTES, -client->pending_pool_size);
+			client->pending_pool_size = 0;
+		}
+		if (client_account(server, client->wl_client,
+				WET_CLIENT_SHM_BYTES, size))
+			client->pending_pool_size = size;
+	} else if (class == wl_shm_pool_interface.name &&
+			message->message_opcode == SHM_POOL_RESIZE) {
+		listener = wl_resource_get_destroy_listener(message->resource,
+			client_pool_destroy);
+		if (!listener)
+			return;
+		pool = wl_container_of(listener, pool, destroy);
+		size = message->arguments[0].i;
+		/* Pools only grow, libwayland rejects the rest */
+		if (size > pool->size && client_account(server,
+				wl_resource_get_client(message->resource),
+				WET_CLIENT_SHM_BYTES, size - pool->size))
+			pool->size = size;
+	}
+}
+
+static void client_surface_commit(struct wl_listener *listener, void *data)
+{
+	/* Attached buffers, at 4 bytes per pixel */
+	struct wet_client_surface *client_surface =
+		wl_container_of(listener, client_surface, commit);
+	struct wlr_surface *surface = client_surface->surface;
+	uint64_t bytes = 0;
+
+	if (wlr_surface_has_buffer(surface))
+		bytes = (uint64_t)surface->current.buffer_width *
+			surface->current.buffer_height * 4;
+	if (bytes == client_surface->buffer_bytes)
+		return;
+	if (client_account(client_surface->server,
+			wl_resource_get_client(surface->resource),
+			WET_CLIENT_BUFFER_BYTES,
+			(int64_t)bytes - (int64_t)client_surface->buffer_bytes))
+		client_surface->buffer_bytes = bytes;
+}
+
+static void client_surface_destroy(struct wl_listener *listener, void *data)
+{
+	struct wet_client_surface *client_surface =
+		wl_container_of(listener, client_surface, destroy);
+	struct wl_client *wl_client =
+		wl_resource_get_client(client_surface->surface->resource);
+
+	client_account(client_surface->server, wl_client,
+		WET_CLIENT_BUFFER_BYTES, -(int64_t)client_surface->buffer_bytes);
+	client_account(client_surface->server, wl_client,
+		WET_CLIENT_SURFACES, -1);
+	wl_list_remove(&client_surface->commit.link);
+	wl_list_remove(&client_surface->destroy.link);
+	free(client_surface);
+}
+
+static void client_new_surface(struct wl_listener *listener, void *data)
+{
+	struct wet_server *server =
+		wl_container_of(listener, server, new_surface);
+	struct wlr_surface *surface = data;
+	struct wet_client_surface *client_surface;
+
+	if (!client_account(server, wl_resource_get_client(surface->resource),
+			WET_CLIENT_SURFACES, 1))
+		return;
+
+	client_surface = calloc(1, sizeof(*client_surface));
+	if (!client_surface) {
+		client_account(server, wl_resource_get_client(surface->resource),
+			WET_CLIENT_SURFACES, -1);
+		return;
+	}
+	client_surface->server = server;
+	client_surface->surface = surface;
+	client_surface->commit.notify = client_surface_commit;
+	wl_signal_add(&surface->events.commit, &client_surface->commit);
+	client_surface->destroy.notify = client_surface_destroy;
+	wl_signal_add(&surface->events.destroy, &client_surface->destroy);
+}
+
+static void client_created(struct wl_listener *listener, void *data)
+{
+	struct wet_server *server =
+		wl_container_of(listener, server, client_created);
+
+	client_get(server, data);
+}
+
+bool client_init(struct wet_server *server, struct wlr_compositor *compositor)
+{
+	if (!wl_display_add_protocol_logger(server->wl_display,
+			client_shm_logger, server)) {
+		printf("failed to add the wl_shm accounting logger\n");
+		return false;
+	}
+
+	server->client_created.notify = client_created;
+	wl_display_add_client_created_listener(server->wl_display,
+		&server->client_created);
+	server->new_surface.notify = client_new_surface;
+	wl_signal_add(&compositor->events.new_surface, &server->new_surface);
+	return true;
+}
+
+struct wl_client *client_launch(struct wet_server *server, const char *path)
+{
+	/* As in Weston, the client gets its end of a socketpair through
+	 * WAYLAND_SOCKET, so privileged globals can tell it by its wl_client */
+	struct wl_client *client;
+	char fd_str[12];
+	int sv[2], fd;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		printf("failed to create a socket for %s: %s\n", path,
+		       strerror(errno));
+		return NULL;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		printf("failed to start %s: %s\n", path, strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return NULL;
+	}
+	if (pid == 0) {
+		/* The duplicate is not close-on-exec */
+		fd = dup(sv[1]);
+		if (fd < 0)
+			_exit(EXIT_FAILURE);
+		snprintf(fd_str, sizeof(fd_str), "%d", fd);
+		setenv("WAYLAND_SOCKET", fd_str, 1);
+		execl(path, path, (void *)NULL);
+		_exit(EXIT_FAILURE);
+	}
+	close(sv[1]);
+
+	client = wl_client_create(server->wl_display, sv[0]);
+	if (!client) {
+		printf("failed to create a client for %s\n", path);
+		close(sv[0]);
+		return NULL;
+	}
+	return client;
+}
+
+static bool parse_size(const char *str, uint64_t *value)
+{
+	char *end;
+
+	errno = 0;
+	*value = strtoull(str, &end, 10);
+	if (errno || end == str || *str == '-')
+		return false;
+	switch (*end) {
+	case 'G':
+		*value <<= 10;
+		/* Fall through */
+	case 'M':
+		*value <<= 10;
+		/* Fall through */
+	case 'K':
+		*value <<= 10;
+		end++;
+		break;
+	}
+	return *end == '\0';
+}
+
+bool client_parse_limit(const char *spec, enum wet_client_resource *resource,
+		struct wet_client_limit *limit)
+{
+	const char *value = strchr(spec, '=');
+	char *copy, *hard;
+	bool ok;
+	int i;
+
+	if (!value)
+		return false;
+	for (i = 0; i < WET_CLIENT_RESOURCE_COUNT; i++) {
+		if (strlen(resource_names[i]) == (size_t)(value - spec) &&
+				strncmp(spec, resource_names[i], value - spec) == 0)
+			break;
+	}
+	if (i == WET_CLIENT_RESOURCE_COUNT)
+		return false;
+
+	copy = strdup(value + 1);
+	if (!copy)
+		return false;
+	hard = strchr(copy, ':');
+	if (hard)
+		*hard++ = '\0';
+	limit->hard = 0;
+	ok = parse_size(copy, &limit->soft) &&
+		(!hard || parse_size(hard, &limit->hard)) &&
+		(!limit->hard || limit->soft <= limit->hard);
+	free(copy);
+
+	*resource = i;
+	return ok;
+}
+
+void client_dump(struct wet_client *client, FILE *f)
+{
+	int i;
+
+	fprintf(f, "client %d:", (int)client->pid);
+	for (i = 0; i < WET_CLIENT_RESOURCE_COUNT; i++)
+		fprintf(f, " %s %" PRIu64 " (peak %" PRIu64 ")",
+			resource_names[i], client->usage[i], client->peak[i]);
+	fprintf(f, "\n");
+}
+
+void client_view_presented(struct wet_view *view, int64_t latency_nsec,
+		bool missed)
+{
+	struct wet_client *client = client_get(view->server,
+		wl_resource_get_client(view->xdg_surface->resource));
+
+	if (!client)
+		return;
+
+	histogram_add(&client->present_latency, latency_nsec);
+	client->presented++;
+	if (missed)
+		client->missed++;
+}
@@ -5,14 +5,15 @@
 
 #include <weston-pro.h>
 
-static struct wet_view *desktop_view_at(
+struct wet_view *desktop_view_at_scene(
 		struct wet_server *server, double lx, double ly,
 		struct wlr_surface **surface, double *sx, double *sy) {
 	/* This returns the topmost node in the scene at the given layout coords.
 	 * we only care about surface nodes as we are specifically looking for a
-	 * surface in the surface tree of a wet_view. */
+	 * surface in the surface tree of a wet_view. The view tree sits at the
+	 * origin, so layout coords are fine. */
 	struct wlr_scene_node *node = wlr_scene_node_at(
-		&server->scene->node, lx, ly, sx, sy);
+		&server->view_tree->node, lx, ly, sx, sy);
 	if (node == NULL || node->type != WLR_SCENE_NODE_SURFACE) {
 		return NULL;
 	}
@@ -22,15 +23,72 @@ static struct wet_view *desktop_view_at(
 	while (node != NULL && node->data == NULL) {
 		node = node->parent;
 	}
-	return node->data;
+	return node ? node->data : NULL;
+}
+
+static struct wlr_surface *layer_surface_at(struct wlr_scene_tree *tree,
+		double lx, double ly, double *sx, double *sy) {
+	/* The scene layers sit at the origin, layout coords are fine */
+	struct wlr_scene_node *node;
+
+	if (!tree->node.state.enabled ||
+			wl_list_empty(&tree->node.state.children)) {
+		return NULL;
+	}
+	node = wlr_scene_node_at(&tree->node, lx, ly, sx, sy);
+	if (node == NULL || node->type != WLR_SCENE_NODE_SURFACE) {
+		return NULL;
+	}
+	return wlr_scene_surface_from_node(node)->surface;
+}
+
+struct wet_view *desktop_view_at(
+		struct wet_server *server, double lx, double ly,
+		struct wlr_surface **surface, double *sx, double *sy) {
+	/* Only the views whose bounds contain the point are asked, see
+	 * spatial.c. The full scene walk is left for the rare case of more
+	 * views stacked on one point than the index looks at. The other
+	 * scene layers are asked in stacking order around the views, their
+	 * surfaces come back with a NULL view. Only the lock screen is
+	 * asked while locked. */
+	struct wet_view *view;
+
+	if (server->locked) {
+		*surface = layer_surface_at(server->lock_tree, lx, ly, sx, sy);
+		return NULL;
+	}
+
+	*surface = ivi_surface_at(server, lx, ly, sx, sy);
+	if (*surface)
+		return NULL;
+	*surface = layer_surface_at(server->panel_tree, lx, ly, sx, sy);
+	if (*surface)
+		return NULL;
+	if (!spatial_view_at(server, lx, ly, &view, surface, sx, sy)) {
+		view = desktop_view_at_scene(server, lx, ly, surface, sx, sy);
+	}
+	if (view)
+		return view;
+	*surface = layer_surface_at(server->background_tree, lx, ly, sx, sy);
+	return NULL;
+}
+
+static void cursor_set_default_image(struct wet_server *server) {
+	/* Loading the theme reads dozens of files, it is left for the first
+	 * time the cursor leaves a client rather than done at startup. */
+	if (!server->cursor_theme_loaded) {
+		wlr_xcursor_manager_load(server->cursor_mgr, 1);
+		server->cursor_theme_loaded = true;
+	}
+	wlr_xcursor_manager_set_cursor_image(
+			server->cursor_mgr, "left_ptr", server->cursor);
 }
 
 static void process_cursor_move(struct wet_server *server, uint32_t time) {
 	/* Move the grabbed view to the new position. */
 	struct wet_view *view = server->grabbed_view;
-	view->x = server->cursor->x - server->grab_x;
-	view->y = server->cursor->y - server->grab_y;
-	wlr_scene_node_set_position(view->scene_node, view->x, view->y);
+	view_set_position(view, server->cursor->x - server->grab_x,
+		server->cursor->y - server->grab_y);
 }
 
 static void process_cursor_resize(struct wet_server *server, uint32_t time) {
@@ -40,9 +98,9 @@ static void process_cursor_resize(struct wet_server *server, uint32_t time) {
 	 * on one or two axes, but can also move the view if you resize from the top
 	 * or left edges (or top-left corner).
 	 *
-	 * Note that I took some shortcuts here. In a more fleshed-out compositor,
-	 * you'd wait for the client to prepare a buffer at the new size, then
-	 * commit any movement that was prepared.
+	 * The client is asked for the new size through view_resize(), which keeps
+	 * at most one configure in flight and only moves the view once a buffer
+	 * of the new size is committed, so the fixed edges don't wobble.
 	 */
 	struct wet_view *view = server->grabbed_view;
 	double border_x = server->cursor->x - server->grab_x;
@@ -75,15 +133,12 @@ static void process_cursor_resize(struct wet_server *server, uint32_t time) {
 		}
 	}
 
-	struct wlr_box geo_box;
-	wlr_xdg_surface_get_geometry(view->xdg_surface, &geo_box);
-	view->x = new_left - geo_box.x;
-	view->y = new_top - geo_box.y;
-	wlr_scene_node_set_position(view->scene_node, view->x, view->y);
-
 	int new_width = new_right - new_left;
 	int new_height = new_bottom - new_top;
-	wlr_xdg_toplevel_set_size(view->xdg_surface, new_width, new_height);
+	view_resize(view,
+		(server->resize_edges & WLR_EDGE_LEFT) ? new_right : new_left,
+		(server->resize_edges & WLR_EDGE_TOP) ? new_bottom : new_top,
+		server->resize_edges, new_width, new_height);
 }
 
 static void process_cursor_motion(struct wet_server *server, uint32_t time) {
@@ -102,12 +157,11 @@ static void process_cursor_motion(struct wet_server *server, uint32_t time) {
 	struct wlr_surface *surface = NULL;
 	struct wet_view *view = desktop_view_at(server,
 			server->cursor->x, server->cursor->y, &surface, &sx, &sy);
-	if (!view) {
+	if (!surface) {
 		/* If there's no view under the cursor, set the cursor image to a
 		 * default. This is what makes the cursor image appear when you move it
 		 * around the screen, not over any views. */
-		wlr_xcursor_manager_set_cursor_image(
-				server->cursor_mgr, "left_ptr", server->cursor);
+		cursor_set_default_image(server);
 	}
 	if (surface) {
 		/*
@@ -130,12 +184,33 @@ static void process_cursor_motion(struct wet_server *server, uint32_t time) {
 	}
 }
 
+static void queue_cursor_motion(struct wet_server *server, uint32_t time) {
+	/* With coalescing on, the hit-test, the seat notification and any grab
+	 * only run once per pointer frame, however many motion events the
+	 * device packed into it. The cursor image itself has already moved. */
+	if (!server->coalesce_motion) {
+		process_cursor_motion(server, time);
+		return;
+	}
+	server->motion_pending = true;
+	server->motion_time = time;
+}
+
+static void flush_cursor_motion(struct wet_server *server) {
+	if (server->motion_pending) {
+		server->motion_pending = false;
+		process_cursor_motion(server, server->motion_time);
+	}
+}
+
 static void server_cursor_motion(struct wl_listener *listener, void *data) {
 	/* This event is forwarded by the cursor when a pointer emits a _relative_
 	 * pointer motion event (i.e. a delta) */
 	struct wet_server *server =
 		wl_container_of(listener, server, cursor_motion);
 	struct wlr_event_pointer_motion *event = data;
+	struct wet_trace_span span = trace_begin("cursor_motion");
+	server->stats.pointer_events++;
 	/* The cursor doesn't move unless we tell it to. The cursor automatically
 	 * handles constraining the motion to the output layout, as well as any
 	 * special configuration applied for the specific input device which
@@ -143,7 +218,8 @@ static void server_cursor_motion(struct wl_listener *listener, void *data) {
 	 * the cursor around without any input. */
 	wlr_cursor_move(server->cursor, event->device,
 			event->delta_x, event->delta_y);
-	process_cursor_motion(server, event->time_msec);
+	queue_cursor_motion(server, event->time_msec);
+	trace_end(&span, NULL, 0);
 }
 
 static void server_cursor_motion_absolute(
@@ -157,8 +233,11 @@ static void server_cursor_motion_absolute(
 	struct wet_server *server =
 		wl_container_of(listener, server, cursor_motion_absolute);
 	struct wlr_event_pointer_motion_absolute *event = data;
+	struct wet_trace_span span = trace_begin("cursor_motion_absolute");
+	server->stats.pointer_events++;
 	wlr_cursor_warp_absolute(server->cursor, event->device, event->x, event->y);
-	process_cursor_motion(server, event->time_msec);
+	queue_cursor_motion(server, event->time_msec);
+	trace_end(&span, NULL, 0);
 }
 
 static void server_cursor_button(struct wl_listener *listener, void *data) {
@@ -167,6 +246,10 @@ static void server_cursor_button(struct wl_listener *listener, void *data) {
 	struct wet_server *server =
 		wl_container_of(listener, server, cursor_button);
 	struct wlr_event_pointer_button *event = data;
+	struct wet_trace_span span = trace_begin("cursor_button");
+	server->stats.pointer_events++;
+	/* The button must land on whatever is under the pointer now */
+	flush_cursor_motion(server);
 	/* Notify the client with pointer focus that a button press has occurred */
 	wlr_seat_pointer_notify_button(server->seat,
 			event->time_msec, event->button, event->state);
@@ -179,8 +262,12 @@ static void server_cursor_button(struct wl_listener *listener, void *data) {
 		server->cursor_mode = CURSOR_PASSTHROUGH;
 	} else {
 		/* Focus that client if the button was _pressed_ */
-		focus_view(view, surface);
+		if (view)
+			focus_view(view, surface);
+		else if (surface && shell_surface_accepts_focus(surface))
+			focus_surface(server, surface);
 	}
+	trace_end(&span, view ? "view" : NULL, view ? view->id : 0);
 }
 
 static void server_cursor_axis(struct wl_listener *listener, void *data) {
@@ -189,10 +276,14 @@ static void server_cursor_axis(struct wl_listener *listener, void *data) {
 	struct wet_server *server =
 		wl_container_of(listener, server, cursor_axis);
 	struct wlr_event_pointer_axis *event = data;
+	struct wet_trace_span span = trace_begin("cursor_axis");
+	server->stats.pointer_events++;
+	flush_cursor_motion(server);
 	/* Notify the client with pointer focus of the axis event. */
 	wlr_seat_pointer_notify_axis(server->seat,
 			event->time_msec, event->orientation, event->delta,
 			event->delta_discrete, event->source);
+	trace_end(&span, NULL, 0);
 }
 
 static void server_cursor_frame(struct wl_listener *listener, void *data) {
@@ -202,8 +293,11 @@ static void server_cursor_frame(struct wl_listener *listener, void *data) {
 	 * same time, in which case a frame event won't be sent in between. */
 	struct wet_server *server =
 		wl_container_of(listener, server, cursor_frame);
+	struct wet_trace_span span = trace_begin("cursor_frame");
+	flush_cursor_motion(server);
 	/* Notify the client with pointer focus of the frame event. */
 	wlr_seat_pointer_notify_frame(server->seat);
+	trace_end(&span, NULL, 0);
 }
 
 void cursor_init(struct wet_server *server)
@@ -211,9 +305,9 @@ void cursor_init(struct wet_server *server)
 	/* Creates an xcursor manager, another wlroots utility which loads up
 	 * Xcursor themes to source cursor images from and makes sure that cursor
 	 * images are available at all scale factors on the screen (necessary for
-	 * HiDPI support). We add a cursor theme at scale factor 1 to begin with. */
+	 * HiDPI support). The theme at scale factor 1 is loaded on first use, see
+	 * cursor_set_default_image(). */
 	server->cursor_mgr = wlr_xcursor_manager_create(NULL, 24);
-	wlr_xcursor_manager_load(server->cursor_mgr, 1);
 
 	/*
 	 * wlr_cursor *only* displays an image on screen. It does not move around
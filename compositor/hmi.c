@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#include <stdlib.h>
+
+#include <weston-pro.h>
+#include "ivi-hmi-controller-protocol.h"
+
+/*
+ * The HMI controller (-H) lays out the application surfaces of an ivi head
+ * unit, that is every ivi surface without a placement of its own, see
+ * ivi.c. The HMI client's own surfaces (background, panel, launchers) are
+ * placed by the -i file as usual, the launchers on HMI_LAYER_HOME.
+ *
+ * Every layout mode is a scene tree of its own on HMI_LAYER_APPLICATION,
+ * holding one node per application surface, kept at its place for that
+ * mode as surfaces come and go. Only the tree of the current mode is
+ * enabled, so switching modes is two node toggles and needs nothing from
+ * the clients: the next output frame shows the new layout.
+ *
+ * wlr_scene can't scale surfaces, so unlike Weston's controller the modes
+ * don't resize anything. Applications are configured once to their tiling
+ * cell, when the number of applications changes; the other modes only
+ * move them around.
+ *
+ * Only the client started with -U may bind ivi_hmi_controller.
+ */
+
+#define HMI_LAYER_APPLICATION 1000
+#define HMI_LAYER_HOME 2000
+#define HMI_MODE_COUNT 4
+
+struct wet_hmi {
+	struct wet_server *server;
+	/* One per ivi_hmi_controller_layout_mode */
+	struct wlr_scene_tree *modes[HMI_MODE_COUNT];
+	uint32_t mode;
+	/* wet_hmi_surface.link, oldest first */
+	struct wl_list surfaces;
+	int count;
+	/* The one client allowed to bind ivi_hmi_controller */
+	struct wl_client *client;
+	struct wl_listener client_destroy;
+};
+
+struct wet_hmi_surface {
+	struct wl_list link;
+	struct wet_ivi_surface *ivi_surface;
+	/* The ivi surface's own node is the tiling one */
+	struct wlr_scene_node *nodes[HMI_MODE_COUNT];
+	/* Fraction of the free space, drawn once */
+	double random_x, random_y;
+};
+
+static void hmi_arrange_surface(struct wet_hmi *hmi,
+		struct wet_hmi_surface *surface, int index, int width,
+		int height, int columns, int cell_width, int cell_height)
+{
+	struct wlr_scene_node **nodes = surface->nodes;
+	int x, y;
+
+	x = index % columns * cell_width;
+	y = index / columns * cell_height;
+	wlr_scene_node_set_position(
+		nodes[IVI_HMI_CONTROLLER_LAYOUT_MODE_TILING], x, y);
+
+	/* The two oldest applications, one per half */
+	wlr_scene_node_set_enabled(
+		nodes[IVI_HMI_CONTROLLER_LAYOUT_MODE_SIDE_BY_SIDE], index < 2);
+	wlr_scene_node_set_position(
+		nodes[IVI_HMI_CONTROLLER_LAYOUT_MODE_SIDE_BY_SIDE],
+		index % 2 * width / 2 + (width / 2 - cell_width) / 2,
+		(height - cell_height) / 2);
+
+	/* The newest one, centered */
+	wlr_scene_node_set_enabled(
+		nodes[IVI_HMI_CONTROLLER_LAYOUT_MODE_FULL_SCREEN],
+		index == hmi->count - 1);
+	wlr_scene_node_set_position(
+		nodes[IVI_HMI_CONTROLLER_LAYOUT_MODE_FULL_SCREEN],
+		(width - cell_width) / 2, (height - cell_height) / 2);
+
+	wlr_scene_node_set_position(
+		nodes[IVI_HMI_CONTROLLER_LAYOUT_MODE_RANDOM],
+		surface->random_x * (width - cell_width),
+		surface->random_y * (height - cell_height));
+
+	ivi_surface_configure(surface->ivi_surface, cell_width, cell_height);
+}
+
+void hmi_arrange(struct wet_server *server)
+{
+	/* Only runs when applications come and go or the output changes,
+	 * never on a mode switch */
+	struct wet_hmi *hmi = server->hmi;
+	struct wet_hmi_surface *surface;
+	int width, height, columns, rows, index = 0;
+
+	if (hmi->count == 0 || !ivi_layer_get_size(server,
+			HMI_LAYER_APPLICATION, &width, &height))
+		return;
+
+	/* The smallest square grid that fits them all */
+	for (columns = 1; columns * columns < hmi->count; columns++)
+		;
+	rows = (hmi->count + columns - 1) / columns;
+
+	wl_list_for_each(surface, &hmi->surfaces, link)
+		hmi_arrange_surface(hmi, surface, index++, width, height,
+			columns, width / columns, height / rows);
+}
+
+bool hmi_surface_add(struct wet_ivi_surface *ivi_surface)
+{
+	struct wet_hmi *hmi = ivi_surface->server->hmi;
+	struct wet_hmi_surface *surface;
+	int i;
+
+	if (ivi_surface->hmi)
+		return true;
+
+	surface = calloc(1, sizeof(*surface));
+	if (!surface)
+		return false;
+	surface->ivi_surface = ivi_surface;
+	surface->nodes[0] = ivi_surface->node;
+	for (i = 1; i < HMI_MODE_COUNT; i++) {
+		surface->nodes[i] = wlr_scene_subsurface_tree_create(
+			&hmi->modes[i]->node, ivi_surface->surface);
+		if (!surface->nodes[i])
+			goto failed;
+	}
+	wlr_scene_node_reparent(ivi_surface->node, &hmi->modes[0]->node);
+	/* ivi.c keeps unplaced surfaces hidden */
+	wlr_scene_node_set_enabled(ivi_surface->node, true);
+	surface->random_x = (double)rand() / RAND_MAX;
+	surface->random_y = (double)rand() / RAND_MAX;
+
+	ivi_surface->hmi = surface;
+	wl_list_insert(hmi->surfaces.prev, &surface->link);
+	hmi->count++;
+	hmi_arrange(ivi_surface->server);
+	return true;
+
+failed:
+	while (--i > 0)
+		wlr_scene_node_destroy(surface->nodes[i]);
+	free(surface);
+	return false;
+}
+
+void hmi_surface_remove(struct wet_ivi_surface *ivi_surface)
+{
+	/* The ivi surface's own node goes back to ivi.c */
+	struct wet_hmi *hmi = ivi_surface->server->hmi;
+	struct wet_hmi_surface *surface = ivi_surface->hmi;
+	int i;
+
+	for (i = 1; i < HMI_MODE_COUNT; i++)
+		wlr_scene_node_destroy(surface->nodes[i]);
+	wl_list_remove(&surface->link);
+	free(surface);
+	ivi_surface->hmi = NULL;
+	hmi->count--;
+	hmi_arrange(ivi_surface->server);
+}
+
+int hmi_surface_count(struct wet_server *server)
+{
+	return server->hmi ? server->hmi->count : 0;
+}
+
+bool hmi_switch_mode(struct wet_server *server, uint32_t mode)
+{
+	struct wet_hmi *hmi = server->hmi;
+
+	if (!hmi || mode >= HMI_MODE_COUNT)
+		return false;
+	if (mode == hmi->mode)
+		return true;
+
+	wlr_scene_node_set_enabled(&hmi->modes[hmi->mode]->node, false);
+	wlr_scene_node_set_enabled(&hmi->modes[mode]->node, true);
+	hmi->mode = mode;
+	server->stats.hmi_mode_switches++;
+	return true;
+}
+
+bool hmi_set_home(struct wet_server *server, bool home)
+{
+	if (!server->hmi)
+		return false;
+	return ivi_layer_set_visible(server, HMI_LAYER_HOME, home);
+}
+
+static void hmi_controller_ui_ready(struct wl_client *client,
+		struct wl_resource *resource)
+{
+	/* Start over from the default layout, without the home screen */
+	struct wet_server *server = wl_resource_get_user_data(resource);
+
+	hmi_switch_mode(server, IVI_HMI_CONTROLLER_LAYOUT_MODE_TILING);
+	hmi_set_home(server, false);
+}
+
+static void hmi_controller_workspace_control(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *seat,
+		uint32_t serial)
+{
+	/* Dragging the workspaces around is not supported, tell the client
+	 * right away that we are not controlling them */
+	ivi_hmi_controller_send_workspace_end_control(resource, 0);
+}
+
+static void hmi_controller_switch_mode(struct wl_client *client,
+		struct wl_resource *resource, uint32_t layout_mode)
+{
+	hmi_switch_mode(wl_resource_get_user_data(resource), layout_mode);
+}
+
+static void hmi_controller_home(struct wl_client *client,
+		struct wl_resource *resource, uint32_t home)
+{
+	hmi_set_home(wl_resource_get_user_data(resource),
+		home == IVI_HMI_CONTROLLER_HOME_ON);
+}
+
+static const struct ivi_hmi_controller_interface hmi_controller_implementation = {
+	.UI_ready = hmi_controller_ui_ready,
+	.workspace_control = hmi_controller_workspace_control,
+	.switch_mode = hmi_controller_switch_mode,
+	.home = hmi_controller_home,
+};
+
+static void hmi_controller_bind(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id)
+{
+	struct wet_server *server = data;
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client, &ivi_hmi_controller_interface,
+		version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	if (client != server->hmi->client) {
+		wl_resource_post_error(resource, WL_DISPLAY_ERROR_INVALID_OBJECT,
+			"permission to bind ivi_hmi_controller denied");
+		wl_resource_destroy(resource);
+		return;
+	}
+	wl_resource_set_implementation(resource, &hmi_controller_implementation,
+		data, NULL);
+}
+
+static void hmi_client_destroy(struct wl_listener *listener, void *data)
+{
+	struct wet_hmi *hmi = wl_container_of(listener, hmi, client_destroy);
+
+	wl_list_remove(&hmi->client_destroy.link);
+	hmi->client = NULL;
+}
+
+bool hmi_launch(struct wet_server *server, const char *path)
+{
+	struct wet_hmi *hmi = server->hmi;
+
+	if (!hmi) {
+		printf("the HMI client needs -H\n");
+		return false;
+	}
+	hmi->client = client_launch(server, path);
+	if (!hmi->client)
+		return false;
+	hmi->client_destroy.notify = hmi_client_destroy;
+	wl_client_add_destroy_listener(hmi->client, &hmi->client_destroy);
+	return true;
+}
+
+bool hmi_init(struct wet_server *server)
+{
+	struct wlr_scene_tree *layer;
+	struct wet_hmi *hmi;
+	int i;
+
+	hmi = calloc(1, sizeof(*hmi));
+	if (!hmi)
+		return false;
+	hmi->server = server;
+	wl_list_init(&hmi->surfaces);
+
+	/* Created here so they stack below the home screen */
+	layer = ivi_layer_get_tree(server, HMI_LAYER_APPLICATION);
+	if (!layer || !ivi_layer_get_tree(server, HMI_LAYER_HOME))
+		goto failed;
+	ivi_layer_set_visible(server, HMI_LAYER_HOME, false);
+
+	for (i = 0; i < HMI_MODE_COUNT; i++) {
+		hmi->modes[i] = wlr_scene_tree_create(&layer->node);
+		if (!hmi->modes[i])
+			goto failed;
+		wlr_scene_node_set_enabled(&hmi->modes[i]->node,
+			i == IVI_HMI_CONTROLLER_LAYOUT_MODE_TILING);
+	}
+	hmi->mode = IVI_HMI_CONTROLLER_LAYOUT_MODE_TILING;
+
+	if (!wl_global_create(server->wl_display, &ivi_hmi_controller_interface,
+			1, server, hmi_controller_bind))
+		goto failed;
+
+	server->hmi = hmi;
+	return true;
+
+failed:
+	printf("failed to create the HMI controller\n");
+	for (i = 0; i < HMI_MODE_COUNT; i++) {
+		if (hmi->modes[i])
+			wlr_scene_node_destroy(&hmi->modes[i]->node);
+	}
+	free(hmi);
+	return false;
+}
@@ -0,0 +1,757 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <weston-pro.h>
+
+/*
+ * A line based control socket at $XDG_RUNTIME_DIR/<display>.ipc, also
+ * exported as WESTON_PRO_IPC. Every line is a batch of commands separated
+ * by ';'. The whole batch is checked first and then applied in a single
+ * dispatch, its moves and resizes as one layout transaction, so it shows
+ * up in one frame; the reply is "ok", or
+ * "error <n>: <reason>" naming the first bad command, in which case
+ * nothing was applied.
+ *
+ *   list                       views and outputs, then ok
+ *   focus|raise|close <id>
+ *   move <id> <x> <y>          window geometry position in the layout
+ *   resize <id> <w> <h>        keeps the top-left corner in place
+ *   fullscreen|maximize <id> 0|1
+ *   split <id> h|v             tiling: views opened next to it share its tile
+ *   weight <id> <percent>      tiling: share of the parent, 100 by default
+ *   output-add <w>x<h>[@<hz>][+<x>,<y>]
+ *   output-remove <name>
+ *   ivi-layer <layer-id> 0|1   shows or hides the whole layer
+ *   ivi-screen <layer-id> <output-name>
+ *   ivi-surface <ivi-id> <layer-id> <x> <y> <w> <h>
+ *                              0x0 for the whole screen, see ivi.c
+ *   hmi-mode tiling|side_by_side|full_screen|random
+ *   hmi-home 0|1               HMI controller, see hmi.c
+ *   lock                       until the desktop shell client unlocks
+ *   clients                    resource usage of every client, then ok
+ *   limit <resource>=<soft>[:<hard>]
+ *                              per-client limit, see client.c
+ *   subscribe                  "event ..." lines from now on
+ *   stats                      the SIGUSR2 dump, then ok
+ */
+
+#define IPC_MAX_LINE 4096
+#define IPC_MAX_ARGS 6
+#define IPC_MAX_BATCH 256
+/* Subscribers that stop reading are dropped past this */
+#define IPC_MAX_PENDING (1024 * 1024)
+
+struct ipc_client {
+	struct wl_list link;
+	struct wet_server *server;
+	int fd;
+	struct wl_event_source *source;
+	char in[IPC_MAX_LINE];
+	size_t in_len;
+	struct wl_array out;
+	bool subscribed;
+	/* Fell too far behind, destroyed from its own handler */
+	bool dead;
+};
+
+enum ipc_op {
+	IPC_LIST,
+	IPC_FOCUS,
+	IPC_RAISE,
+	IPC_CLOSE,
+	IPC_MOVE,
+	IPC_RESIZE,
+	IPC_FULLSCREEN,
+	IPC_MAXIMIZE,
+	IPC_SPLIT,
+	IPC_WEIGHT,
+	IPC_OUTPUT_ADD,
+	IPC_OUTPUT_REMOVE,
+	IPC_IVI_LAYER,
+	IPC_IVI_SCREEN,
+	IPC_IVI_SURFACE,
+	IPC_HMI_MODE,
+	IPC_HMI_HOME,
+	IPC_LOCK,
+	IPC_CLIENTS,
+	IPC_LIMIT,
+	IPC_SUBSCRIBE,
+	IPC_STATS,
+};
+
+static const struct {
+	const char *name;
+	enum ipc_op op;
+	/* Arguments after the command name */
+	int argc;
+	bool view;
+} ipc_commands[] = {
+	{ "list", IPC_LIST, 0, false },
+	{ "focus", IPC_FOCUS, 1, true },
+	{ "raise", IPC_RAISE, 1, true },
+	{ "close", IPC_CLOSE, 1, true },
+	{ "move", IPC_MOVE, 3, true },
+	{ "resize", IPC_RESIZE, 3, true },
+	{ "fullscreen", IPC_FULLSCREEN, 2, true },
+	{ "maximize", IPC_MAXIMIZE, 2, true },
+	{ "split", IPC_SPLIT, 2, true },
+	{ "weight", IPC_WEIGHT, 2, true },
+	{ "output-add", IPC_OUTPUT_ADD, 1, false },
+	{ "output-remove", IPC_OUTPUT_REMOVE, 1, false },
+	{ "ivi-layer", IPC_IVI_LAYER, 2, false },
+	{ "ivi-screen", IPC_IVI_SCREEN, 2, false },
+	{ "ivi-surface", IPC_IVI_SURFACE, 6, false },
+	{ "hmi-mode", IPC_HMI_MODE, 1, false },
+	{ "hmi-home", IPC_HMI_HOME, 1, false },
+	{ "lock", IPC_LOCK, 0, false },
+	{ "clients", IPC_CLIENTS, 0, false },
+	{ "limit", IPC_LIMIT, 1, false },
+	{ "subscribe", IPC_SUBSCRIBE, 0, false },
+	{ "stats", IPC_STATS, 0, false },
+};
+
+/* By ivi_hmi_controller_layout_mode */
+static const char *const hmi_modes[] = {
+	"tiling", "side_by_side", "full_screen", "random",
+};
+
+struct ipc_command {
+	enum ipc_op op;
+	struct wet_view *view;
+	struct wet_output *output;
+	struct wet_output_spec spec;
+	const char *name;
+	struct wlr_box box;
+	enum wet_client_resource resource;
+	struct wet_client_limit limit;
+	int a, b;
+};
+
+static void ipc_client_destroy(struct ipc_client *client)
+{
+	wl_event_source_remove(client->source);
+	close(client->fd);
+	wl_array_release(&client->out);
+	wl_list_remove(&client->link);
+	free(client);
+}
+
+static void ipc_client_flush(struct ipc_client *client)
+{
+	char *data = client->out.data;
+	ssize_t len;
+
+	while (client->out.size > 0) {
+		len = send(client->fd, data, client->out.size, MSG_NOSIGNAL);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			break;
+		if (len < 0) {
+			/* Hung up, the handler sees that next */
+			client->dead = true;
+			break;
+		}
+		memmove(data, data + len, client->out.size - len);
+		client->out.size -= len;
+	}
+
+	wl_event_source_fd_update(client->source, WL_EVENT_READABLE |
+		(client->out.size > 0 || client->dead ? WL_EVENT_WRITABLE : 0));
+}
+
+static void ipc_client_vprintf(struct ipc_client *client, const char *fmt,
+		va_list args)
+{
+	va_list copy;
+	char *dst;
+	int len;
+
+	va_copy(copy, args);
+	len = vsnprintf(NULL, 0, fmt, copy);
+	va_end(copy);
+	if (len < 0)
+		return;
+
+	/* Flushed once the batch or event is complete */
+	dst = wl_array_add(&client->out, len + 1);
+	if (!dst)
+		return;
+	vsnprintf(dst, len + 1, fmt, args);
+	dst[len] = '\n';
+}
+
+static void ipc_client_printf(struct ipc_client *client, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void ipc_client_printf(struct ipc_client *client, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	ipc_client_vprintf(client, fmt, args);
+	va_end(args);
+}
+
+void ipc_send_event(struct wet_server *server, const char *fmt, ...)
+{
+	struct ipc_client *client;
+	char line[IPC_MAX_LINE];
+	va_list args;
+
+	if (!server->ipc_clients.next || wl_list_empty(&server->ipc_clients))
+		return;
+
+	va_start(args, fmt);
+	vsnprintf(line, sizeof(line), fmt, args);
+	va_end(args);
+
+	/* Events can fire while a batch of the same client is being applied,
+	 * so only queue here and let the client's handler write them out. */
+	wl_list_for_each(client, &server->ipc_clients, link) {
+		if (!client->subscribed || client->dead)
+			continue;
+		if (client->out.size > IPC_MAX_PENDING)
+			client->dead = true;
+		else
+			ipc_client_printf(client, "event %s", line);
+		wl_event_source_fd_update(client->source,
+			WL_EVENT_READABLE | WL_EVENT_WRITABLE);
+	}
+}
+
+static struct wet_view *ipc_find_view(struct wet_server *server,
+		const char *arg)
+{
+	struct wet_view *view;
+	char *end;
+	unsigned long id = strtoul(arg, &end, 10);
+
+	if (*end != '\0')
+		return NULL;
+	wl_list_for_each(view, &server->views, link) {
+		if (view->id == id)
+			return view;
+	}
+	return NULL;
+}
+
+static bool parse_int(const char *arg, int *value)
+{
+	char *end;
+	long v;
+
+	errno = 0;
+	v = strtol(arg, &end, 10);
+	if (errno || end == arg || *end != '\0' || v < -65536 || v > 65536)
+		return false;
+	*value = v;
+	return true;
+}
+
+static const char *ipc_parse(struct wet_server *server, char *text,
+		struct ipc_command *command)
+{
+	char *argv[IPC_MAX_ARGS + 1], *save, *word;
+	int argc = 0;
+	size_t i;
+
+	for (word = strtok_r(text, " \t", &save); word;
+			word = strtok_r(NULL, " \t", &save)) {
+		if (argc == IPC_MAX_ARGS + 1)
+			return "too many arguments";
+		argv[argc++] = word;
+	}
+	if (argc == 0)
+		return "empty command";
+
+	for (i = 0; i < sizeof(ipc_commands) / sizeof(ipc_commands[0]); i++) {
+		if (strcmp(argv[0], ipc_commands[i].name) == 0)
+			break;
+	}
+	if (i == sizeof(ipc_commands) / sizeof(ipc_commands[0]))
+		return "unknown command";
+	if (argc - 1 != ipc_commands[i].argc)
+		return "wrong number of arguments";
+
+	*command = (struct ipc_command){ .op = ipc_commands[i].op };
+	if (ipc_commands[i].view) {
+		command->view = ipc_find_view(server, argv[1]);
+		if (!command->view)
+			return "no such view";
+	}
+
+	switch (command->op) {
+	case IPC_MOVE:
+	case IPC_RESIZE:
+		if (!parse_int(argv[2], &command->a) ||
+				!parse_int(argv[3], &command->b))
+			return "invalid number";
+		if (command->op == IPC_RESIZE &&
+				(command->a <= 0 || command->b <= 0))
+			return "invalid size";
+		if (command->view->tile)
+			return "tiled, see weight";
+		break;
+	case IPC_FULLSCREEN:
+	case IPC_MAXIMIZE:
+		if (!parse_int(argv[2], &command->a))
+			return "invalid number";
+		break;
+	case IPC_SPLIT:
+		if (!command->view->tile)
+			return "not tiled";
+		if (strcmp(argv[2], "h") != 0 && strcmp(argv[2], "v") != 0)
+			return "invalid split";
+		command->a = argv[2][0] == 'v';
+		break;
+	case IPC_WEIGHT:
+		if (!command->view->tile)
+			return "not tiled";
+		if (!parse_int(argv[2], &command->a) || command->a <= 0)
+			return "invalid weight";
+		break;
+	case IPC_OUTPUT_ADD:
+		if (!output_parse_spec(argv[1], &command->spec))
+			return "invalid output";
+		if (!server->headless_backend)
+			return "no headless backend";
+		break;
+	case IPC_OUTPUT_REMOVE:
+		command->output = output_find(server, argv[1]);
+		if (!command->output)
+			return "no such output";
+		if (!wlr_output_is_headless(command->output->wlr_output))
+			return "not a virtual output";
+		break;
+	case IPC_IVI_LAYER:
+		if (!parse_int(argv[1], &command->a) || command->a < 0 ||
+				!parse_int(argv[2], &command->b))
+			return "invalid number";
+		break;
+	case IPC_IVI_SCREEN:
+		if (!parse_int(argv[1], &command->a) || command->a < 0)
+			return "invalid number";
+		command->name = argv[2];
+		break;
+	case IPC_IVI_SURFACE:
+		if (!parse_int(argv[1], &command->a) || command->a < 0 ||
+				!parse_int(argv[2], &command->b) || command->b < 0 ||
+				!parse_int(argv[3], &command->box.x) ||
+				!parse_int(argv[4], &command->box.y) ||
+				!parse_int(argv[5], &command->box.width) ||
+				!parse_int(argv[6], &command->box.height))
+			return "invalid number";
+		if (command->box.width < 0 || command->box.height < 0)
+			return "invalid size";
+		break;
+	case IPC_HMI_MODE:
+		if (!server->hmi)
+			return "no hmi controller";
+		for (i = 0; i < sizeof(hmi_modes) / sizeof(hmi_modes[0]); i++) {
+			if (strcmp(argv[1], hmi_modes[i]) == 0)
+				break;
+		}
+		if (i == sizeof(hmi_modes) / sizeof(hmi_modes[0]))
+			return "invalid mode";
+		command->a = i;
+		break;
+	case IPC_HMI_HOME:
+		if (!server->hmi)
+			return "no hmi controller";
+		if (!parse_int(argv[1], &command->a))
+			return "invalid number";
+		break;
+	case IPC_LOCK:
+		if (!shell_has_client(server))
+			return "no desktop shell";
+		break;
+	case IPC_LIMIT:
+		if (!client_parse_limit(argv[1], &command->resource,
+				&command->limit))
+			return "invalid limit";
+		break;
+	default:
+		break;
+	}
+
+	return NULL;
+}
+
+static void ipc_list(struct ipc_client *client)
+{
+	struct wet_server *server = client->server;
+	struct wlr_surface *focused = server->seat->keyboard_state.focused_surface;
+	struct wet_output *output;
+	struct wet_view *view;
+	struct wlr_box box, *output_box;
+	const char *title;
+
+	wl_list_for_each(output, &server->outputs, link) {
+		output_box = wlr_output_layout_get_box(server->output_layout,
+			output->wlr_output);
+		if (!output_box)
+			continue;
+		ipc_client_printf(client, "output %s %d %d %d %d %d",
+			output->wlr_output->name, output_box->x, output_box->y,
+			output_box->width, output_box->height,
+			output->wlr_output->refresh);
+	}
+
+	/* Topmost first */
+	wl_list_for_each(view, &server->views, link) {
+		view_get_geometry(view, &box);
+		title = view->xdg_surface->toplevel->title;
+		ipc_client_printf(client, "view %u %d %d %d %d %d %s", view->id,
+			box.x, box.y, box.width, box.height,
+			view->xdg_surface->surface == focused,
+			title ? title : "");
+	}
+}
+
+static void ipc_stats(struct ipc_client *client)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *f = open_memstream(&buf, &size);
+
+	if (!f)
+		return;
+	server_dump_stats(client->server, f);
+	fclose(f);
+
+	if (size > 0 && buf[size - 1] == '\n')
+		size--;
+	ipc_client_printf(client, "%.*s", (int)size, buf);
+	free(buf);
+}
+
+static void ipc_clients(struct ipc_client *client)
+{
+	struct wet_client *wet_client;
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *f = open_memstream(&buf, &size);
+
+	if (!f)
+		return;
+	wl_list_for_each(wet_client, &client->server->clients, link)
+		client_dump(wet_client, f);
+	fclose(f);
+
+	if (size > 0 && buf[size - 1] == '\n')
+		size--;
+	if (size > 0)
+		ipc_client_printf(client, "%.*s", (int)size, buf);
+	free(buf);
+}
+
+static void ipc_apply(struct ipc_client *client, struct ipc_command *command,
+		struct wet_transaction **transaction)
+{
+	struct wet_view *view = command->view;
+	struct wlr_box box;
+
+	/* Moves and resizes of a batch all go into one layout transaction */
+	if ((command->op == IPC_MOVE || command->op == IPC_RESIZE) &&
+			!*transaction) {
+		*transaction = transaction_create(client->server);
+		if (!*transaction)
+			return;
+	}
+
+	switch (command->op) {
+	case IPC_LIST:
+		ipc_list(client);
+		break;
+	case IPC_FOCUS:
+		focus_view(view, view->xdg_surface->surface);
+		break;
+	case IPC_RAISE:
+		view_raise(view);
+		break;
+	case IPC_CLOSE:
+		wlr_xdg_toplevel_send_close(view->xdg_surface);
+		break;
+	case IPC_MOVE:
+		transaction_get_geometry(*transaction, view, &box);
+		box.x = command->a;
+		box.y = command->b;
+		transaction_add_view(*transaction, view, &box);
+		break;
+	case IPC_RESIZE:
+		transaction_get_geometry(*transaction, view, &box);
+		box.width = command->a;
+		box.height = command->b;
+		transaction_add_view(*transaction, view, &box);
+		break;
+	case IPC_FULLSCREEN:
+		view_set_fullscreen(view, command->a, NULL);
+		break;
+	case IPC_MAXIMIZE:
+		view_set_maximized(view, command->a);
+		break;
+	case IPC_SPLIT:
+		tile_view_split(view, command->a);
+		break;
+	case IPC_WEIGHT:
+		tile_view_set_weight(view, command->a / 100.0);
+		break;
+	case IPC_OUTPUT_ADD:
+		if (!output_add_virtual(client->server, &command->spec))
+			printf("ipc: failed to create a %dx%d output\n",
+			       command->spec.width, command->spec.height);
+		break;
+	case IPC_OUTPUT_REMOVE:
+		output_remove_virtual(command->output);
+		break;
+	case IPC_IVI_LAYER:
+		ivi_layer_set_visible(client->server, command->a, command->b);
+		break;
+	case IPC_IVI_SCREEN:
+		ivi_layer_set_screen(client->server, command->a, command->name);
+		break;
+	case IPC_IVI_SURFACE:
+		ivi_set_placement(client->server, command->a, command->b,
+			&command->box);
+		break;
+	case IPC_HMI_MODE:
+		hmi_switch_mode(client->server, command->a);
+		break;
+	case IPC_HMI_HOME:
+		hmi_set_home(client->server, command->a);
+		break;
+	case IPC_LOCK:
+		shell_lock(client->server);
+		break;
+	case IPC_CLIENTS:
+		ipc_clients(client);
+		break;
+	case IPC_LIMIT:
+		/* Checked on the next increase, nobody is disconnected now */
+		client->server->client_limits[command->resource] = command->limit;
+		break;
+	case IPC_SUBSCRIBE:
+		client->subscribed = true;
+		break;
+	case IPC_STATS:
+		ipc_stats(client);
+		break;
+	}
+}
+
+static void ipc_handle_line(struct ipc_client *client, char *line)
+{
+	struct ipc_command commands[IPC_MAX_BATCH];
+	struct wet_transaction *transaction = NULL;
+	char *save, *text;
+	const char *error;
+	int n = 0, i;
+
+	/* Check the whole batch before touching anything */
+	for (text = strtok_r(line, ";", &save); text;
+			text = strtok_r(NULL, ";", &save)) {
+		if (n == IPC_MAX_BATCH) {
+			ipc_client_printf(client, "error %d: batch too long", n);
+			return;
+		}
+		error = ipc_parse(client->server, text, &commands[n]);
+		if (error) {
+			ipc_client_printf(client, "error %d: %s", n, error);
+			return;
+		}
+		n++;
+	}
+
+	/* Output removal destroys the output, make sure a batch naming it
+	 * twice doesn't use it after that */
+	for (i = 0; i < n; i++) {
+		int j;
+
+		if (commands[i].op != IPC_OUTPUT_REMOVE)
+			continue;
+		for (j = i + 1; j < n; j++) {
+			if (commands[j].op == IPC_OUTPUT_REMOVE &&
+					commands[j].output == commands[i].output) {
+				ipc_client_printf(client,
+					"error %d: output removed twice", j);
+				return;
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		ipc_apply(client, &commands[i], &transaction);
+	/* Tiling changes of the batch are arranged together too */
+	tile_arrange(client->server);
+	if (transaction)
+		transaction_commit(transaction);
+	ipc_client_printf(client, "ok");
+}
+
+static int ipc_client_handle(int fd, uint32_t mask, void *data)
+{
+	struct ipc_client *client = data;
+	char *line, *newline;
+	ssize_t len;
+
+	if (client->dead || (mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR))) {
+		ipc_client_destroy(client);
+		return 0;
+	}
+
+	if (mask & WL_EVENT_READABLE) {
+		len = recv(fd, client->in + client->in_len,
+			sizeof(client->in) - client->in_len, 0);
+		if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) {
+			ipc_client_destroy(client);
+			return 0;
+		}
+		if (len > 0)
+			client->in_len += len;
+
+		line = client->in;
+		while ((newline = memchr(line, '\n',
+				client->in + client->in_len - line))) {
+			*newline = '\0';
+			ipc_handle_line(client, line);
+			line = newline + 1;
+		}
+		client->in_len -= line - client->in;
+		memmove(client->in, line, client->in_len);
+
+		if (client->in_len == sizeof(client->in)) {
+			ipc_client_printf(client, "error 0: line too long");
+			ipc_client_flush(client);
+			client->dead = true;
+		}
+		if (client->dead) {
+			ipc_client_destroy(client);
+			return 0;
+		}
+	}
+
+	ipc_client_flush(client);
+	return 0;
+}
+
+static int ipc_handle_connection(int fd, uint32_t mask, void *data)
+{
+	struct wet_server *server = data;
+	struct ipc_client *client;
+	int client_fd;
+
+	client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client_fd < 0)
+		return 0;
+
+	client = calloc(1, sizeof(*client));
+	if (!client) {
+		close(client_fd);
+		return 0;
+	}
+	client->server = server;
+	client->fd = client_fd;
+	wl_array_init(&client->out);
+	client->source = wl_event_loop_add_fd(
+		wl_display_get_event_loop(server->wl_display), client_fd,
+		WL_EVENT_READABLE, ipc_client_handle, client);
+	if (!client->source) {
+		close(client_fd);
+		free(client);
+		return 0;
+	}
+	wl_list_insert(&server->ipc_clients, &client->link);
+
+	return 0;
+}
+
+bool ipc_init(struct wet_server *server, const char *socket_name)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	wl_list_init(&server->ipc_clients);
+	server->ipc_fd = -1;
+
+	if (!dir) {
+		printf("XDG_RUNTIME_DIR is not set, no control socket\n");
+		return false;
+	}
+	if (asprintf(&server->ipc_path, "%s/%s.ipc", dir, socket_name) < 0) {
+		server->ipc_path = NULL;
+		return false;
+	}
+	if (strlen(server->ipc_path) >= sizeof(addr.sun_path)) {
+		printf("control socket path too long\n");
+		goto failed;
+	}
+	strcpy(addr.sun_path, server->ipc_path);
+
+	server->ipc_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+		SOCK_CLOEXEC, 0);
+	if (server->ipc_fd < 0)
+		goto failed;
+	/* The Wayland socket lock already tells us nobody else owns it */
+	unlink(server->ipc_path);
+	if (bind(server->ipc_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(server->ipc_fd, 16) < 0) {
+		printf("failed to bind the control socket %s\n",
+		       server->ipc_path);
+		goto failed;
+	}
+
+	server->ipc_source = wl_event_loop_add_fd(
+		wl_display_get_event_loop(server->wl_display), server->ipc_fd,
+		WL_EVENT_READABLE, ipc_handle_connection, server);
+	if (!server->ipc_source)
+		goto failed;
+
+	setenv("WESTON_PRO_IPC", server->ipc_path, true);
+	return true;
+
+failed:
+	if (server->ipc_fd >= 0) {
+		close(server->ipc_fd);
+		unlink(server->ipc_path);
+	}
+	server->ipc_fd = -1;
+	free(server->ipc_path);
+	server->ipc_path = NULL;
+	return false;
+}
+
+void ipc_finish(struct wet_server *server)
+{
+	struct ipc_client *client, *tmp;
+
+	if (!server->ipc_clients.next)
+		return;
+
+	wl_list_for_each_safe(client, tmp, &server->ipc_clients, link)
+		ipc_client_destroy(client);
+
+	if (server->ipc_source)
+		wl_event_source_remove(server->ipc_source);
+	server->ipc_source = NULL;
+	if (server->ipc_fd >= 0) {
+		close(server->ipc_fd);
+		unlink(server->ipc_path);
+	}
+	server->ipc_fd = -1;
+	free(server->ipc_path);
+	server->ipc_path = NULL;
+}
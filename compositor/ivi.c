@@ -0,0 +1,580 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <weston-pro.h>
+#include "ivi-application-protocol.h"
+
+/*
+ * ivi-application: clients name their surfaces with a fixed ivi-id, and the
+ * compositor decides where each id goes. The scene is organised as
+ *
+ *   ivi_tree -> screen (one per output name) -> layer -> surfaces
+ *
+ * Screens sit at the layout position of their output, layers stack by id,
+ * lowest at the bottom. Showing or hiding a layer is one node toggle.
+ *
+ * Placements come from the file given with -i and from the control socket:
+ *
+ *   layer <layer-id> <output-name>
+ *   surface <ivi-id> <layer-id> <x> <y> <width> <height>
+ *
+ * An ivi-id without a placement stays hidden until one is given. Layers not
+ * given an output are on the first one. The global is only offered with -i
+ * or -H.
+ */
+
+struct wet_ivi_screen {
+	struct wl_list link; /* wet_server.ivi_screens */
+	char *name;
+	struct wlr_scene_tree *tree;
+};
+
+struct wet_ivi_layer {
+	struct wl_list link; /* wet_server.ivi_layers, by id */
+	uint32_t id;
+	struct wet_ivi_screen *screen;
+	struct wlr_scene_tree *tree;
+};
+
+struct wet_ivi_placement {
+	struct wl_list link; /* wet_server.ivi_placements */
+	uint32_t ivi_id;
+	uint32_t layer_id;
+	/* Relative to the screen, empty size for the whole screen */
+	struct wlr_box box;
+};
+
+static const struct wlr_surface_role ivi_surface_role = {
+	.name = "ivi_surface",
+};
+
+static struct wet_output *ivi_screen_output(struct wet_server *server,
+		const char *name)
+{
+	/* The unnamed screen is the first output, whichever that is now */
+	struct wet_output *output;
+
+	if (name[0] != '\0')
+		return output_find(server, name);
+	if (wl_list_empty(&server->outputs))
+		return NULL;
+	/* server_new_output() inserts at the head, the first one is last */
+	output = wl_container_of(server->outputs.prev, output, link);
+	return output;
+}
+
+static struct wet_ivi_screen *ivi_screen_get(struct wet_server *server,
+		const char *name)
+{
+	struct wet_ivi_screen *screen;
+
+	wl_list_for_each(screen, &server->ivi_screens, link) {
+		if (strcmp(screen->name, name) == 0)
+			return screen;
+	}
+
+	screen = calloc(1, sizeof(*screen));
+	if (!screen)
+		return NULL;
+	screen->name = strdup(name);
+	screen->tree = wlr_scene_tree_create(&server->ivi_tree->node);
+	if (!screen->name || !screen->tree) {
+		if (screen->tree)
+			wlr_scene_node_destroy(&screen->tree->node);
+		free(screen->name);
+		free(screen);
+		return NULL;
+	}
+	wl_list_insert(server->ivi_screens.prev, &screen->link);
+	ivi_update_screens(server);
+
+	return screen;
+}
+
+void ivi_update_screens(struct wet_server *server)
+{
+	/* Screens follow their outputs around the layout, and disappear with
+	 * them until they come back */
+	struct wet_ivi_screen *screen;
+	struct wet_output *output;
+	struct wlr_box *box;
+
+	if (!server->ivi_tree)
+		return;
+
+	wl_list_for_each(screen, &server->ivi_screens, link) {
+		output = ivi_screen_output(server, screen->name);
+		box = output ? wlr_output_layout_get_box(server->output_layout,
+			output->wlr_output) : NULL;
+		wlr_scene_node_set_enabled(&screen->tree->node, box != NULL);
+		if (box)
+			wlr_scene_node_set_position(&screen->tree->node,
+				box->x, box->y);
+	}
+}
+
+static struct wet_ivi_layer *ivi_layer_find(struct wet_server *server,
+		uint32_t id)
+{
+	struct wet_ivi_layer *layer;
+
+	wl_list_for_each(layer, &server->ivi_layers, link) {
+		if (layer->id == id)
+			return layer;
+	}
+	return NULL;
+}
+
+bool ivi_layer_set_screen(struct wet_server *server, uint32_t id,
+		const char *screen_name)
+{
+	/* Creates the layer as needed; moving it keeps its surfaces */
+	struct wet_ivi_layer *layer, *other;
+	struct wet_ivi_screen *screen;
+	struct wlr_scene_node *below = NULL, *above = NULL;
+
+	screen = ivi_screen_get(server, screen_name);
+	if (!screen)
+		return false;
+
+	layer = ivi_layer_find(server, id);
+	if (!layer) {
+		layer = calloc(1, sizeof(*layer));
+		if (!layer)
+			return false;
+		layer->id = id;
+		layer->tree = wlr_scene_tree_create(&screen->tree->node);
+		if (!layer->tree) {
+			free(layer);
+			return false;
+		}
+		wl_list_for_each(other, &server->ivi_layers, link) {
+			if (other->id > id)
+				break;
+		}
+		wl_list_insert(other->link.prev, &layer->link);
+	} else if (layer->screen != screen) {
+		wlr_scene_node_reparent(&layer->tree->node, &screen->tree->node);
+	}
+	layer->screen = screen;
+
+	/* Keep the id order among the layers of the screen */
+	wl_list_for_each(other, &server->ivi_layers, link) {
+		if (other == layer || other->screen != screen)
+			continue;
+		if (other->id < id)
+			below = &other->tree->node;
+		else if (!above)
+			above = &other->tree->node;
+	}
+	if (below)
+		wlr_scene_node_place_above(&layer->tree->node, below);
+	else if (above)
+		wlr_scene_node_place_below(&layer->tree->node, above);
+
+	return true;
+}
+
+static struct wet_ivi_layer *ivi_layer_get(struct wet_server *server,
+		uint32_t id)
+{
+	struct wet_ivi_layer *layer = ivi_layer_find(server, id);
+
+	if (layer)
+		return layer;
+	if (!ivi_layer_set_screen(server, id, ""))
+		return NULL;
+	return ivi_layer_find(server, id);
+}
+
+bool ivi_layer_set_visible(struct wet_server *server, uint32_t id,
+		bool visible)
+{
+	/* Hiding a layer before anything is on it is fine too */
+	struct wet_ivi_layer *layer = ivi_layer_get(server, id);
+
+	if (!layer)
+		return false;
+
+	/* The whole layer in one go, the scene damages its area for the next
+	 * frame */
+	wlr_scene_node_set_enabled(&layer->tree->node, visible);
+	return true;
+}
+
+static struct wet_ivi_placement *ivi_placement_find(struct wet_server *server,
+		uint32_t ivi_id)
+{
+	struct wet_ivi_placement *placement;
+
+	wl_list_for_each(placement, &server->ivi_placements, link) {
+		if (placement->ivi_id == ivi_id)
+			return placement;
+	}
+	return NULL;
+}
+
+struct wlr_scene_tree *ivi_layer_get_tree(struct wet_server *server,
+		uint32_t id)
+{
+	struct wet_ivi_layer *layer = ivi_layer_get(server, id);
+
+	return layer ? layer->tree : NULL;
+}
+
+bool ivi_layer_get_size(struct wet_server *server, uint32_t id,
+		int *width, int *height)
+{
+	/* The size of the output the layer is on, if it is there */
+	struct wet_ivi_layer *layer = ivi_layer_get(server, id);
+	struct wet_output *output;
+
+	output = layer ? ivi_screen_output(server, layer->screen->name) : NULL;
+	if (!output)
+		return false;
+	wlr_output_effective_resolution(output->wlr_output, width, height);
+	return true;
+}
+
+void ivi_surface_configure(struct wet_ivi_surface *ivi_surface,
+		int width, int height)
+{
+	if (width <= 0 || height <= 0 || (width == ivi_surface->width &&
+			height == ivi_surface->height))
+		return;
+	ivi_surface->width = width;
+	ivi_surface->height = height;
+	ivi_surface_send_configure(ivi_surface->resource, width, height);
+}
+
+static void ivi_surface_place(struct wet_ivi_surface *ivi_surface)
+{
+	struct wet_server *server = ivi_surface->server;
+	struct wet_ivi_placement *placement;
+	struct wet_ivi_layer *layer;
+	struct wlr_box box;
+
+	placement = ivi_placement_find(server, ivi_surface->ivi_id);
+	if (!placement) {
+		/* No-op for surfaces the controller already has */
+		if (server->hmi && hmi_surface_add(ivi_surface))
+			return;
+		/* Hidden until placed, an unknown id must not cover the
+		 * screen */
+		wlr_scene_node_set_enabled(ivi_surface->node, false);
+		return;
+	}
+	/* An explicit placement takes it back from the controller */
+	if (ivi_surface->hmi)
+		hmi_surface_remove(ivi_surface);
+	layer = ivi_layer_get(server, placement->layer_id);
+	if (!layer)
+		return;
+
+	box = placement->box;
+	if (box.width <= 0 || box.height <= 0)
+		ivi_layer_get_size(server, placement->layer_id,
+			&box.width, &box.height);
+
+	if (ivi_surface->node->parent != &layer->tree->node)
+		wlr_scene_node_reparent(ivi_surface->node, &layer->tree->node);
+	wlr_scene_node_set_position(ivi_surface->node, box.x, box.y);
+	wlr_scene_node_set_enabled(ivi_surface->node, true);
+	ivi_surface_configure(ivi_surface, box.width, box.height);
+}
+
+bool ivi_set_placement(struct wet_server *server, uint32_t ivi_id,
+		uint32_t layer_id, const struct wlr_box *box)
+{
+	struct wet_ivi_placement *placement;
+	struct wet_ivi_surface *ivi_surface;
+
+	placement = ivi_placement_find(server, ivi_id);
+	if (!placement) {
+		placement = calloc(1, sizeof(*placement));
+		if (!placement)
+			return false;
+		placement->ivi_id = ivi_id;
+		wl_list_insert(&server->ivi_placements, &placement->link);
+	}
+	placement->layer_id = layer_id;
+	placement->box = *box;
+
+	wl_list_for_each(ivi_surface, &server->ivi_surfaces, link) {
+		if (ivi_surface->ivi_id == ivi_id)
+			ivi_surface_place(ivi_surface);
+	}
+	return true;
+}
+
+bool ivi_load_config(struct wet_server *server, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[256], screen[64];
+	unsigned int ivi_id, layer_id;
+	struct wlr_box box;
+	int n = 0;
+
+	if (!f) {
+		printf("failed to open %s\n", path);
+		return false;
+	}
+
+	/* Outputs named here need not exist yet, their screens stay hidden
+	 * until they show up */
+	while (fgets(line, sizeof(line), f)) {
+		n++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "layer %u %63s", &layer_id, screen) == 2) {
+			if (!ivi_layer_set_screen(server, layer_id, screen))
+				goto failed;
+		} else if (sscanf(line, "surface %u %u %d %d %d %d", &ivi_id,
+				&layer_id, &box.x, &box.y, &box.width,
+				&box.height) == 6) {
+			if (!ivi_set_placement(server, ivi_id, layer_id, &box))
+				goto failed;
+		} else {
+			printf("%s:%d: invalid line\n", path, n);
+			goto failed;
+		}
+	}
+
+	fclose(f);
+	return true;
+
+failed:
+	fclose(f);
+	return false;
+}
+
+struct wlr_surface *ivi_surface_at(struct wet_server *server, double lx,
+		double ly, double *sx, double *sy)
+{
+	struct wlr_scene_node *node;
+
+	if (!server->ivi_tree ||
+			wl_list_empty(&server->ivi_tree->node.state.children))
+		return NULL;
+
+	/* ivi_tree sits at the origin, parent coordinates are layout ones */
+	node = wlr_scene_node_at(&server->ivi_tree->node, lx, ly, sx, sy);
+	if (!node || node->type != WLR_SCENE_NODE_SURFACE)
+		return NULL;
+	return wlr_scene_surface_from_node(node)->surface;
+}
+
+struct ivi_frame_done_data {
+	const struct wlr_box *box;
+	const struct timespec *now;
+};
+
+static void ivi_frame_done_iterator(struct wlr_surface *surface,
+		int sx, int sy, void *data)
+{
+	struct ivi_frame_done_data *frame = data;
+	struct wlr_box box = { sx, sy, surface->current.width,
+		surface->current.height };
+	struct wlr_box intersection;
+
+	if (wlr_box_intersection(&intersection, &box, frame->box))
+		wlr_surface_send_frame_done(surface, frame->now);
+}
+
+void ivi_send_frame_done(struct wet_server *server,
+		const struct wlr_box *output_box, const struct timespec *now)
+{
+	/* Hidden layers are disabled nodes, which the walk skips */
+	struct ivi_frame_done_data data = { output_box, now };
+
+	if (!server->ivi_tree)
+		return;
+	wlr_scene_node_for_each_surface(&server->ivi_tree->node,
+		ivi_frame_done_iterator, &data);
+}
+
+static void ivi_surface_destroy(struct wet_ivi_surface *ivi_surface)
+{
+	if (ivi_surface->hmi)
+		hmi_surface_remove(ivi_surface);
+	wl_list_remove(&ivi_surface->surface_destroy.link);
+	wl_list_remove(&ivi_surface->link);
+	/* Already gone when the surface is: the subsurface tree listens to
+	 * the surface too, and came first */
+	if (ivi_surface->node) {
+		wl_list_remove(&ivi_surface->node_destroy.link);
+		wlr_scene_node_destroy(ivi_surface->node);
+	}
+	client_account(ivi_surface->server,
+		wl_resource_get_client(ivi_surface->resource), WET_CLIENT_NODES,
+		-1);
+	/* Frees the role, the surface may get another ivi_surface later */
+	ivi_surface->surface->role_data = NULL;
+	wl_resource_set_user_data(ivi_surface->resource, NULL);
+	free(ivi_surface);
+}
+
+static void ivi_surface_handle_surface_destroy(struct wl_listener *listener,
+		void *data)
+{
+	struct wet_ivi_surface *ivi_surface =
+		wl_container_of(listener, ivi_surface, surface_destroy);
+
+	ivi_surface_destroy(ivi_surface);
+}
+
+static void ivi_surface_handle_node_destroy(struct wl_listener *listener,
+		void *data)
+{
+	struct wet_ivi_surface *ivi_surface =
+		wl_container_of(listener, ivi_surface, node_destroy);
+
+	wl_list_remove(&ivi_surface->node_destroy.link);
+	ivi_surface->node = NULL;
+}
+
+static void ivi_surface_resource_destroy(struct wl_resource *resource)
+{
+	struct wet_ivi_surface *ivi_surface = wl_resource_get_user_data(resource);
+
+	if (ivi_surface)
+		ivi_surface_destroy(ivi_surface);
+}
+
+static void ivi_surface_handle_destroy(struct wl_client *client,
+		struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct ivi_surface_interface ivi_surface_implementation = {
+	.destroy = ivi_surface_handle_destroy,
+};
+
+static void ivi_application_surface_create(struct wl_client *client,
+		struct wl_resource *resource, uint32_t ivi_id,
+		struct wl_resource *surface_resource, uint32_t id)
+{
+	struct wet_server *server = wl_resource_get_user_data(resource);
+	struct wlr_surface *surface = wlr_surface_from_resource(surface_resource);
+	struct wet_ivi_surface *ivi_surface;
+
+	wl_list_for_each(ivi_surface, &server->ivi_surfaces, link) {
+		if (ivi_surface->ivi_id == ivi_id) {
+			wl_resource_post_error(resource,
+				IVI_APPLICATION_ERROR_IVI_ID,
+				"ivi_id %u is already in use", ivi_id);
+			return;
+		}
+	}
+
+	/* The failures below all disconnect the client, which drops its
+	 * accounting with it */
+	if (!client_account(server, client, WET_CLIENT_NODES, 1))
+		return;
+	ivi_surface = calloc(1, sizeof(*ivi_surface));
+	if (!ivi_surface) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	if (!wlr_surface_set_role(surface, &ivi_surface_role, ivi_surface,
+			resource, IVI_APPLICATION_ERROR_ROLE)) {
+		free(ivi_surface);
+		return;
+	}
+
+	ivi_surface->resource = wl_resource_create(client,
+		&ivi_surface_interface, wl_resource_get_version(resource), id);
+	if (!ivi_surface->resource) {
+		surface->role_data = NULL;
+		free(ivi_surface);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	ivi_surface->node = wlr_scene_subsurface_tree_create(
+		&server->ivi_tree->node, surface);
+	if (!ivi_surface->node) {
+		wl_resource_destroy(ivi_surface->resource);
+		surface->role_data = NULL;
+		free(ivi_surface);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wlr_scene_node_set_enabled(ivi_surface->node, false);
+	wl_resource_set_implementation(ivi_surface->resource,
+		&ivi_surface_implementation, ivi_surface,
+		ivi_surface_resource_destroy);
+
+	ivi_surface->server = server;
+	ivi_surface->ivi_id = ivi_id;
+	ivi_surface->surface = surface;
+	ivi_surface->surface_destroy.notify = ivi_surface_handle_surface_destroy;
+	wl_signal_add(&surface->events.destroy, &ivi_surface->surface_destroy);
+	ivi_surface->node_destroy.notify = ivi_surface_handle_node_destroy;
+	wl_signal_add(&ivi_surface->node->events.destroy,
+		&ivi_surface->node_destroy);
+	wl_list_insert(&server->ivi_surfaces, &ivi_surface->link);
+
+	ivi_surface_place(ivi_surface);
+}
+
+static const struct ivi_application_interface ivi_application_implementation = {
+	.surface_create = ivi_application_surface_create,
+};
+
+static void ivi_application_bind(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client, &ivi_application_interface,
+		version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource,
+		&ivi_application_implementation, data, NULL);
+}
+
+static void ivi_layout_change(struct wl_listener *listener, void *data)
+{
+	struct wet_server *server =
+		wl_container_of(listener, server, ivi_layout_change);
+	struct wet_ivi_surface *ivi_surface;
+
+	ivi_update_screens(server);
+	/* Full screen surfaces follow the size of their output */
+	wl_list_for_each(ivi_surface, &server->ivi_surfaces, link)
+		ivi_surface_place(ivi_surface);
+	if (server->hmi)
+		hmi_arrange(server);
+}
+
+bool ivi_init(struct wet_server *server)
+{
+	wl_list_init(&server->ivi_screens);
+	wl_list_init(&server->ivi_layers);
+	wl_list_init(&server->ivi_placements);
+	wl_list_init(&server->ivi_surfaces);
+
+	server->ivi_layout_change.notify = ivi_layout_change;
+	wl_signal_add(&server->output_layout->events.change,
+		&server->ivi_layout_change);
+
+	if (!server->ivi_enabled && !server->hmi_enabled)
+		return true;
+	if (!wl_global_create(server->wl_display, &ivi_application_interface,
+			1, server, ivi_application_bind)) {
+		printf("failed to create the ivi_application global\n");
+		return false;
+	}
+
+	return true;
+}
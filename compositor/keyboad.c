@@ -3,9 +3,235 @@
  * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
  */
 
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <weston-pro.h>
 
-void keyboard_init(struct wet_server *server)
+/*
+ * All keyboards share one xkb context for the lifetime of the server, and
+ * compiled keymaps are cached by their RMLVO names: a dozen identical HID
+ * interfaces showing up at once cost a single compilation. With a cache
+ * directory, compiled keymaps are also kept on disk in the serialized text
+ * format, which loads without going through the rules and include files.
+ * The file name is only a hash of the names, so the file starts with a line
+ * holding the names themselves and is recompiled when they don't match.
+ */
+
+struct wet_keymap {
+	struct wl_list link;
+	char *rules, *model, *layout, *variant, *options;
+	struct xkb_keymap *keymap;
+};
+
+static const char *name_or_env(const char *name, const char *env)
+{
+	/* Resolve the names like libxkbcommon does, so that the cache key is
+	 * what actually gets compiled */
+	if (name && *name)
+		return name;
+	name = getenv(env);
+	return name ? name : "";
+}
+
+static void resolve_names(const struct xkb_rule_names *names,
+		struct xkb_rule_names *resolved)
+{
+	resolved->rules = name_or_env(names ? names->rules : NULL,
+		"XKB_DEFAULT_RULES");
+	resolved->model = name_or_env(names ? names->model : NULL,
+		"XKB_DEFAULT_MODEL");
+	resolved->layout = name_or_env(names ? names->layout : NULL,
+		"XKB_DEFAULT_LAYOUT");
+	resolved->variant = name_or_env(names ? names->variant : NULL,
+		"XKB_DEFAULT_VARIANT");
+	resolved->options = name_or_env(names ? names->options : NULL,
+		"XKB_DEFAULT_OPTIONS");
+}
+
+static uint32_t hash_string(uint32_t hash, const char *s)
 {
+	/* FNV-1a, including the terminator so "ab","c" != "a","bc" */
+	do {
+		hash ^= (uint8_t)*s;
+		hash *= 16777619u;
+	} while (*s++);
+	return hash;
+}
+
+static char *keymap_cache_path(struct wet_server *server,
+		const struct xkb_rule_names *names)
+{
+	uint32_t hash = 2166136261u;
+	char *path;
+
+	hash = hash_string(hash, names->rules);
+	hash = hash_string(hash, names->model);
+	hash = hash_string(hash, names->layout);
+	hash = hash_string(hash, names->variant);
+	hash = hash_string(hash, names->options);
+
+	if (asprintf(&path, "%s/keymap-%08x.xkb", server->keymap_cache_dir,
+			hash) < 0)
+		return NULL;
+	return path;
+}
+
+static char *keymap_header(const struct xkb_rule_names *names)
+{
+	char *header;
+
+	if (asprintf(&header, "# weston-pro keymap: %s\t%s\t%s\t%s\t%s\n",
+			names->rules, names->model, names->layout,
+			names->variant, names->options) < 0)
+		return NULL;
+	return header;
+}
+
+static struct xkb_keymap *keymap_load(struct wet_server *server,
+		const char *path, const char *header)
+{
+	struct xkb_keymap *keymap = NULL;
+	char *string = NULL;
+	size_t size = 0, header_len = strlen(header);
+	FILE *f = fopen(path, "r");
+
+	if (!f)
+		return NULL;
+	/* Keymaps are a few dozen kilobytes */
+	if (getdelim(&string, &size, '\0', f) > 0 &&
+			strncmp(string, header, header_len) == 0)
+		keymap = xkb_keymap_new_from_string(server->xkb_context,
+			string + header_len, XKB_KEYMAP_FORMAT_TEXT_V1,
+			XKB_KEYMAP_COMPILE_NO_FLAGS);
+	free(string);
+	fclose(f);
+	return keymap;
+}
+
+static void keymap_save(struct xkb_keymap *keymap, const char *path,
+		const char *header)
+{
+	char *string, *tmp;
+	FILE *f;
+
+	string = xkb_keymap_get_as_string(keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+	if (!string)
+		return;
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+		free(string);
+		return;
+	}
+
+	/* Write next to the final name and rename, so a concurrent start
+	 * never reads a half written file */
+	int fd = mkstemp(tmp);
+	if (fd >= 0) {
+		f = fdopen(fd, "w");
+		if (f) {
+			bool ok = fputs(header, f) >= 0 &&
+				fputs(string, f) >= 0;
+			if (fclose(f) == 0 && ok && rename(tmp, path) == 0)
+				tmp[0] = '\0';
+		} else {
+			close(fd);
+		}
+		if (tmp[0])
+			unlink(tmp);
+	}
+
+	free(tmp);
+	free(string);
+}
+
+struct xkb_keymap *keyboard_get_keymap(struct wet_server *server,
+		const struct xkb_rule_names *names)
+{
+	struct xkb_rule_names resolved;
+	struct wet_keymap *entry;
+	struct xkb_keymap *keymap = NULL;
+	char *path = NULL, *header = NULL;
+
+	if (!server->xkb_context)
+		return NULL;
+
+	resolve_names(names, &resolved);
+
+	wl_list_for_each(entry, &server->keymaps, link) {
+		if (strcmp(entry->rules, resolved.rules) == 0 &&
+				strcmp(entry->model, resolved.model) == 0 &&
+				strcmp(entry->layout, resolved.layout) == 0 &&
+				strcmp(entry->variant, resolved.variant) == 0 &&
+				strcmp(entry->options, resolved.options) == 0)
+			return entry->keymap;
+	}
+
+	if (server->keymap_cache_dir) {
+		path = keymap_cache_path(server, &resolved);
+		header = keymap_header(&resolved);
+		if (path && header)
+			keymap = keymap_load(server, path, header);
+	}
+	if (!keymap) {
+		/* Also when the cached file is for other names that happen to
+		 * hash the same, which then gets replaced */
+		keymap = xkb_keymap_new_from_names(server->xkb_context,
+			&resolved, XKB_KEYMAP_COMPILE_NO_FLAGS);
+		if (keymap && path && header)
+			keymap_save(keymap, path, header);
+	}
+	free(header);
+	free(path);
+	if (!keymap) {
+		printf("failed to compile keymap\n");
+		return NULL;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (entry) {
+		entry->rules = strdup(resolved.rules);
+		entry->model = strdup(resolved.model);
+		entry->layout = strdup(resolved.layout);
+		entry->variant = strdup(resolved.variant);
+		entry->options = strdup(resolved.options);
+	}
+	if (!entry || !entry->rules || !entry->model || !entry->layout ||
+			!entry->variant || !entry->options) {
+		/* The cache owns the keymaps it hands out */
+		if (entry) {
+			free(entry->rules);
+			free(entry->model);
+			free(entry->layout);
+			free(entry->variant);
+			free(entry->options);
+			free(entry);
+		}
+		xkb_keymap_unref(keymap);
+		return NULL;
+	}
+	entry->keymap = keymap;
+	wl_list_insert(&server->keymaps, &entry->link);
+
+	return keymap;
+}
+
+bool keyboard_init(struct wet_server *server)
+{
+	wl_list_init(&server->keymaps);
+
+	server->xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	if (!server->xkb_context) {
+		printf("failed to create xkb context\n");
+		return false;
+	}
+
+	/* Warm the cache with the default keymap, from disk if we can, so the
+	 * first keyboard doesn't stall the event loop. */
+	keyboard_get_keymap(server, NULL);
 
+	return true;
 }
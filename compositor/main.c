@@ -3,6 +3,7 @@
  * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
  */
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -15,40 +16,184 @@
 static int
 on_term_signal(int signal_number, void *data)
 {
-	struct wl_display *display = data;
+	struct wet_server *server = data;
 
 	//printf("caught signal %d\n", signal_number);
-	wl_display_terminate(display);
+	server_terminate(server);
+
+	return 1;
+}
+
+static void
+usage(const char *name)
+{
+	printf("Usage: %s [options]\n"
+	       "  -s <cmd>\tstartup command\n"
+	       "  -S <file>\tstart the desktop shell client, the only one\n"
+	       "\t\tallowed to bind weston_desktop_shell\n"
+	       "  -r <ms>\trepaint window before vblank, 0 to disable\n"
+	       "  -c\t\tcoalesce pointer motion until the pointer frame\n"
+	       "  -T\t\ttile views instead of floating them\n"
+	       "  -t <ms>\tlongest wait for clients in a layout transaction\n"
+	       "  -b <fps>\tframe callback cap for unfocused views, 0 for none\n"
+	       "  -k <dir>\tdirectory to cache compiled keymaps in\n"
+	       "  -o <w>x<h>[@<hz>][+<x>,<y>]\n"
+	       "\t\tadd a virtual output, can be repeated\n"
+	       "  -i <file>\tivi layers and surface placements\n"
+	       "  -H\t\tlay out ivi applications with the HMI controller\n"
+	       "  -U <file>\tstart the HMI client, the only one allowed to\n"
+	       "\t\tbind ivi_hmi_controller\n"
+	       "  -f <fd>\tlisten on this already bound Wayland socket\n"
+	       "  -l <resource>=<soft>[:<hard>]\n"
+	       "\t\tper-client limit on surfaces, nodes, shm or buffers\n"
+	       "\t\t(bytes, K/M/G), can be repeated\n"
+	       "  -j <count>\tthreads compositing pixman frames (default 1)\n"
+	       "  -x <file>\trecord a Chrome JSON trace, written to <file> on\n"
+	       "\t\tSIGUSR2 and at exit\n"
+	       "  -X <file>\tstream a Chrome JSON trace to <file> until exit\n"
+	       "  -W <ms>\treport event loop dispatches taking longer\n",
+	       name);
+}
+
+static int
+socket_activation_fd(void)
+{
+	/* systemd socket activation passes the socket as fd 3 */
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	int fd = -1;
+
+	if (pid && fds && atoi(pid) == getpid() && atoi(fds) >= 1)
+		fd = 3;
+	/* Not for the startup command */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+	return fd;
+}
+
+static int
+on_stats_signal(int signal_number, void *data)
+{
+	struct wet_server *server = data;
+
+	server_dump_stats(server, stdout);
+	/* The flight recorder's last events, if tracing */
+	trace_dump();
 
 	return 1;
 }
 
 int main(int argc, char *argv[]) {
 	char *startup_cmd = NULL;
+	const char *shell_client = NULL;
+	const char *hmi_client = NULL;
+	const char *ivi_config = NULL;
 	int ret = EXIT_FAILURE;
 	struct wl_display *display;
-	struct wl_event_source *signals[3];
+	struct wl_event_source *signals[4];
 	struct wl_event_loop *loop;
-	int i;
+	int i, socket_fd = -1;
 	struct wet_server server = { 0 };
+	struct wet_output_spec *spec;
+	struct wet_client_limit limit;
+	enum wet_client_resource resource;
+	struct wl_array outputs;
 	sigset_t mask;
 
+	clock_gettime(CLOCK_MONOTONIC, &server.startup.start);
+	wl_array_init(&outputs);
+
+	/* Same default as Weston's repaint-window */
+	server.repaint_window = 7;
+	server.transaction_timeout = 200;
+
 	int c;
-	while ((c = getopt(argc, argv, "s:h")) != -1) {
+	while ((c = getopt(argc, argv, "s:S:r:cTt:b:k:o:i:HU:f:l:j:x:X:W:h")) != -1) {
 		switch (c) {
 		case 's':
 			startup_cmd = optarg;
 			break;
+		case 'S':
+			shell_client = optarg;
+			break;
+		case 'r':
+			server.repaint_window = atoi(optarg);
+			break;
+		case 'c':
+			server.coalesce_motion = true;
+			break;
+		case 'T':
+			server.tiling = true;
+			break;
+		case 't':
+			server.transaction_timeout = atoi(optarg);
+			break;
+		case 'b':
+			server.background_fps = atoi(optarg);
+			break;
+		case 'k':
+			server.keymap_cache_dir = optarg;
+			break;
+		case 'o':
+			spec = wl_array_add(&outputs, sizeof(*spec));
+			if (!spec || !output_parse_spec(optarg, spec)) {
+				printf("invalid output '%s'\n", optarg);
+				usage(argv[0]);
+				wl_array_release(&outputs);
+				return 0;
+			}
+			break;
+		case 'i':
+			ivi_config = optarg;
+			server.ivi_enabled = true;
+			break;
+		case 'H':
+			server.hmi_enabled = true;
+			break;
+		case 'U':
+			hmi_client = optarg;
+			break;
+		case 'f':
+			socket_fd = atoi(optarg);
+			break;
+		case 'l':
+			if (!client_parse_limit(optarg, &resource, &limit)) {
+				printf("invalid limit '%s'\n", optarg);
+				usage(argv[0]);
+				wl_array_release(&outputs);
+				return 0;
+			}
+			server.client_limits[resource] = limit;
+			break;
+		case 'j':
+			server.render_threads = atoi(optarg);
+			break;
+		case 'x':
+		case 'X':
+			if (!trace_init(optarg, c == 'X')) {
+				wl_array_release(&outputs);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'W':
+			server.stall_threshold = atoi(optarg);
+			break;
 		default:
-			printf("Usage: %s [-s startup command]\n", argv[0]);
+			usage(argv[0]);
+			wl_array_release(&outputs);
 			return 0;
 		}
 	}
 	if (optind < argc) {
-		printf("Usage: %s [-s startup command]\n", argv[0]);
+		usage(argv[0]);
+		wl_array_release(&outputs);
 		return 0;
 	}
-
+	if (socket_fd < 0)
+		socket_fd = socket_activation_fd();
+	if (socket_fd >= 0)
+		fcntl(socket_fd, F_SETFD, FD_CLOEXEC);
 
 	server.wl_display = display = wl_display_create();
 	if (display == NULL) {
@@ -58,13 +203,19 @@ int main(int argc, char *argv[]) {
 
 	loop = wl_display_get_event_loop(display);
 	signals[0] = wl_event_loop_add_signal(loop, SIGTERM, on_term_signal,
-					      display);
+					      &server);
 	signals[1] = wl_event_loop_add_signal(loop, SIGINT, on_term_signal,
-					      display);
+					      &server);
 	signals[2] = wl_event_loop_add_signal(loop, SIGQUIT, on_term_signal,
-					      display);
+					      &server);
+	signals[3] = wl_event_loop_add_signal(loop, SIGUSR2, on_stats_signal,
+					      &server);
 
-	if (!signals[0] || !signals[1] || !signals[2])
+	if (!signals[0] || !signals[1] || !signals[2] || !signals[3])
+		goto out_signals;
+
+	/* Before anything slow, so clients can connect in the meantime */
+	if (!server_listen(&server, socket_fd))
 		goto out_signals;
 
 	/* Xwayland uses SIGUSR1 for communicating with weston. Since some
@@ -76,10 +227,27 @@ int main(int argc, char *argv[]) {
 	pthread_sigmask(SIG_BLOCK, &mask, NULL);
 
 	if (!server_init(&server))
-		return -1;
+		goto out_outputs;
+
+	if (ivi_config && !ivi_load_config(&server, ivi_config))
+		goto out_outputs;
 
 	if (!server_start(&server))
-		return -1;
+		goto out_outputs;
+
+	wl_array_for_each(spec, &outputs) {
+		if (!output_add_virtual(&server, spec)) {
+			printf("failed to create a %dx%d virtual output\n",
+			       spec->width, spec->height);
+			goto out_outputs;
+		}
+	}
+	startup_mark(&server, "outputs");
+
+	if (shell_client && !shell_launch(&server, shell_client))
+		goto out_outputs;
+	if (hmi_client && !hmi_launch(&server, hmi_client))
+		goto out_outputs;
 
 	if (startup_cmd) {
 		if (fork() == 0) {
@@ -87,17 +255,29 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	wl_display_run(server.wl_display);
+	server_run(&server);
 
-	/* Once wl_display_run returns, we shut down the server. */
+	/* Once server_run returns, we shut down the server. */
+	ipc_finish(&server);
+	metrics_finish(&server);
 	wl_display_destroy_clients(server.wl_display);
 	wl_display_destroy(server.wl_display);
+	render_finish(&server);
+	watchdog_finish(&server);
+	trace_dump();
+	trace_finish();
 
 out_signals:
 	for (i = ARRAY_LENGTH(signals) - 1; i >= 0; i--)
 		if (signals[i])
 			wl_event_source_remove(signals[i]);
 out_display:
+	wl_array_release(&outputs);
 
 	return ret;
+
+out_outputs:
+	/* Like before, the rest is left for the process exit to clean up */
+	wl_array_release(&outputs);
+	return -1;
 }
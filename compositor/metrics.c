@@ -0,0 +1,390 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <weston-pro.h>
+
+/*
+ * Read-only metrics socket at $XDG_RUNTIME_DIR/<display>.metrics. Every
+ * connection gets the current values in Prometheus' text format behind an
+ * HTTP/1.0 header, once its request headers are in, it hung up its end, or
+ * METRICS_TIMEOUT passed; what it asked for doesn't matter. Plain socat
+ * works, and so does a Prometheus scrape through a TCP to unix socket
+ * forwarder. The counters are fields bumped where things happen, the text
+ * is only built here, into a buffer allocated once.
+ *
+ * Closing a socket with unread data resets the connection, which may lose
+ * the response on its way, so the request is read first, and after the
+ * response we shut down our end and drain until the reader closes.
+ */
+
+#define METRICS_BUFFER_SIZE 65536
+#define METRICS_REQUEST_SIZE 4096
+#define METRICS_CONNECTIONS 16
+/* ms to send the request, and then to hang up */
+#define METRICS_TIMEOUT 1000
+
+struct wet_metrics_conn {
+	struct wl_list link; /* wet_metrics.conns */
+	struct wet_metrics *metrics;
+	int fd;
+	struct wl_event_source *source;
+	struct wl_event_source *timer;
+	/* Responded, only draining now */
+	bool responded;
+	char request[METRICS_REQUEST_SIZE];
+	size_t len;
+};
+
+struct wet_metrics {
+	struct wet_server *server;
+	char *path;
+	int fd;
+	struct wl_event_source *source;
+	struct wl_list conns; /* wet_metrics_conn.link */
+	int conn_count;
+
+	uint64_t keyboard_focus_changes;
+	uint64_t pointer_focus_changes;
+	struct wl_listener keyboard_focus_change;
+	struct wl_listener pointer_focus_change;
+
+	char buffer[METRICS_BUFFER_SIZE];
+	size_t len;
+};
+
+static void metrics_printf(struct wet_metrics *metrics, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void metrics_printf(struct wet_metrics *metrics, const char *fmt, ...)
+{
+	size_t avail = sizeof(metrics->buffer) - metrics->len;
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(metrics->buffer + metrics->len, avail, fmt, args);
+	va_end(args);
+	/* Cut short rather than grow */
+	if (len > 0)
+		metrics->len += (size_t)len < avail ? (size_t)len : avail - 1;
+}
+
+static void metrics_header(struct wet_metrics *metrics, const char *name,
+		const char *type, const char *help)
+{
+	metrics_printf(metrics, "# HELP weston_pro_%s %s\n"
+		"# TYPE weston_pro_%s %s\n", name, help, name, type);
+}
+
+static void metrics_summary(struct wet_metrics *metrics, const char *name,
+		const char *help, const struct wet_histogram *histogram)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99 };
+	size_t i;
+
+	metrics_header(metrics, name, "summary", help);
+	for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+		metrics_printf(metrics, "weston_pro_%s{quantile=\"%g\"} %g\n",
+			name, quantiles[i], histogram->count ?
+			histogram_percentile(histogram, quantiles[i]) / 1e3 :
+			0.0);
+	metrics_printf(metrics, "weston_pro_%s_sum %g\n"
+		"weston_pro_%s_count %" PRIu64 "\n", name,
+		histogram->sum_nsec / 1e9, name, histogram->count);
+}
+
+static void metrics_format(struct wet_metrics *metrics)
+{
+	struct wet_server *server = metrics->server;
+	struct wet_output *output;
+	uint64_t composited;
+	int i;
+
+	metrics->len = 0;
+	metrics_printf(metrics, "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n\r\n");
+
+	metrics_header(metrics, "frames_committed_total", "counter",
+		"Frames committed to the output");
+	wl_list_for_each(output, &server->outputs, link) {
+		composited = 0;
+		for (i = 0; i < WET_SCANOUT_FALLBACK_COUNT; i++)
+			composited += output->composited_frames[i];
+		metrics_printf(metrics, "weston_pro_frames_committed_total"
+			"{output=\"%s\",path=\"scanout\"} %" PRIu64 "\n"
+			"weston_pro_frames_committed_total"
+			"{output=\"%s\",path=\"composited\"} %" PRIu64 "\n",
+			output->wlr_output->name, output->scanout_frames,
+			output->wlr_output->name, composited);
+	}
+	metrics_header(metrics, "frames_skipped_total", "counter",
+		"Repaints with nothing to commit");
+	wl_list_for_each(output, &server->outputs, link)
+		metrics_printf(metrics, "weston_pro_frames_skipped_total"
+			"{output=\"%s\"} %" PRIu64 "\n",
+			output->wlr_output->name, output->skipped_frames);
+	metrics_header(metrics, "frames_late_total", "counter",
+		"Frames presented a vblank after the one aimed for");
+	wl_list_for_each(output, &server->outputs, link)
+		metrics_printf(metrics, "weston_pro_frames_late_total"
+			"{output=\"%s\"} %" PRIu64 "\n",
+			output->wlr_output->name, output->late_frames);
+
+	metrics_summary(metrics, "render_seconds",
+		"Time to render and commit a frame", &server->stats.render_time);
+
+	metrics_header(metrics, "clients", "gauge", "Connected clients");
+	metrics_printf(metrics, "weston_pro_clients %d\n",
+		wl_list_length(&server->clients));
+	metrics_header(metrics, "views", "gauge", "Mapped views");
+	metrics_printf(metrics, "weston_pro_views %d\n",
+		wl_list_length(&server->views));
+
+	metrics_header(metrics, "input_events_total", "counter",
+		"Input events handled, rate() gives events per second");
+	metrics_printf(metrics, "weston_pro_input_events_total"
+		"{device=\"pointer\"} %" PRIu64 "\n"
+		"weston_pro_input_events_total{device=\"keyboard\"} %" PRIu64
+		"\n", server->stats.pointer_events, server->stats.key_events);
+	metrics_header(metrics, "focus_changes_total", "counter",
+		"Seat focus changes");
+	metrics_printf(metrics, "weston_pro_focus_changes_total"
+		"{focus=\"keyboard\"} %" PRIu64 "\n"
+		"weston_pro_focus_changes_total{focus=\"pointer\"} %" PRIu64
+		"\n", metrics->keyboard_focus_changes,
+		metrics->pointer_focus_changes);
+}
+
+static void metrics_conn_destroy(struct wet_metrics_conn *conn)
+{
+	wl_event_source_remove(conn->timer);
+	wl_event_source_remove(conn->source);
+	close(conn->fd);
+	wl_list_remove(&conn->link);
+	conn->metrics->conn_count--;
+	free(conn);
+}
+
+static void metrics_conn_respond(struct wet_metrics_conn *conn)
+{
+	struct wet_metrics *metrics = conn->metrics;
+
+	/* A few kilobytes fit in the socket buffer, whatever doesn't is
+	 * dropped rather than waiting on the reader */
+	metrics_format(metrics);
+	send(conn->fd, metrics->buffer, metrics->len, MSG_NOSIGNAL);
+	shutdown(conn->fd, SHUT_WR);
+	conn->responded = true;
+	wl_event_source_timer_update(conn->timer, METRICS_TIMEOUT);
+}
+
+static int metrics_conn_handle_data(int fd, uint32_t mask, void *data)
+{
+	struct wet_metrics_conn *conn = data;
+	char drain[512];
+	ssize_t len;
+
+	if (conn->responded) {
+		while ((len = recv(fd, drain, sizeof(drain), 0)) > 0)
+			;
+		if (len == 0 || (errno != EAGAIN && errno != EINTR))
+			metrics_conn_destroy(conn);
+		return 0;
+	}
+
+	len = recv(fd, conn->request + conn->len,
+		sizeof(conn->request) - 1 - conn->len, 0);
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			metrics_conn_destroy(conn);
+		return 0;
+	}
+	/* Done asking */
+	if (len == 0) {
+		metrics_conn_respond(conn);
+		return 0;
+	}
+
+	conn->len += len;
+	conn->request[conn->len] = '\0';
+	if (strstr(conn->request, "\r\n\r\n") ||
+			strstr(conn->request, "\n\n"))
+		metrics_conn_respond(conn);
+	else if (conn->len == sizeof(conn->request) - 1)
+		metrics_conn_destroy(conn);
+
+	return 0;
+}
+
+static int metrics_conn_handle_timeout(void *data)
+{
+	/* A socat that sends nothing gets the values after the wait, a
+	 * reader that never hangs up is dropped */
+	struct wet_metrics_conn *conn = data;
+
+	if (conn->responded)
+		metrics_conn_destroy(conn);
+	else
+		metrics_conn_respond(conn);
+
+	return 0;
+}
+
+static int metrics_handle_connection(int fd, uint32_t mask, void *data)
+{
+	struct wet_metrics *metrics = data;
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(metrics->server->wl_display);
+	struct wet_metrics_conn *conn;
+	int client_fd;
+
+	client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client_fd < 0)
+		return 0;
+	if (metrics->conn_count >= METRICS_CONNECTIONS) {
+		close(client_fd);
+		return 0;
+	}
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn) {
+		close(client_fd);
+		return 0;
+	}
+	conn->metrics = metrics;
+	conn->fd = client_fd;
+	conn->source = wl_event_loop_add_fd(loop, client_fd, WL_EVENT_READABLE,
+		metrics_conn_handle_data, conn);
+	conn->timer = wl_event_loop_add_timer(loop,
+		metrics_conn_handle_timeout, conn);
+	if (!conn->source || !conn->timer) {
+		if (conn->source)
+			wl_event_source_remove(conn->source);
+		if (conn->timer)
+			wl_event_source_remove(conn->timer);
+		close(client_fd);
+		free(conn);
+		return 0;
+	}
+	wl_event_source_timer_update(conn->timer, METRICS_TIMEOUT);
+	wl_list_insert(&metrics->conns, &conn->link);
+	metrics->conn_count++;
+
+	return 0;
+}
+
+static void metrics_keyboard_focus_change(struct wl_listener *listener,
+		void *data)
+{
+	struct wet_metrics *metrics =
+		wl_container_of(listener, metrics, keyboard_focus_change);
+
+	metrics->keyboard_focus_changes++;
+}
+
+static void metrics_pointer_focus_change(struct wl_listener *listener,
+		void *data)
+{
+	struct wet_metrics *metrics =
+		wl_container_of(listener, metrics, pointer_focus_change);
+
+	metrics->pointer_focus_changes++;
+}
+
+bool metrics_init(struct wet_server *server, const char *socket_name)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct wet_metrics *metrics;
+
+	if (!dir) {
+		printf("XDG_RUNTIME_DIR is not set, no metrics socket\n");
+		return false;
+	}
+
+	metrics = calloc(1, sizeof(*metrics));
+	if (!metrics)
+		return false;
+	metrics->server = server;
+	metrics->fd = -1;
+	wl_list_init(&metrics->conns);
+	if (asprintf(&metrics->path, "%s/%s.metrics", dir, socket_name) < 0) {
+		metrics->path = NULL;
+		goto failed;
+	}
+	if (strlen(metrics->path) >= sizeof(addr.sun_path)) {
+		printf("metrics socket path too long\n");
+		goto failed;
+	}
+	strcpy(addr.sun_path, metrics->path);
+
+	metrics->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+		SOCK_CLOEXEC, 0);
+	if (metrics->fd < 0)
+		goto failed;
+	unlink(metrics->path);
+	if (bind(metrics->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(metrics->fd, 16) < 0) {
+		printf("failed to bind the metrics socket %s\n", metrics->path);
+		goto failed;
+	}
+
+	metrics->source = wl_event_loop_add_fd(
+		wl_display_get_event_loop(server->wl_display), metrics->fd,
+		WL_EVENT_READABLE, metrics_handle_connection, metrics);
+	if (!metrics->source)
+		goto failed;
+
+	metrics->keyboard_focus_change.notify = metrics_keyboard_focus_change;
+	wl_signal_add(&server->seat->keyboard_state.events.focus_change,
+		&metrics->keyboard_focus_change);
+	metrics->pointer_focus_change.notify = metrics_pointer_focus_change;
+	wl_signal_add(&server->seat->pointer_state.events.focus_change,
+		&metrics->pointer_focus_change);
+
+	server->metrics = metrics;
+	return true;
+
+failed:
+	if (metrics->fd >= 0) {
+		close(metrics->fd);
+		unlink(metrics->path);
+	}
+	free(metrics->path);
+	free(metrics);
+	return false;
+}
+
+void metrics_finish(struct wet_server *server)
+{
+	struct wet_metrics *metrics = server->metrics;
+	struct wet_metrics_conn *conn, *tmp;
+
+	if (!metrics)
+		return;
+
+	wl_list_for_each_safe(conn, tmp, &metrics->conns, link)
+		metrics_conn_destroy(conn);
+	wl_list_remove(&metrics->keyboard_focus_change.link);
+	wl_list_remove(&metrics->pointer_focus_change.link);
+	wl_event_source_remove(metrics->source);
+	close(metrics->fd);
+	unlink(metrics->path);
+	free(metrics->path);
+	free(metrics);
+	server->metrics = NULL;
+}
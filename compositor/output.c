@@ -3,27 +3,401 @@
  * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <weston-pro.h>
 
-static void output_frame(struct wl_listener *listener, void *data)
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000LL
+
+static int64_t timespec_sub_to_nsec(const struct timespec *a,
+		const struct timespec *b) {
+	return (int64_t)(a->tv_sec - b->tv_sec) * NSEC_PER_SEC +
+		(a->tv_nsec - b->tv_nsec);
+}
+
+static void timespec_add_nsec(struct timespec *r, const struct timespec *a,
+		int64_t b) {
+	r->tv_sec = a->tv_sec + b / NSEC_PER_SEC;
+	r->tv_nsec = a->tv_nsec + b % NSEC_PER_SEC;
+	if (r->tv_nsec >= NSEC_PER_SEC) {
+		r->tv_sec++;
+		r->tv_nsec -= NSEC_PER_SEC;
+	}
+}
+
+struct scanout_data {
+	struct wlr_box box;
+	struct wlr_surface *surface;
+	int sx, sy;
+	int count;
+};
+
+static void scanout_iterator(struct wlr_surface *surface, int sx, int sy,
+		void *data)
 {
-	/* This function is called every time an output is ready to display a frame,
-	 * generally at the output's refresh rate (e.g. 60Hz). */
-	struct wet_output *output = wl_container_of(listener, output, frame);
-	struct wlr_scene *scene = output->server->scene;
+	struct scanout_data *scanout = data;
+
+	scanout->surface = surface;
+	scanout->sx = sx;
+	scanout->sy = sy;
+	scanout->count++;
+}
+
+/* Mirrors the checks wlr_scene does before trying direct scanout, to tell
+ * why a composited frame could not skip the renderer. */
+static enum wet_scanout_fallback output_scanout_fallback(
+		struct wet_output *output, struct wlr_scene_output *scene_output)
+{
+	struct wlr_output *wlr_output = output->wlr_output;
+	struct scanout_data scanout = { 0 };
+	struct wlr_surface *surface;
+
+	scanout.box.x = scene_output->x;
+	scanout.box.y = scene_output->y;
+	wlr_output_effective_resolution(wlr_output, &scanout.box.width,
+		&scanout.box.height);
+	wlr_scene_output_for_each_surface(scene_output, scanout_iterator,
+		&scanout);
+
+	if (scanout.count == 0)
+		return WET_SCANOUT_NO_SURFACE;
+	if (scanout.count > 1)
+		return WET_SCANOUT_MULTIPLE_SURFACES;
+
+	surface = scanout.surface;
+	if (scanout.sx != scanout.box.x || scanout.sy != scanout.box.y ||
+			surface->current.width != scanout.box.width ||
+			surface->current.height != scanout.box.height)
+		return WET_SCANOUT_GEOMETRY;
+	if (surface->current.transform != wlr_output->transform ||
+			surface->current.scale != wlr_output->scale)
+		return WET_SCANOUT_TRANSFORM;
+
+	return WET_SCANOUT_REJECTED;
+}
+
+static void send_frame_done_iterator(struct wlr_surface *surface,
+		int sx, int sy, void *data)
+{
+	wlr_surface_send_frame_done(surface, data);
+}
+
+static void view_add_opaque(struct wet_view *view, pixman_region32_t *opaque)
+{
+	/* Only the toplevel surface, it sits at the origin of the view node */
+	struct wlr_surface *surface = view->xdg_surface->surface;
+	pixman_region32_t region;
+
+	pixman_region32_init(&region);
+	pixman_region32_copy(&region, &surface->opaque_region);
+	pixman_region32_intersect_rect(&region, &region, 0, 0,
+		surface->current.width, surface->current.height);
+	pixman_region32_translate(&region, view->x, view->y);
+	pixman_region32_union(opaque, opaque, &region);
+	pixman_region32_fini(&region);
+}
+
+static void output_send_frame_done(struct wet_output *output,
+		const struct timespec *now)
+{
+	/*
+	 * Frame callbacks pace client rendering, so they are withheld from
+	 * views nobody can see: hidden behind a fullscreen view or the opaque
+	 * regions of the views above, or outside every output. Views without
+	 * keyboard focus are held to background_fps if set. Views on several
+	 * outputs get callbacks from each, like wlr_scene does.
+	 */
+	struct wet_server *server = output->server;
+	struct wlr_surface *focused = server->seat->keyboard_state.focused_surface;
+	struct wlr_box *output_box, *box, intersection;
+	struct wet_view *view;
+	pixman_region32_t opaque;
+	int64_t interval, slack;
+	bool first_output;
+
+	output_box = wlr_output_layout_get_box(server->output_layout,
+		output->wlr_output);
+	if (!output_box)
+		return;
+
+	interval = server->background_fps > 0 ?
+		NSEC_PER_SEC / server->background_fps : 0;
+	/* Don't let vblank jitter turn a 30 fps cap at 60 Hz into 20 fps */
+	slack = output->refresh_nsec / 2;
+
+	/* Views outside every output have no output of their own to count
+	 * withheld callbacks against, the first one does */
+	first_output = server->outputs.next == &output->link;
+
+	pixman_region32_init(&opaque);
 
+	/* server->views is in stacking order, topmost first. A withheld
+	 * callback counts once per frame of an output the view is on. */
+	wl_list_for_each(view, &server->views, link) {
+		box = &view->spatial.box;
+		if (!wlr_output_layout_intersects(server->output_layout, NULL,
+				box)) {
+			if (first_output)
+				view->frames.offscreen++;
+			continue;
+		}
+		if (!wlr_box_intersection(&intersection, output_box, box))
+			continue;
+		if (!view->scene_node->state.enabled) {
+			view->frames.occluded++;
+			continue;
+		}
+		if (pixman_region32_contains_rectangle(&opaque,
+				&(pixman_box32_t){ box->x, box->y,
+					box->x + box->width,
+					box->y + box->height }) == PIXMAN_REGION_IN) {
+			view->frames.occluded++;
+			continue;
+		}
+		view_add_opaque(view, &opaque);
+
+		if (interval > 0 && view->xdg_surface->surface != focused &&
+				view->frames.last_done.tv_sec != 0 &&
+				timespec_sub_to_nsec(now, &view->frames.last_done) +
+					slack < interval) {
+			view->frames.background++;
+			continue;
+		}
+
+		view->frames.last_done = *now;
+		view->frames.sent++;
+		wlr_scene_node_for_each_surface(view->scene_node,
+			send_frame_done_iterator, (void *)now);
+	}
+
+	pixman_region32_fini(&opaque);
+
+	/* ivi surfaces, outside of hidden layers */
+	ivi_send_frame_done(server, output_box, now);
+	/* Shell surfaces which committed since the last frame */
+	shell_send_frame_done(server, output->wlr_output, output_box, now);
+}
+
+static void output_repaint(struct wet_output *output)
+{
+	struct wlr_scene *scene = output->server->scene;
 	struct wlr_scene_output *scene_output = wlr_scene_get_scene_output(
 		scene, output->wlr_output);
+	uint32_t commit_seq = output->wlr_output->commit_seq;
+	struct wet_trace_span span = trace_begin("output_repaint"), commit;
+	struct timespec start, now;
+	int64_t render_nsec;
+
+	output->repaint_scheduled = false;
 
 	/* Render the scene if needed and commit the output */
-	wlr_scene_output_commit(scene_output);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	commit = trace_begin("scene_output_commit");
+	render_output_commit(output->server, scene_output);
+	trace_end_str(&commit, "output", output->wlr_output->name);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	render_nsec = timespec_sub_to_nsec(&now, &start);
+
+	/* Only count frames which actually reached the output, an undamaged
+	 * scene doesn't commit anything. */
+	if (output->wlr_output->commit_seq != commit_seq) {
+		if (!output->server->startup.first_frame) {
+			output->server->startup.first_frame = true;
+			startup_mark(output->server, "first frame");
+			startup_print(output->server, stdout);
+		}
+		output->frame_start = start;
+		histogram_add(&output->server->stats.render_time, render_nsec);
+		if (scene_output->prev_scanout)
+			output->scanout_frames++;
+		else
+			output->composited_frames[output_scanout_fallback(
+				output, scene_output)]++;
+	} else {
+		output->skipped_frames++;
+	}
 
+	/* Track how long a repaint takes so the repaint window never gets
+	 * shorter than the work we have to fit into it. Grow immediately when
+	 * a frame was slower than expected, shrink back slowly. */
+	if (render_nsec > output->render_nsec)
+		output->render_nsec = render_nsec;
+	else
+		output->render_nsec -= (output->render_nsec - render_nsec) / 16;
+
+	/* Clients get their frame callbacks right after the repaint, which
+	 * leaves them a full refresh period to hit the next one. */
+	output_send_frame_done(output, &now);
+	trace_end_str(&span, "output", output->wlr_output->name);
+}
+
+static int output_repaint_timer_handler(void *data)
+{
+	struct wet_output *output = data;
+
+	output_repaint(output);
+
+	return 0;
+}
+
+/* Returns how many milliseconds to wait before repainting so that the
+ * repaint finishes shortly before the next vblank, or 0 to repaint now. */
+static int output_repaint_delay(struct wet_output *output,
+		const struct timespec *now)
+{
+	int64_t refresh = output->refresh_nsec;
+	int64_t window, since_present, vblank, deadline;
+
+	if (output->server->repaint_window <= 0 || refresh <= 0 ||
+			output->last_present.tv_sec == 0 || !output->repaint_timer)
+		return 0;
+
+	window = (int64_t)output->server->repaint_window * NSEC_PER_MSEC;
+	if (window < output->render_nsec + NSEC_PER_MSEC)
+		window = output->render_nsec + NSEC_PER_MSEC;
+	if (window >= refresh)
+		return 0;
+
+	/* Predict the next vblank from the last presentation. The frame event
+	 * can also come from wlr_output_schedule_frame() after an idle period,
+	 * so skip over the vblanks that already went by. */
+	since_present = timespec_sub_to_nsec(now, &output->last_present);
+	if (since_present < 0)
+		since_present = 0;
+	vblank = (since_present / refresh + 1) * refresh;
+	deadline = vblank - window;
+	if (deadline <= since_present)
+		return 0;
+
+	timespec_add_nsec(&output->next_vblank, &output->last_present, vblank);
+	return (deadline - since_present) / NSEC_PER_MSEC;
+}
+
+static void output_frame(struct wl_listener *listener, void *data)
+{
+	/* This function is called every time an output is ready to display a frame,
+	 * generally at the output's refresh rate (e.g. 60Hz). Rather than
+	 * rendering right away, which would leave almost a whole refresh period
+	 * between sampling client content and scanout, the repaint is delayed
+	 * until repaint_window milliseconds before the next vblank, like
+	 * Weston's repaint window. */
+	struct wet_output *output = wl_container_of(listener, output, frame);
+	struct wet_trace_span span = trace_begin("output_frame");
 	struct timespec now;
+	int delay;
+
+	if (output->repaint_scheduled)
+		goto out;
+
 	clock_gettime(CLOCK_MONOTONIC, &now);
-	wlr_scene_output_send_frame_done(scene_output, &now);
+	delay = output_repaint_delay(output, &now);
+	if (delay <= 0) {
+		output_repaint(output);
+		goto out;
+	}
+
+	output->repaint_scheduled = true;
+	wl_event_source_timer_update(output->repaint_timer, delay);
+out:
+	trace_end_str(&span, "output", output->wlr_output->name);
+}
+
+static void output_views_presented(struct wet_output *output,
+		const struct wlr_output_event_present *event)
+{
+	/* Account the views whose commits made it into this frame */
+	struct wet_server *server = output->server;
+	struct wlr_box *output_box, intersection;
+	struct wet_view *view;
+	int64_t refresh = event->refresh, since, latency;
+	bool missed;
+
+	output_box = wlr_output_layout_get_box(server->output_layout,
+		output->wlr_output);
+	if (!output_box)
+		return;
+
+	wl_list_for_each(view, &server->views, link) {
+		if (view->commit_time.tv_sec == 0 ||
+				timespec_sub_to_nsec(&output->frame_start,
+					&view->commit_time) < 0 ||
+				!wlr_box_intersection(&intersection, output_box,
+					&view->spatial.box))
+			continue;
+
+		latency = timespec_sub_to_nsec(event->when, &view->commit_time);
+		/* The commit could have made the first vblank after it, unless
+		 * it came in after the previous frame was presented and we
+		 * have no prediction */
+		missed = false;
+		if (refresh > 0 && output->last_present.tv_sec != 0) {
+			since = timespec_sub_to_nsec(&view->commit_time,
+				&output->last_present);
+			if (since >= 0)
+				missed = latency > (since / refresh + 1) * refresh -
+					since + refresh / 2;
+		}
+
+		client_view_presented(view, latency, missed);
+		view->commit_time.tv_sec = 0;
+	}
+}
+
+static void output_present(struct wl_listener *listener, void *data)
+{
+	struct wet_output *output = wl_container_of(listener, output, present);
+	struct wlr_output_event_present *event = data;
+	int64_t late;
+
+	if (event->when == NULL)
+		return;
+
+	if (event->presented)
+		output_views_presented(output, event);
+
+	/* A presentation landing one vblank after the one we aimed for means
+	 * the repaint started too late; widen the window for the next frames.
+	 * Anything later than that is an idle output, not a miss. */
+	if (output->next_vblank.tv_sec != 0 && event->refresh > 0) {
+		late = timespec_sub_to_nsec(event->when, &output->next_vblank);
+		if (late > event->refresh / 2 && late < event->refresh * 2) {
+			output->late_frames++;
+			if (output->render_nsec < event->refresh)
+				output->render_nsec += NSEC_PER_MSEC;
+		}
+		output->next_vblank.tv_sec = 0;
+	}
+
+	output->last_present = *event->when;
+	output->refresh_nsec = event->refresh;
+}
+
+static void output_destroy(struct wl_listener *listener, void *data)
+{
+	struct wet_output *output = wl_container_of(listener, output, destroy);
+	struct wet_view *view;
+
+	ipc_send_event(output->server, "output-remove %s",
+		output->wlr_output->name);
+
+	wl_list_for_each(view, &output->server->views, link) {
+		if (view->fullscreen_output == output->wlr_output)
+			view_set_fullscreen(view, false, NULL);
+	}
+
+	if (output->repaint_timer)
+		wl_event_source_remove(output->repaint_timer);
+	wl_list_remove(&output->frame.link);
+	wl_list_remove(&output->present.link);
+	wl_list_remove(&output->destroy.link);
+	wl_list_remove(&output->link);
+	tile_output_destroy(output);
+	free(output);
 }
 
 static void server_new_output(struct wl_listener *listener, void *data)
@@ -57,9 +431,18 @@ static void server_new_output(struct wl_listener *listener, void *data)
 		calloc(1, sizeof(struct wet_output));
 	output->wlr_output = wlr_output;
 	output->server = server;
+	output->refresh_nsec = wlr_output->refresh > 0 ?
+		NSEC_PER_SEC * 1000 / wlr_output->refresh : 0;
+	output->repaint_timer = wl_event_loop_add_timer(
+		wl_display_get_event_loop(server->wl_display),
+		output_repaint_timer_handler, output);
 	/* Sets up a listener for the frame notify event. */
 	output->frame.notify = output_frame;
 	wl_signal_add(&wlr_output->events.frame, &output->frame);
+	output->present.notify = output_present;
+	wl_signal_add(&wlr_output->events.present, &output->present);
+	output->destroy.notify = output_destroy;
+	wl_signal_add(&wlr_output->events.destroy, &output->destroy);
 	wl_list_insert(&server->outputs, &output->link);
 
 	/* Adds this to the output layout. The add_auto function arranges outputs
@@ -72,6 +455,126 @@ static void server_new_output(struct wl_listener *listener, void *data)
 	 * output (such as DPI, scale factor, manufacturer, etc).
 	 */
 	wlr_output_layout_add_auto(server->output_layout, wlr_output);
+	ipc_send_event(server, "output-add %s", wlr_output->name);
+}
+
+bool output_parse_spec(const char *str, struct wet_output_spec *spec)
+{
+	char *end;
+	double hz;
+	long v;
+
+	*spec = (struct wet_output_spec){ 0 };
+
+	errno = 0;
+	v = strtol(str, &end, 10);
+	if (errno || end == str || *end != 'x' || v <= 0 || v > 16384)
+		return false;
+	spec->width = v;
+	str = end + 1;
+	v = strtol(str, &end, 10);
+	if (errno || end == str || v <= 0 || v > 16384)
+		return false;
+	spec->height = v;
+	str = end;
+
+	if (*str == '@') {
+		hz = strtod(str + 1, &end);
+		if (errno || end == str + 1 || hz <= 0 || hz > 1000)
+			return false;
+		spec->refresh = hz * 1000 + 0.5;
+		str = end;
+	}
+
+	if (*str == '+') {
+		v = strtol(str + 1, &end, 10);
+		if (errno || end == str + 1 || *end != ',')
+			return false;
+		spec->x = v;
+		str = end + 1;
+		v = strtol(str, &end, 10);
+		if (errno || end == str)
+			return false;
+		spec->y = v;
+		spec->has_position = true;
+		str = end;
+	}
+
+	return *str == '\0';
+}
+
+struct wet_output *output_find(struct wet_server *server, const char *name)
+{
+	struct wet_output *output;
+
+	wl_list_for_each(output, &server->outputs, link) {
+		if (strcmp(output->wlr_output->name, name) == 0)
+			return output;
+	}
+	return NULL;
+}
+
+static struct wet_output *output_from_wlr(struct wet_server *server,
+		struct wlr_output *wlr_output)
+{
+	struct wet_output *output;
+
+	wl_list_for_each(output, &server->outputs, link) {
+		if (output->wlr_output == wlr_output)
+			return output;
+	}
+	return NULL;
+}
+
+struct wet_output *output_add_virtual(struct wet_server *server,
+		const struct wet_output_spec *spec)
+{
+	/* Only once the backend is started: before that, the headless backend
+	 * holds on to new outputs and server_new_output() doesn't run. */
+	struct wlr_output *wlr_output;
+	struct wet_output *output;
+
+	if (!server->headless_backend)
+		return NULL;
+
+	wlr_output = wlr_headless_add_output(server->headless_backend,
+		spec->width, spec->height);
+	if (!wlr_output)
+		return NULL;
+	output = output_from_wlr(server, wlr_output);
+	if (!output) {
+		wlr_output_destroy(wlr_output);
+		return NULL;
+	}
+
+	wlr_output_set_custom_mode(wlr_output, spec->width, spec->height,
+		spec->refresh);
+	wlr_output_enable(wlr_output, true);
+	if (!wlr_output_commit(wlr_output)) {
+		wlr_output_destroy(wlr_output);
+		return NULL;
+	}
+	output->refresh_nsec = wlr_output->refresh > 0 ?
+		NSEC_PER_SEC * 1000 / wlr_output->refresh : 0;
+
+	/* Adding an output again moves it, and takes it out of the automatic
+	 * left-to-right arrangement */
+	if (spec->has_position)
+		wlr_output_layout_add(server->output_layout, wlr_output,
+			spec->x, spec->y);
+
+	return output;
+}
+
+bool output_remove_virtual(struct wet_output *output)
+{
+	/* Real outputs go away with their hardware only */
+	if (!wlr_output_is_headless(output->wlr_output))
+		return false;
+
+	/* Frees output through output_destroy() */
+	wlr_output_destroy(output->wlr_output);
+	return true;
 }
 
 bool output_init(struct wet_server *server)
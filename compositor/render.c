@@ -0,0 +1,518 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <wlr/render/pixman.h>
+#include <wlr/types/wlr_buffer.h>
+#include <wlr/types/wlr_output_damage.h>
+
+#include <weston-pro.h>
+
+/*
+ * Parallel compositing for the pixman renderer. wlr_scene paints the damage
+ * of an output on the main thread only; here the damage is cut into tiles
+ * and a pool of threads, the main one included, composites them at the same
+ * time. A tile is painted like wlr_scene paints it, cleared to opaque black
+ * and then every surface composited over it from the bottom up, so the
+ * frame comes out the same. Frames wlr_scene might scan out directly,
+ * surfaces it would have to transform or scale, and views a transaction
+ * holds, are left to wlr_scene_output_commit().
+ *
+ * Client pixels are only read on the main thread, while wlroots gives
+ * access to them: that is what protects us from a client truncating its
+ * wl_shm pool, and only on the thread which asked. So the damaged part of
+ * every surface is copied first and the threads composite the copies.
+ */
+
+#define RENDER_TILE_WIDTH 256
+#define RENDER_TILE_HEIGHT 64
+
+/* A pixman buffer as plain data, each thread wraps it in its own image */
+struct render_image {
+	pixman_format_code_t format;
+	int width, height, stride;
+	uint32_t *data;
+	/* Sources only: output-local position, the surface it shows, and
+	 * where the copy starts in the client buffer */
+	int x, y;
+	struct wlr_surface *surface;
+	struct wlr_buffer *buffer;
+	int buffer_x, buffer_y;
+};
+
+struct render_job {
+	struct render_image target;
+	/* struct render_image, bottom first */
+	struct wl_array sources;
+	/* The pixels of the sources, copied from the clients */
+	struct wl_array staging;
+	/* pixman_image_t *, one row of sources per thread */
+	struct wl_array images;
+	/* pixman_box32_t, output-local */
+	struct wl_array tiles;
+	int tile_count;
+	/* Next tile and images row to claim, shared by the threads */
+	int next_tile;
+	int next_row;
+};
+
+struct wet_render_pool {
+	pthread_t *threads;
+	int thread_count;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	/* Bumped for every job, so workers tell a new one from the last */
+	uint64_t seq;
+	/* Workers not done with the current job yet */
+	int busy;
+	bool stop;
+	struct render_job job;
+};
+
+static pixman_image_t *render_image_wrap(const struct render_image *image)
+{
+	/* Sources outside of the damage have nothing copied */
+	if (!image->data)
+		return NULL;
+	return pixman_image_create_bits_no_clear(image->format, image->width,
+		image->height, image->data, image->stride);
+}
+
+static void render_job_run(struct render_job *job)
+{
+	/* pixman images aren't safe to share between threads, validating
+	 * one on use writes to it. The pixels are, as long as every thread
+	 * writes its own tiles. */
+	static const pixman_color_t black = { 0, 0, 0, 0xffff };
+	struct render_image *sources = job->sources.data;
+	int i, n, count = job->sources.size / sizeof(*sources);
+	pixman_image_t *target, **images;
+	pixman_box32_t *tile;
+	int x1, y1, x2, y2, tiles = 0;
+	struct wet_trace_span span = trace_begin("render_tiles");
+
+	target = render_image_wrap(&job->target);
+	if (!target)
+		goto out;
+	images = (pixman_image_t **)job->images.data + count *
+		__atomic_fetch_add(&job->next_row, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < count; i++)
+		images[i] = render_image_wrap(&sources[i]);
+
+	while ((n = __atomic_fetch_add(&job->next_tile, 1, __ATOMIC_RELAXED)) <
+			job->tile_count) {
+		tile = (pixman_box32_t *)job->tiles.data + n;
+		tiles++;
+		pixman_image_fill_boxes(PIXMAN_OP_SRC, target, &black, 1, tile);
+
+		for (i = 0; i < count; i++) {
+			x1 = sources[i].x > tile->x1 ? sources[i].x : tile->x1;
+			y1 = sources[i].y > tile->y1 ? sources[i].y : tile->y1;
+			x2 = sources[i].x + sources[i].width;
+			y2 = sources[i].y + sources[i].height;
+			if (x2 > tile->x2)
+				x2 = tile->x2;
+			if (y2 > tile->y2)
+				y2 = tile->y2;
+			if (!images[i] || x1 >= x2 || y1 >= y2)
+				continue;
+			pixman_image_composite32(PIXMAN_OP_OVER, images[i],
+				NULL, target, x1 - sources[i].x,
+				y1 - sources[i].y, 0, 0, x1, y1,
+				x2 - x1, y2 - y1);
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		if (images[i])
+			pixman_image_unref(images[i]);
+	pixman_image_unref(target);
+out:
+	trace_end(&span, "tiles", tiles);
+}
+
+static void *render_worker(void *data)
+{
+	struct wet_render_pool *pool = data;
+	uint64_t seq = 0;
+
+	trace_thread_name("render");
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && pool->seq == seq)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->stop)
+			break;
+		seq = pool->seq;
+
+		pthread_mutex_unlock(&pool->lock);
+		render_job_run(&pool->job);
+		pthread_mutex_lock(&pool->lock);
+
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static void render_pool_run(struct wet_render_pool *pool)
+{
+	struct render_job *job = &pool->job;
+
+	job->next_tile = 0;
+	job->next_row = 0;
+	/* Not worth waking anybody for a single tile */
+	if (job->tile_count <= 1) {
+		render_job_run(job);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->seq++;
+	pool->busy = pool->thread_count;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	render_job_run(job);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void render_add_tiles(struct render_job *job, pixman_region32_t *damage)
+{
+	pixman_box32_t *rects, *tile;
+	int i, n, x, y;
+
+	job->tiles.size = 0;
+	job->tile_count = 0;
+
+	rects = pixman_region32_rectangles(damage, &n);
+	for (i = 0; i < n; i++) {
+		for (y = rects[i].y1; y < rects[i].y2; y += RENDER_TILE_HEIGHT) {
+			for (x = rects[i].x1; x < rects[i].x2;
+					x += RENDER_TILE_WIDTH) {
+				tile = wl_array_add(&job->tiles, sizeof(*tile));
+				if (!tile)
+					return;
+				tile->x1 = x;
+				tile->y1 = y;
+				tile->x2 = x + RENDER_TILE_WIDTH < rects[i].x2 ?
+					x + RENDER_TILE_WIDTH : rects[i].x2;
+				tile->y2 = y + RENDER_TILE_HEIGHT < rects[i].y2 ?
+					y + RENDER_TILE_HEIGHT : rects[i].y2;
+				job->tile_count++;
+			}
+		}
+	}
+}
+
+struct render_collect {
+	struct wlr_scene_output *scene_output;
+	struct wl_array *sources;
+	int width, height;
+	/* Surfaces on the output, and whether one covers it exactly */
+	int count;
+	bool covers_output;
+	bool supported;
+};
+
+static void render_collect_iterator(struct wlr_surface *surface, int sx,
+		int sy, void *data)
+{
+	struct render_collect *collect = data;
+	struct wlr_texture *texture = wlr_surface_get_texture(surface);
+	struct render_image *source;
+	pixman_image_t *image;
+
+	collect->count++;
+	if (sx == collect->scene_output->x && sy == collect->scene_output->y &&
+			surface->current.width == collect->width &&
+			surface->current.height == collect->height)
+		collect->covers_output = true;
+
+	/* wlr_scene skips these too */
+	if (!texture)
+		return;
+
+	if (surface->current.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+			surface->current.scale != 1 ||
+			surface->current.viewport.has_src ||
+			surface->current.viewport.has_dst ||
+			surface->current.buffer_width != surface->current.width ||
+			surface->current.buffer_height != surface->current.height) {
+		collect->supported = false;
+		return;
+	}
+
+	/* The texture keeps the client buffer it shows alive */
+	image = wlr_pixman_texture_get_image(texture);
+	source = wl_array_add(collect->sources, sizeof(*source));
+	if (!image || !source || !surface->buffer ||
+			!surface->buffer->source) {
+		collect->supported = false;
+		return;
+	}
+	source->format = pixman_image_get_format(image);
+	source->width = pixman_image_get_width(image);
+	source->height = pixman_image_get_height(image);
+	source->stride = 0;
+	source->data = NULL;
+	source->x = sx - collect->scene_output->x;
+	source->y = sy - collect->scene_output->y;
+	source->surface = surface;
+	source->buffer = surface->buffer->source;
+}
+
+static bool render_stage_sources(struct render_job *job,
+		pixman_region32_t *damage)
+{
+	/* Only the part of a source under the damage is ever composited */
+	pixman_box32_t *extents = pixman_region32_extents(damage);
+	struct render_image *source;
+	size_t total = 0, bpp, row_size;
+	int x1, y1, x2, y2, row;
+	uint32_t format;
+	size_t stride;
+	uint8_t *staging, *data;
+
+	wl_array_for_each(source, &job->sources) {
+		x1 = source->x > extents->x1 ? source->x : extents->x1;
+		y1 = source->y > extents->y1 ? source->y : extents->y1;
+		x2 = source->x + source->width < extents->x2 ?
+			source->x + source->width : extents->x2;
+		y2 = source->y + source->height < extents->y2 ?
+			source->y + source->height : extents->y2;
+		if (x1 >= x2 || y1 >= y2) {
+			source->width = source->height = 0;
+			continue;
+		}
+		source->buffer_x = x1 - source->x;
+		source->buffer_y = y1 - source->y;
+		source->x = x1;
+		source->y = y1;
+		source->width = x2 - x1;
+		source->height = y2 - y1;
+		bpp = PIXMAN_FORMAT_BPP(source->format) / 8;
+		source->stride = (source->width * bpp + 3) & ~3;
+		total += (size_t)source->stride * source->height;
+	}
+
+	job->staging.size = 0;
+	staging = total ? wl_array_add(&job->staging, total) : NULL;
+	if (total && !staging)
+		return false;
+
+	wl_array_for_each(source, &job->sources) {
+		if (source->width == 0)
+			continue;
+		if (!wlr_buffer_begin_data_ptr_access(source->buffer,
+				WLR_BUFFER_DATA_PTR_ACCESS_READ, (void **)&data,
+				&format, &stride))
+			return false;
+		bpp = PIXMAN_FORMAT_BPP(source->format) / 8;
+		row_size = source->width * bpp;
+		data += source->buffer_y * stride + source->buffer_x * bpp;
+		for (row = 0; row < source->height; row++)
+			memcpy(staging + row * source->stride,
+				data + row * stride, row_size);
+		wlr_buffer_end_data_ptr_access(source->buffer);
+
+		source->data = (uint32_t *)staging;
+		staging += (size_t)source->stride * source->height;
+	}
+	return true;
+}
+
+static bool render_reserve_images(struct render_job *job, int threads)
+{
+	/* Kept from frame to frame, only grows with the sources */
+	size_t size = (size_t)threads * (job->sources.size /
+		sizeof(struct render_image)) * sizeof(pixman_image_t *);
+
+	job->images.size = 0;
+	return size == 0 || wl_array_add(&job->images, size);
+}
+
+bool render_output_commit(struct wet_server *server,
+		struct wlr_scene_output *scene_output)
+{
+	struct wet_render_pool *pool = server->render_pool;
+	struct wlr_output *output = scene_output->output;
+	struct render_job *job;
+	struct render_collect collect = { 0 };
+	struct render_image *source;
+	pixman_image_t *target;
+	pixman_region32_t damage;
+	struct wet_trace_span span;
+	bool needs_frame, staged, ret = false;
+
+	/* Views held by a transaction are scene buffers, which only
+	 * wlr_scene paints */
+	if (!pool || output->transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+			output->scale != 1.0f ||
+			transaction_holds_output(server, output))
+		return wlr_scene_output_commit(scene_output);
+
+	job = &pool->job;
+	job->sources.size = 0;
+	collect.scene_output = scene_output;
+	collect.sources = &job->sources;
+	collect.supported = true;
+	wlr_output_effective_resolution(output, &collect.width,
+		&collect.height);
+	wlr_scene_output_for_each_surface(scene_output,
+		render_collect_iterator, &collect);
+
+	/* wlr_scene tries direct scanout when a single surface covers the
+	 * output, let it */
+	if (!collect.supported || (collect.count == 1 && collect.covers_output))
+		return wlr_scene_output_commit(scene_output);
+
+	/* Coming back from direct scanout, the buffer has nothing of ours */
+	if (scene_output->prev_scanout) {
+		wlr_output_damage_add_whole(scene_output->damage);
+		scene_output->prev_scanout = false;
+	}
+
+	pixman_region32_init(&damage);
+	if (!wlr_output_damage_attach_render(scene_output->damage,
+			&needs_frame, &damage))
+		goto out;
+	if (!needs_frame) {
+		wlr_output_rollback(output);
+		ret = true;
+		goto out;
+	}
+
+	pixman_region32_intersect_rect(&damage, &damage, 0, 0,
+		output->width, output->height);
+	span = trace_begin("render_stage");
+	staged = render_stage_sources(job, &damage) &&
+		render_reserve_images(job, pool->thread_count + 1);
+	trace_end(&span, "sources", job->sources.size / sizeof(*source));
+	if (!staged) {
+		/* wlroots paints them itself, or fails just the same */
+		wlr_output_rollback(output);
+		pixman_region32_fini(&damage);
+		return wlr_scene_output_commit(scene_output);
+	}
+
+	wlr_renderer_begin(server->renderer, output->width, output->height);
+	target = wlr_pixman_renderer_get_current_image(server->renderer);
+	job->target.format = pixman_image_get_format(target);
+	job->target.width = pixman_image_get_width(target);
+	job->target.height = pixman_image_get_height(target);
+	job->target.stride = pixman_image_get_stride(target);
+	job->target.data = pixman_image_get_data(target);
+
+	render_add_tiles(job, &damage);
+	render_pool_run(pool);
+	server->stats.render_parallel_frames++;
+	server->stats.render_tiles += job->tile_count;
+
+	wlr_renderer_scissor(server->renderer, NULL);
+	wlr_output_render_software_cursors(output, &damage);
+	wlr_renderer_end(server->renderer);
+
+	wl_array_for_each(source, &job->sources)
+		wlr_presentation_surface_sampled_on_output(server->presentation,
+			source->surface, output);
+
+	wlr_output_set_damage(output, &scene_output->damage->current);
+	ret = wlr_output_commit(output);
+out:
+	pixman_region32_fini(&damage);
+	return ret;
+}
+
+bool render_init(struct wet_server *server)
+{
+	struct wet_render_pool *pool;
+	int i;
+
+	if (server->render_threads <= 1)
+		return true;
+	if (!wlr_renderer_is_pixman(server->renderer)) {
+		printf("render threads only help the pixman renderer, "
+		       "rendering on one thread\n");
+		return true;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return false;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	wl_array_init(&pool->job.sources);
+	wl_array_init(&pool->job.staging);
+	wl_array_init(&pool->job.images);
+	wl_array_init(&pool->job.tiles);
+
+	/* The main thread takes tiles too */
+	pool->threads = calloc(server->render_threads - 1,
+		sizeof(*pool->threads));
+	if (!pool->threads)
+		goto failed;
+	for (i = 0; i < server->render_threads - 1; i++) {
+		if (pthread_create(&pool->threads[i], NULL, render_worker,
+				pool) != 0) {
+			printf("failed to start render thread %d\n", i);
+			break;
+		}
+		pool->thread_count++;
+	}
+	if (pool->thread_count == 0)
+		goto failed;
+
+	server->render_pool = pool;
+	return true;
+
+failed:
+	free(pool->threads);
+	wl_array_release(&pool->job.sources);
+	wl_array_release(&pool->job.staging);
+	wl_array_release(&pool->job.images);
+	wl_array_release(&pool->job.tiles);
+	free(pool);
+	return false;
+}
+
+void render_finish(struct wet_server *server)
+{
+	struct wet_render_pool *pool = server->render_pool;
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->thread_count; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	wl_array_release(&pool->job.sources);
+	wl_array_release(&pool->job.staging);
+	wl_array_release(&pool->job.images);
+	wl_array_release(&pool->job.tiles);
+	free(pool->threads);
+	free(pool);
+	server->render_pool = NULL;
+}
@@ -5,6 +5,9 @@
 
 #include <stdlib.h>
 
+#include <wlr/types/wlr_keyboard_group.h>
+#include <wlr/types/wlr_virtual_keyboard_v1.h>
+
 #include <weston-pro.h>
 
 static void seat_request_cursor(struct wl_listener *listener, void *data) {
@@ -14,6 +17,7 @@ static void seat_request_cursor(struct wl_listener *listener, void *data) {
 	struct wlr_seat_pointer_request_set_cursor_event *event = data;
 	struct wlr_seat_client *focused_client =
 		server->seat->pointer_state.focused_client;
+	struct wet_trace_span span = trace_begin("seat_request_cursor");
 	/* This can be sent by any client, so we check to make sure this one is
 	 * actually has pointer focus first. */
 	if (focused_client == event->seat_client) {
@@ -24,6 +28,7 @@ static void seat_request_cursor(struct wl_listener *listener, void *data) {
 		wlr_cursor_set_surface(server->cursor, event->surface,
 				event->hotspot_x, event->hotspot_y);
 	}
+	trace_end(&span, NULL, 0);
 }
 
 static void seat_request_set_selection(struct wl_listener *listener, void *data) {
@@ -34,7 +39,19 @@ static void seat_request_set_selection(struct wl_listener *listener, void *data)
 	struct wet_server *server = wl_container_of(
 			listener, server, request_set_selection);
 	struct wlr_seat_request_set_selection_event *event = data;
+	struct wet_trace_span span = trace_begin("seat_request_set_selection");
 	wlr_seat_set_selection(server->seat, event->source, event->serial);
+	trace_end(&span, NULL, 0);
+}
+
+static void seat_set_keyboard(struct wet_server *server,
+		struct wlr_input_device *device) {
+	/* Every time the seat keyboard changes, wlroots resends the keymap to
+	 * all clients, count those. */
+	if (server->seat->keyboard_state.keyboard != device->keyboard) {
+		server->stats.keymap_sends++;
+	}
+	wlr_seat_set_keyboard(server->seat, device);
 }
 
 static void keyboard_handle_modifiers(
@@ -43,16 +60,19 @@ static void keyboard_handle_modifiers(
 	 * pressed. We simply communicate this to the client. */
 	struct wet_keyboard *keyboard =
 		wl_container_of(listener, keyboard, modifiers);
+	struct wet_trace_span span = trace_begin("keyboard_modifiers");
 	/*
 	 * A seat can only have one keyboard, but this is a limitation of the
-	 * Wayland protocol - not wlroots. We assign all connected keyboards to the
-	 * same seat. You can swap out the underlying wlr_keyboard like this and
-	 * wlr_seat handles this transparently.
+	 * Wayland protocol - not wlroots. Keyboards with matching keymaps are
+	 * merged into one keyboard group, so this is a no-op for them; the
+	 * others are swapped in here and wlr_seat resends their keymap.
 	 */
-	wlr_seat_set_keyboard(keyboard->server->seat, keyboard->device);
-	/* Send modifiers to the client. */
-	wlr_seat_keyboard_notify_modifiers(keyboard->server->seat,
-		&keyboard->device->keyboard->modifiers);
+	seat_set_keyboard(keyboard->server, keyboard->device);
+	/* Send modifiers to the input method, or else the client. */
+	if (!text_input_handle_modifiers(keyboard->server, keyboard->device))
+		wlr_seat_keyboard_notify_modifiers(keyboard->server->seat,
+			&keyboard->device->keyboard->modifiers);
+	trace_end(&span, NULL, 0);
 }
 
 static bool handle_keybinding(struct wet_server *server, xkb_keysym_t sym) {
@@ -65,7 +85,7 @@ static bool handle_keybinding(struct wet_server *server, xkb_keysym_t sym) {
 	 */
 	switch (sym) {
 	case XKB_KEY_Escape:
-		wl_display_terminate(server->wl_display);
+		server_terminate(server);
 		break;
 	case XKB_KEY_F1:
 		/* Cycle to the next view */
@@ -90,6 +110,7 @@ static void keyboard_handle_key(
 	struct wet_server *server = keyboard->server;
 	struct wlr_event_keyboard_key *event = data;
 	struct wlr_seat *seat = server->seat;
+	struct wet_trace_span span = trace_begin("keyboard_key");
 
 	/* Translate libinput keycode -> xkbcommon */
 	uint32_t keycode = event->keycode + 8;
@@ -100,6 +121,7 @@ static void keyboard_handle_key(
 
 	bool handled = false;
 	uint32_t modifiers = wlr_keyboard_get_modifiers(keyboard->device->keyboard);
+	server->stats.key_events++;
 	if ((modifiers & WLR_MODIFIER_ALT) &&
 			event->state == WL_KEYBOARD_KEY_STATE_PRESSED) {
 		/* If alt is held down and this button was _pressed_, we attempt to
@@ -109,12 +131,98 @@ static void keyboard_handle_key(
 		}
 	}
 
-	if (!handled) {
-		/* Otherwise, we pass it along to the client. */
-		wlr_seat_set_keyboard(seat, keyboard->device);
+	/* Otherwise, we pass it along to the input method if it grabbed the
+	 * keyboard, or else the client. */
+	if (!handled && !text_input_handle_key(server, keyboard->device,
+			event)) {
+		seat_set_keyboard(server, keyboard->device);
 		wlr_seat_keyboard_notify_key(seat, event->time_msec,
 			event->keycode, event->state);
 	}
+	trace_end(&span, "keycode", event->keycode);
+}
+
+static void update_capabilities(struct wet_server *server) {
+	/* We need to let the wlr_seat know what our capabilities are, which is
+	 * communiciated to the client. In TinyWL we always have a cursor, even if
+	 * there are no pointer devices, so we always include that capability. */
+	uint32_t caps = WL_SEAT_CAPABILITY_POINTER;
+	if (!wl_list_empty(&server->keyboards)) {
+		caps |= WL_SEAT_CAPABILITY_KEYBOARD;
+	}
+	wlr_seat_set_capabilities(server->seat, caps);
+}
+
+static void keyboard_handle_destroy(
+		struct wl_listener *listener, void *data) {
+	/* This event is raised when the keyboard goes away, e.g. unplugged or
+	 * re-enumerated by a KVM switch. */
+	struct wet_keyboard *keyboard =
+		wl_container_of(listener, keyboard, destroy);
+	struct wet_server *server = keyboard->server;
+	struct wlr_keyboard *wlr_keyboard = keyboard->device->keyboard;
+
+	if (wlr_keyboard->group) {
+		wlr_keyboard_group_remove_keyboard(wlr_keyboard->group, wlr_keyboard);
+	} else {
+		wl_list_remove(&keyboard->modifiers.link);
+		wl_list_remove(&keyboard->key.link);
+	}
+	wl_list_remove(&keyboard->destroy.link);
+	wl_list_remove(&keyboard->link);
+	free(keyboard);
+
+	update_capabilities(server);
+}
+
+static struct wlr_keyboard_group *keyboard_group_get(struct wet_server *server) {
+	/* The group is a virtual keyboard of its own. It forwards the keys and
+	 * modifiers of all its members, so we only listen to it. */
+	struct wet_keyboard *keyboard;
+
+	if (server->keyboard_group) {
+		return server->keyboard_group;
+	}
+
+	keyboard = calloc(1, sizeof(struct wet_keyboard));
+	if (!keyboard) {
+		return NULL;
+	}
+	server->keyboard_group = wlr_keyboard_group_create();
+	if (!server->keyboard_group) {
+		free(keyboard);
+		return NULL;
+	}
+
+	server->group_keyboard = keyboard;
+	keyboard->server = server;
+	keyboard->device = server->keyboard_group->input_device;
+	keyboard->modifiers.notify = keyboard_handle_modifiers;
+	wl_signal_add(&server->keyboard_group->keyboard.events.modifiers,
+		&keyboard->modifiers);
+	keyboard->key.notify = keyboard_handle_key;
+	wl_signal_add(&server->keyboard_group->keyboard.events.key,
+		&keyboard->key);
+
+	return server->keyboard_group;
+}
+
+static bool keyboard_group_add(struct wet_server *server,
+		struct wlr_input_device *device) {
+	struct wlr_keyboard_group *group = keyboard_group_get(server);
+
+	if (!group) {
+		return false;
+	}
+	if (wl_list_empty(&group->devices)) {
+		/* The first member defines the keymap of the group */
+		wlr_keyboard_set_keymap(&group->keyboard, device->keyboard->keymap);
+		wlr_keyboard_set_repeat_info(&group->keyboard,
+			device->keyboard->repeat_info.rate,
+			device->keyboard->repeat_info.delay);
+	}
+	/* This fails when the keymap really differs from the group's */
+	return wlr_keyboard_group_add_keyboard(group, device->keyboard);
 }
 
 static void server_new_keyboard(struct wet_server *server,
@@ -124,24 +232,49 @@ static void server_new_keyboard(struct wet_server *server,
 	keyboard->server = server;
 	keyboard->device = device;
 
-	/* We need to prepare an XKB keymap and assign it to the keyboard. This
-	 * assumes the defaults (e.g. layout = "us"). */
-	struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-	struct xkb_keymap *keymap = xkb_keymap_new_from_names(context, NULL,
-		XKB_KEYMAP_COMPILE_NO_FLAGS);
+	if (wlr_input_device_get_virtual_keyboard(device)) {
+		/* Virtual keyboards, e.g. of an input method passing keys
+		 * through, bring their own keymap. They stay out of the group
+		 * and are swapped into the seat when used. */
+		keyboard->modifiers.notify = keyboard_handle_modifiers;
+		wl_signal_add(&device->keyboard->events.modifiers, &keyboard->modifiers);
+		keyboard->key.notify = keyboard_handle_key;
+		wl_signal_add(&device->keyboard->events.key, &keyboard->key);
+		keyboard->destroy.notify = keyboard_handle_destroy;
+		wl_signal_add(&device->events.destroy, &keyboard->destroy);
+		wl_list_insert(&server->keyboards, &keyboard->link);
+		return;
+	}
 
+	/* We need to assign an XKB keymap to the keyboard. This assumes the
+	 * defaults (e.g. layout = "us"). Keymaps come from a cache shared by
+	 * all keyboards, so hotplugging doesn't compile them again. */
+	struct xkb_keymap *keymap = keyboard_get_keymap(server, NULL);
+	if (!keymap) {
+		/* Without one neither the group nor our key handler can
+		 * make sense of the keys */
+		printf("no keymap, ignoring keyboard %s\n", device->name);
+		free(keyboard);
+		return;
+	}
 	wlr_keyboard_set_keymap(device->keyboard, keymap);
-	xkb_keymap_unref(keymap);
-	xkb_context_unref(context);
 	wlr_keyboard_set_repeat_info(device->keyboard, 25, 600);
 
-	/* Here we set up listeners for keyboard events. */
-	keyboard->modifiers.notify = keyboard_handle_modifiers;
-	wl_signal_add(&device->keyboard->events.modifiers, &keyboard->modifiers);
-	keyboard->key.notify = keyboard_handle_key;
-	wl_signal_add(&device->keyboard->events.key, &keyboard->key);
-
-	wlr_seat_set_keyboard(server->seat, device);
+	if (keyboard_group_add(server, device)) {
+		/* Keys and modifiers arrive through the group, and the seat
+		 * keeps the group's keymap whichever member is typed on. */
+		seat_set_keyboard(server, server->keyboard_group->input_device);
+	} else {
+		/* A keyboard with a different keymap, it gets swapped into the
+		 * seat when it is used. */
+		keyboard->modifiers.notify = keyboard_handle_modifiers;
+		wl_signal_add(&device->keyboard->events.modifiers, &keyboard->modifiers);
+		keyboard->key.notify = keyboard_handle_key;
+		wl_signal_add(&device->keyboard->events.key, &keyboard->key);
+		seat_set_keyboard(server, device);
+	}
+	keyboard->destroy.notify = keyboard_handle_destroy;
+	wl_signal_add(&device->events.destroy, &keyboard->destroy);
 
 	/* And add the keyboard to our list of keyboards */
 	wl_list_insert(&server->keyboards, &keyboard->link);
@@ -162,6 +295,7 @@ static void server_new_input(struct wl_listener *listener, void *data) {
 	struct wet_server *server =
 		wl_container_of(listener, server, new_input);
 	struct wlr_input_device *device = data;
+	struct wet_trace_span span = trace_begin("new_input");
 	switch (device->type) {
 	case WLR_INPUT_DEVICE_KEYBOARD:
 		server_new_keyboard(server, device);
@@ -172,19 +306,28 @@ static void server_new_input(struct wl_listener *listener, void *data) {
 	default:
 		break;
 	}
-	/* We need to let the wlr_seat know what our capabilities are, which is
-	 * communiciated to the client. In TinyWL we always have a cursor, even if
-	 * there are no pointer devices, so we always include that capability. */
-	uint32_t caps = WL_SEAT_CAPABILITY_POINTER;
-	if (!wl_list_empty(&server->keyboards)) {
-		caps |= WL_SEAT_CAPABILITY_KEYBOARD;
-	}
-	wlr_seat_set_capabilities(server->seat, caps);
+	update_capabilities(server);
+	trace_end_str(&span, "device", device->name);
 }
 
-void seat_init(struct wet_server *server)
+static void seat_new_virtual_keyboard(struct wl_listener *listener,
+		void *data) {
+	struct wet_server *server =
+		wl_container_of(listener, server, new_virtual_keyboard);
+	struct wlr_virtual_keyboard_v1 *virtual_keyboard = data;
+
+	server_new_keyboard(server, &virtual_keyboard->input_device);
+	update_capabilities(server);
+}
+
+bool seat_init(struct wet_server *server)
 {
+	if (!keyboard_init(server))
+		return false;
+
 	server->seat = wlr_seat_create(server->wl_display, "seat0");
+	if (!server->seat)
+		return false;
 
 	server->request_cursor.notify = seat_request_cursor;
 	wl_signal_add(&server->seat->events.request_set_cursor, &server->request_cursor);
@@ -202,6 +345,15 @@ void seat_init(struct wet_server *server)
 	server->new_input.notify = server_new_input;
 	wl_signal_add(&server->backend->events.new_input, &server->new_input);
 
+	/* Input methods send the keys they don't use back through these */
+	server->virtual_keyboard_mgr =
+		wlr_virtual_keyboard_manager_v1_create(server->wl_display);
+	if (server->virtual_keyboard_mgr) {
+		server->new_virtual_keyboard.notify = seat_new_virtual_keyboard;
+		wl_signal_add(&server->virtual_keyboard_mgr->events.new_virtual_keyboard,
+			&server->new_virtual_keyboard);
+	}
+
 	/*
 	 * Creates a cursor, which is a wlroots utility for tracking the cursor
 	 * image shown on screen.
@@ -210,4 +362,6 @@ void seat_init(struct wet_server *server)
 
 	wlr_cursor_attach_output_layout(server->cursor, server->output_layout);
 	cursor_init(server);
+
+	return true;
 }
@@ -3,11 +3,82 @@
  * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
  */
 
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include  <weston-pro.h>
 
+static void find_headless_backend(struct wlr_backend *backend, void *data)
+{
+	struct wlr_backend **headless = data;
+
+	if (wlr_backend_is_headless(backend))
+		*headless = backend;
+}
+
+static char *socket_name_from_fd(int fd)
+{
+	/* WAYLAND_DISPLAY is relative to XDG_RUNTIME_DIR, or else absolute */
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	struct sockaddr_un addr;
+	socklen_t len = sizeof(addr);
+	size_t dir_len;
+
+	if (getsockname(fd, (struct sockaddr *)&addr, &len) < 0 ||
+			addr.sun_family != AF_UNIX || addr.sun_path[0] != '/')
+		return NULL;
+	addr.sun_path[sizeof(addr.sun_path) - 1] = '\0';
+
+	dir_len = dir ? strlen(dir) : 0;
+	if (dir_len && strncmp(addr.sun_path, dir, dir_len) == 0 &&
+			addr.sun_path[dir_len] == '/' &&
+			!strchr(addr.sun_path + dir_len + 1, '/'))
+		return strdup(addr.sun_path + dir_len + 1);
+	return strdup(addr.sun_path);
+}
+
+bool server_listen(struct wet_server *server, int socket_fd)
+{
+	/*
+	 * Called before server_init(), so clients started alongside us can
+	 * connect while the backend comes up: they wait in the listen
+	 * backlog until the event loop runs. socket_fd is an already
+	 * listening socket, e.g. from systemd socket activation, or -1 to
+	 * create one.
+	 */
+	const char *socket;
+
+	if (socket_fd < 0) {
+		socket = wl_display_add_socket_auto(server->wl_display);
+		if (!socket) {
+			printf("failed to create the Wayland socket\n");
+			return false;
+		}
+		server->socket = strdup(socket);
+	} else {
+		server->socket = socket_name_from_fd(socket_fd);
+		if (!server->socket) {
+			printf("socket %d is not bound to a path\n", socket_fd);
+			return false;
+		}
+		if (wl_display_add_socket_fd(server->wl_display,
+				socket_fd) < 0) {
+			printf("failed to listen on socket %d\n", socket_fd);
+			return false;
+		}
+	}
+	if (!server->socket)
+		return false;
+
+	startup_mark(server, "socket");
+	return true;
+}
+
 bool server_init(struct wet_server *server)
 {
 	struct wlr_compositor *compositor;
@@ -24,6 +95,29 @@ bool server_init(struct wet_server *server)
 		printf("failed to create backend\n");
 		goto failed;
 	}
+	startup_mark(server, "backend");
+
+	/*
+	 * Virtual outputs live on a headless backend next to the real ones.
+	 * Reuse the one WLR_BACKENDS asked for, if any, otherwise add an empty
+	 * one: it costs nothing until an output is created on it. The
+	 * autocreated backend is always a multi backend.
+	 */
+	wlr_multi_for_each_backend(server->backend, find_headless_backend,
+		&server->headless_backend);
+	if (!server->headless_backend) {
+		server->headless_backend =
+			wlr_headless_backend_create(server->wl_display);
+		if (server->headless_backend &&
+				!wlr_multi_backend_add(server->backend,
+					server->headless_backend)) {
+			wlr_backend_destroy(server->headless_backend);
+			server->headless_backend = NULL;
+		}
+		if (!server->headless_backend)
+			printf("failed to create the headless backend, "
+			       "virtual outputs are disabled\n");
+	}
 
 	/*
 	 * Autocreates a renderer, either Pixman, GLES2 or Vulkan for us. The
@@ -38,6 +132,7 @@ bool server_init(struct wet_server *server)
 	}
 
 	wlr_renderer_init_wl_display(server->renderer, server->wl_display);
+	startup_mark(server, "renderer");
 
 	/*
 	 * Autocreates an allocator for us. The allocator is the bridge between
@@ -49,8 +144,16 @@ bool server_init(struct wet_server *server)
 		printf("failed to create allocator\n");
 		goto failed;
 	}
+	startup_mark(server, "allocator");
+
+	if (!render_init(server))
+		goto failed;
 
 	wl_list_init(&server->views);
+	wl_list_init(&server->clients);
+	wl_list_init(&server->transactions);
+	trace_add_display(server->wl_display);
+	spatial_init(server);
 
 	server->scene = wlr_scene_create();
 	if (!server->scene) {
@@ -58,8 +161,31 @@ bool server_init(struct wet_server *server)
 		goto failed;
 	}
 
+	/* Scene layers, from the bottom up. Each can be hit-tested and
+	 * shown or hidden on its own. */
+	server->background_tree = wlr_scene_tree_create(&server->scene->node);
+	server->view_tree = wlr_scene_tree_create(&server->scene->node);
+	server->panel_tree = wlr_scene_tree_create(&server->scene->node);
+	server->ivi_tree = wlr_scene_tree_create(&server->scene->node);
+	server->lock_tree = wlr_scene_tree_create(&server->scene->node);
+	server->held_tree = wlr_scene_tree_create(&server->scene->node);
+	if (!server->background_tree || !server->view_tree ||
+			!server->panel_tree || !server->ivi_tree ||
+			!server->lock_tree || !server->held_tree) {
+		printf("failed to create the scene layers\n");
+		goto failed;
+	}
+	wlr_scene_node_set_enabled(&server->held_tree->node, false);
+
 	if (!output_init(server))
 		goto failed;
+	tile_init(server);
+	if (!shell_init(server))
+		goto failed;
+	if (!ivi_init(server))
+		goto failed;
+	if (server->hmi_enabled && !hmi_init(server))
+		goto failed;
 
 	/*
 	 * Create some hands-off wlroots interfaces. The compositor is
@@ -73,6 +199,8 @@ bool server_init(struct wet_server *server)
 		printf("failed to create the wlroots compositor\n");
 		goto failed;
 	}
+	if (!client_init(server, compositor))
+		goto failed;
 
 	device_manager = wlr_data_device_manager_create(server->wl_display);
 	if (!device_manager) {
@@ -80,7 +208,29 @@ bool server_init(struct wet_server *server)
 		goto failed;
 	}
 
-	seat_init(server);
+	/*
+	 * wp_presentation gives clients the time their content hit the screen,
+	 * with the refresh interval and vblank sequence, so they can pace
+	 * themselves to the display clock. wlr_scene sends the feedback.
+	 */
+	server->presentation = wlr_presentation_create(server->wl_display,
+		server->backend);
+	if (!server->presentation) {
+		printf("failed to create the presentation interface\n");
+		goto failed;
+	}
+	wlr_scene_set_presentation(server->scene, server->presentation);
+
+	startup_mark(server, "globals");
+
+	if (!seat_init(server))
+		goto failed;
+	if (!text_input_init(server))
+		goto failed;
+	startup_mark(server, "seat");
+
+	if (!watchdog_init(server))
+		goto failed;
 
 	server->xdg_shell = wlr_xdg_shell_create(server->wl_display);
 	if (!server->xdg_shell) {
@@ -98,12 +248,8 @@ failed:
 
 bool server_start(struct wet_server *server)
 {
-	/* Add a Unix socket to the Wayland display. */
-	const char *socket = wl_display_add_socket_auto(server->wl_display);
-	if (!socket) {
-		wlr_backend_destroy(server->backend);
-		return false;
-	}
+	/* The Wayland socket was added by server_listen() */
+	const char *socket = server->socket;
 
 	/* Start the backend. This will enumerate outputs and inputs, become the DRM
 	 * master, etc */
@@ -112,16 +258,60 @@ bool server_start(struct wet_server *server)
 		wl_display_destroy(server->wl_display);
 		return false;
 	}
+	startup_mark(server, "backend start");
 
 	/* Set the WAYLAND_DISPLAY environment variable to our socket and run the
 	 * startup command if requested. */
 	setenv("WAYLAND_DISPLAY", socket, true);
 
+	/* Not fatal, the compositor is perfectly usable without them */
+	ipc_init(server, strrchr(socket, '/') ? strrchr(socket, '/') + 1 :
+		socket);
+	metrics_init(server, strrchr(socket, '/') ? strrchr(socket, '/') + 1 :
+		socket);
+
 	/* Run the Wayland event loop. This does not return until you exit the
 	 * compositor. Starting the backend rigged up all of the necessary event
 	 * loop configuration to listen to libinput events, DRM events, generate
 	 * frame events at the refresh rate, and so on. */
-	printf("Running Wayland compositor on WAYLAND_DISPLAY=%s", socket);
+	printf("Running Wayland compositor on WAYLAND_DISPLAY=%s\n", socket);
 
 	return true;
 }
+
+void server_run(struct wet_server *server)
+{
+	struct wl_event_loop *loop = wl_display_get_event_loop(server->wl_display);
+	struct pollfd pfd = {
+		.fd = wl_event_loop_get_fd(loop),
+		.events = POLLIN,
+	};
+
+	if (!server->watchdog) {
+		wl_display_run(server->wl_display);
+		return;
+	}
+
+	/* wl_display_run(), with the wait for events kept out of the time
+	 * the watchdog sees */
+	for (;;) {
+		watchdog_dispatch_begin(server);
+		wl_event_loop_dispatch(loop, 0);
+		/* What the dispatch queued runs before we sleep, as it would
+		 * in wl_event_loop_dispatch() with a timeout */
+		wl_event_loop_dispatch_idle(loop);
+		watchdog_dispatch_end(server);
+		if (server->terminated)
+			break;
+
+		wl_display_flush_clients(server->wl_display);
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+	}
+}
+
+void server_terminate(struct wet_server *server)
+{
+	server->terminated = true;
+	wl_display_terminate(server->wl_display);
+}
@@ -0,0 +1,628 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#include <stdlib.h>
+
+#include <weston-pro.h>
+#include "weston-desktop-shell-protocol.h"
+
+/*
+ * weston_desktop_shell: one client, typically weston-desktop-shell started
+ * with -S, draws the backgrounds, panels and lock screen. Each kind has a
+ * scene tree of its own, stacked around the views:
+ *
+ *   background_tree < view_tree < panel_tree < ivi_tree < lock_tree
+ *
+ * The backgrounds and panels stay out of the per-frame work done for views:
+ * they are not in the spatial index nor in the visibility pass, and only
+ * get frame callbacks after they committed. A fullscreen view disables
+ * those of its output, and locking disables the whole view, panel and ivi
+ * trees at once.
+ */
+
+enum wet_shell_role {
+	SHELL_BACKGROUND,
+	SHELL_PANEL,
+	SHELL_LOCK,
+};
+
+struct wet_shell {
+	struct wet_server *server;
+	/* The one client allowed to draw the desktop, started with -S */
+	struct wl_client *client;
+	struct wl_listener client_destroy;
+	struct wl_resource *resource;
+	struct wl_list surfaces; /* wet_shell_surface.link */
+	enum weston_desktop_shell_panel_position panel_position;
+	struct wl_listener layout_change;
+};
+
+struct wet_shell_surface {
+	struct wl_list link;
+	struct wet_shell *shell;
+	enum wet_shell_role role;
+	struct wlr_surface *surface;
+	struct wlr_output *output;
+	/* NULL once wlroots destroyed it with the surface */
+	struct wlr_scene_node *node;
+	/* Committed since the last frame callbacks */
+	bool frame_pending;
+	/* Configured size, and the panel size the usable box last had */
+	int width, height;
+	int panel_width, panel_height;
+	struct wl_listener surface_commit;
+	struct wl_listener surface_destroy;
+	struct wl_listener output_destroy;
+	struct wl_listener node_destroy;
+};
+
+static const struct wlr_surface_role shell_surface_role = {
+	.name = "weston_desktop_shell",
+};
+
+static struct wet_shell_surface *shell_surface_from_wlr_surface(
+		struct wlr_surface *surface)
+{
+	surface = wlr_surface_get_root_surface(surface);
+	if (surface->role != &shell_surface_role)
+		return NULL;
+	return surface->role_data;
+}
+
+bool shell_surface_accepts_focus(struct wlr_surface *surface)
+{
+	/* Backgrounds and panels get the pointer, not the keyboard */
+	struct wet_shell_surface *shell_surface =
+		shell_surface_from_wlr_surface(surface);
+
+	return !shell_surface || shell_surface->role == SHELL_LOCK;
+}
+
+static bool output_has_fullscreen(struct wet_server *server,
+		struct wlr_output *output)
+{
+	struct wet_view *view;
+
+	wl_list_for_each(view, &server->views, link) {
+		if (view->fullscreen && view->fullscreen_output == output &&
+				view->scene_node->state.enabled)
+			return true;
+	}
+	return false;
+}
+
+static void shell_surface_place(struct wet_shell_surface *shell_surface)
+{
+	struct wet_server *server = shell_surface->shell->server;
+	struct wlr_surface *surface = shell_surface->surface;
+	struct wlr_box *box;
+	int x, y;
+
+	box = shell_surface->output ? wlr_output_layout_get_box(
+		server->output_layout, shell_surface->output) : NULL;
+	if (!box) {
+		wlr_scene_node_set_enabled(shell_surface->node, false);
+		return;
+	}
+
+	x = box->x;
+	y = box->y;
+	switch (shell_surface->role) {
+	case SHELL_BACKGROUND:
+		break;
+	case SHELL_PANEL:
+		if (shell_surface->shell->panel_position ==
+				WESTON_DESKTOP_SHELL_PANEL_POSITION_BOTTOM)
+			y += box->height - surface->current.height;
+		else if (shell_surface->shell->panel_position ==
+				WESTON_DESKTOP_SHELL_PANEL_POSITION_RIGHT)
+			x += box->width - surface->current.width;
+		break;
+	case SHELL_LOCK:
+		x += (box->width - surface->current.width) / 2;
+		y += (box->height - surface->current.height) / 2;
+		break;
+	}
+	wlr_scene_node_set_position(shell_surface->node, x, y);
+	wlr_scene_node_set_enabled(shell_surface->node,
+		shell_surface->role == SHELL_LOCK ||
+		!output_has_fullscreen(server, shell_surface->output));
+
+	/* The lock surface picks its own size */
+	if (shell_surface->role != SHELL_LOCK && shell_surface->shell->resource &&
+			(box->width != shell_surface->width ||
+			 box->height != shell_surface->height)) {
+		shell_surface->width = box->width;
+		shell_surface->height = box->height;
+		weston_desktop_shell_send_configure(
+			shell_surface->shell->resource, 0,
+			surface->resource, box->width, box->height);
+	}
+}
+
+void shell_update_visibility(struct wet_server *server)
+{
+	/* Called by views_update_visibility(), backgrounds and panels under
+	 * a fullscreen view are not drawn */
+	struct wet_shell_surface *shell_surface;
+	bool visible;
+
+	if (!server->shell)
+		return;
+
+	wl_list_for_each(shell_surface, &server->shell->surfaces, link) {
+		if (shell_surface->role == SHELL_LOCK || !shell_surface->output)
+			continue;
+		visible = !output_has_fullscreen(server, shell_surface->output) &&
+			wlr_output_layout_get_box(server->output_layout,
+				shell_surface->output);
+		if (shell_surface->node->state.enabled != visible)
+			wlr_scene_node_set_enabled(shell_surface->node, visible);
+	}
+}
+
+bool shell_get_usable_box(struct wet_server *server, struct wlr_output *output,
+		struct wlr_box *box)
+{
+	/* The output without its panel, for maximized and tiled views */
+	struct wet_shell_surface *shell_surface;
+	struct wlr_box *output_box;
+	int width, height;
+
+	output_box = wlr_output_layout_get_box(server->output_layout, output);
+	if (!output_box)
+		return false;
+	*box = *output_box;
+	if (!server->shell)
+		return true;
+
+	wl_list_for_each(shell_surface, &server->shell->surfaces, link) {
+		if (shell_surface->role != SHELL_PANEL ||
+				shell_surface->output != output)
+			continue;
+		width = shell_surface->surface->current.width;
+		height = shell_surface->surface->current.height;
+		switch (server->shell->panel_position) {
+		case WESTON_DESKTOP_SHELL_PANEL_POSITION_TOP:
+			box->y += height;
+			box->height -= height;
+			break;
+		case WESTON_DESKTOP_SHELL_PANEL_POSITION_BOTTOM:
+			box->height -= height;
+			break;
+		case WESTON_DESKTOP_SHELL_PANEL_POSITION_LEFT:
+			box->x += width;
+			box->width -= width;
+			break;
+		case WESTON_DESKTOP_SHELL_PANEL_POSITION_RIGHT:
+			box->width -= width;
+			break;
+		}
+	}
+	if (box->width <= 0 || box->height <= 0)
+		*box = *output_box;
+	return true;
+}
+
+struct shell_frame_done_data {
+	const struct wlr_box *box;
+	const struct timespec *now;
+};
+
+static void shell_frame_done_iterator(struct wlr_surface *surface,
+		int sx, int sy, void *data)
+{
+	struct shell_frame_done_data *frame = data;
+	struct wlr_box box = { sx, sy, surface->current.width,
+		surface->current.height };
+	struct wlr_box intersection;
+
+	if (wlr_box_intersection(&intersection, &box, frame->box))
+		wlr_surface_send_frame_done(surface, frame->now);
+}
+
+void shell_send_frame_done(struct wet_server *server, struct wlr_output *output,
+		const struct wlr_box *output_box, const struct timespec *now)
+{
+	/* Only to shell surfaces which drew something since the last time,
+	 * a static background is never visited */
+	struct shell_frame_done_data data = { output_box, now };
+	struct wet_shell_surface *shell_surface;
+
+	if (!server->shell)
+		return;
+
+	wl_list_for_each(shell_surface, &server->shell->surfaces, link) {
+		if (!shell_surface->frame_pending ||
+				shell_surface->output != output ||
+				!shell_surface->node->state.enabled)
+			continue;
+		shell_surface->frame_pending = false;
+		wlr_scene_node_for_each_surface(shell_surface->node,
+			shell_frame_done_iterator, &data);
+	}
+}
+
+static void focus_top_view(struct wet_server *server)
+{
+	struct wet_view *view;
+
+	wl_list_for_each(view, &server->views, link) {
+		if (view->mapped) {
+			focus_view(view, view->xdg_surface->surface);
+			return;
+		}
+	}
+}
+
+static void shell_surface_destroy(struct wet_shell_surface *shell_surface)
+{
+	wl_list_remove(&shell_surface->surface_commit.link);
+	wl_list_remove(&shell_surface->surface_destroy.link);
+	wl_list_remove(&shell_surface->output_destroy.link);
+	wl_list_remove(&shell_surface->link);
+	/* Already gone when the surface is: the subsurface tree listens to
+	 * the surface too, and came first */
+	if (shell_surface->node) {
+		wl_list_remove(&shell_surface->node_destroy.link);
+		wlr_scene_node_destroy(shell_surface->node);
+	}
+	client_account(shell_surface->shell->server,
+		wl_resource_get_client(shell_surface->surface->resource),
+		WET_CLIENT_NODES, -1);
+	/* Frees the role for the next set_* request */
+	shell_surface->surface->role_data = NULL;
+	free(shell_surface);
+}
+
+static void shell_surface_handle_commit(struct wl_listener *listener,
+		void *data)
+{
+	struct wet_shell_surface *shell_surface =
+		wl_container_of(listener, shell_surface, surface_commit);
+	struct wet_server *server = shell_surface->shell->server;
+	struct wlr_surface *surface = shell_surface->surface;
+
+	shell_surface->frame_pending = true;
+	/* Panels and the lock surface are placed by their size */
+	if (shell_surface->role != SHELL_BACKGROUND)
+		shell_surface_place(shell_surface);
+
+	/* Tiles make room for a panel of a new size */
+	if (shell_surface->role == SHELL_PANEL &&
+			(surface->current.width != shell_surface->panel_width ||
+			 surface->current.height != shell_surface->panel_height)) {
+		shell_surface->panel_width = surface->current.width;
+		shell_surface->panel_height = surface->current.height;
+		tile_arrange(server);
+	}
+
+	if (shell_surface->role == SHELL_LOCK && server->locked &&
+			wlr_surface_has_buffer(shell_surface->surface))
+		focus_surface(server, shell_surface->surface);
+}
+
+static void shell_surface_handle_destroy(struct wl_listener *listener,
+		void *data)
+{
+	struct wet_shell_surface *shell_surface =
+		wl_container_of(listener, shell_surface, surface_destroy);
+
+	shell_surface_destroy(shell_surface);
+}
+
+static void shell_surface_handle_node_destroy(struct wl_listener *listener,
+		void *data)
+{
+	struct wet_shell_surface *shell_surface =
+		wl_container_of(listener, shell_surface, node_destroy);
+
+	wl_list_remove(&shell_surface->node_destroy.link);
+	shell_surface->node = NULL;
+}
+
+static void shell_surface_handle_output_destroy(struct wl_listener *listener,
+		void *data)
+{
+	struct wet_shell_surface *shell_surface =
+		wl_container_of(listener, shell_surface, output_destroy);
+
+	/* The client gets to set a new one when the output comes back */
+	shell_surface_destroy(shell_surface);
+}
+
+static void shell_set_surface(struct wl_resource *resource,
+		enum wet_shell_role role, struct wl_resource *output_resource,
+		struct wl_resource *surface_resource)
+{
+	struct wet_shell *shell = wl_resource_get_user_data(resource);
+	struct wet_server *server = shell->server;
+	struct wlr_surface *surface = wlr_surface_from_resource(surface_resource);
+	struct wlr_output *output = NULL;
+	struct wet_shell_surface *shell_surface, *old, *tmp;
+	struct wlr_scene_tree *tree;
+
+	if (output_resource) {
+		output = wlr_output_from_resource(output_resource);
+		if (!output)
+			return;
+	} else {
+		output = wlr_output_layout_get_center_output(
+			server->output_layout);
+	}
+
+	/* Checked before anything is replaced, a bad request leaves the
+	 * current surfaces alone */
+	if (surface->role && surface->role != &shell_surface_role) {
+		wl_resource_post_error(resource,
+			WESTON_DESKTOP_SHELL_ERROR_INVALID_ARGUMENT,
+			"surface already has a role");
+		return;
+	}
+
+	/* The failures below all disconnect the client, which drops its
+	 * accounting with it */
+	if (!client_account(server, wl_resource_get_client(resource),
+			WET_CLIENT_NODES, 1))
+		return;
+	shell_surface = calloc(1, sizeof(*shell_surface));
+	if (!shell_surface) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	/* One surface per output and role, the new one replaces the old */
+	wl_list_for_each_safe(old, tmp, &shell->surfaces, link) {
+		if (old->surface == surface || (old->role == role &&
+				(role == SHELL_LOCK || old->output == output)))
+			shell_surface_destroy(old);
+	}
+
+	if (!wlr_surface_set_role(surface, &shell_surface_role, shell_surface,
+			resource, WESTON_DESKTOP_SHELL_ERROR_INVALID_ARGUMENT)) {
+		free(shell_surface);
+		return;
+	}
+
+	tree = role == SHELL_BACKGROUND ? server->background_tree :
+		role == SHELL_PANEL ? server->panel_tree : server->lock_tree;
+	shell_surface->node = wlr_scene_subsurface_tree_create(&tree->node,
+		surface);
+	if (!shell_surface->node) {
+		surface->role_data = NULL;
+		free(shell_surface);
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	shell_surface->shell = shell;
+	shell_surface->role = role;
+	shell_surface->surface = surface;
+	shell_surface->output = output;
+	shell_surface->surface_commit.notify = shell_surface_handle_commit;
+	wl_signal_add(&surface->events.commit, &shell_surface->surface_commit);
+	shell_surface->surface_destroy.notify = shell_surface_handle_destroy;
+	wl_signal_add(&surface->events.destroy, &shell_surface->surface_destroy);
+	shell_surface->node_destroy.notify = shell_surface_handle_node_destroy;
+	wl_signal_add(&shell_surface->node->events.destroy,
+		&shell_surface->node_destroy);
+	shell_surface->output_destroy.notify =
+		shell_surface_handle_output_destroy;
+	if (output)
+		wl_signal_add(&output->events.destroy,
+			&shell_surface->output_destroy);
+	else
+		wl_list_init(&shell_surface->output_destroy.link);
+	wl_list_insert(shell->surfaces.prev, &shell_surface->link);
+
+	shell_surface_place(shell_surface);
+}
+
+static void desktop_shell_set_background(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *output,
+		struct wl_resource *surface)
+{
+	shell_set_surface(resource, SHELL_BACKGROUND, output, surface);
+}
+
+static void desktop_shell_set_panel(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *output,
+		struct wl_resource *surface)
+{
+	shell_set_surface(resource, SHELL_PANEL, output, surface);
+}
+
+static void desktop_shell_set_lock_surface(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *surface)
+{
+	struct wet_shell *shell = wl_resource_get_user_data(resource);
+
+	/* Too late, or no lock asked for */
+	if (!shell->server->locked)
+		return;
+	shell_set_surface(resource, SHELL_LOCK, NULL, surface);
+}
+
+static void shell_set_locked(struct wet_server *server, bool locked)
+{
+	struct wet_shell_surface *shell_surface, *tmp;
+
+	server->locked = locked;
+	/* Everything but the backgrounds and the lock screen, in one go */
+	wlr_scene_node_set_enabled(&server->view_tree->node, !locked);
+	wlr_scene_node_set_enabled(&server->panel_tree->node, !locked);
+	wlr_scene_node_set_enabled(&server->ivi_tree->node, !locked);
+
+	if (locked) {
+		wlr_seat_keyboard_notify_clear_focus(server->seat);
+		wlr_seat_pointer_clear_focus(server->seat);
+		return;
+	}
+
+	wl_list_for_each_safe(shell_surface, tmp, &server->shell->surfaces,
+			link) {
+		if (shell_surface->role == SHELL_LOCK)
+			shell_surface_destroy(shell_surface);
+	}
+	wlr_seat_keyboard_notify_clear_focus(server->seat);
+	focus_top_view(server);
+}
+
+static void desktop_shell_unlock(struct wl_client *client,
+		struct wl_resource *resource)
+{
+	struct wet_shell *shell = wl_resource_get_user_data(resource);
+
+	if (shell->server->locked)
+		shell_set_locked(shell->server, false);
+}
+
+static void desktop_shell_set_grab_surface(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *surface)
+{
+	/* Interactive moves and resizes are done by the compositor itself,
+	 * no grab_cursor events to send */
+}
+
+static void desktop_shell_desktop_ready(struct wl_client *client,
+		struct wl_resource *resource)
+{
+	struct wet_shell *shell = wl_resource_get_user_data(resource);
+
+	ipc_send_event(shell->server, "desktop-ready");
+}
+
+static void desktop_shell_set_panel_position(struct wl_client *client,
+		struct wl_resource *resource, uint32_t position)
+{
+	struct wet_shell *shell = wl_resource_get_user_data(resource);
+	struct wet_shell_surface *shell_surface;
+
+	if (position > WESTON_DESKTOP_SHELL_PANEL_POSITION_RIGHT) {
+		wl_resource_post_error(resource,
+			WESTON_DESKTOP_SHELL_ERROR_INVALID_ARGUMENT,
+			"bad position argument");
+		return;
+	}
+	shell->panel_position = position;
+	wl_list_for_each(shell_surface, &shell->surfaces, link) {
+		if (shell_surface->role == SHELL_PANEL)
+			shell_surface_place(shell_surface);
+	}
+}
+
+static const struct weston_desktop_shell_interface desktop_shell_implementation = {
+	.set_background = desktop_shell_set_background,
+	.set_panel = desktop_shell_set_panel,
+	.set_lock_surface = desktop_shell_set_lock_surface,
+	.unlock = desktop_shell_unlock,
+	.set_grab_surface = desktop_shell_set_grab_surface,
+	.desktop_ready = desktop_shell_desktop_ready,
+	.set_panel_position = desktop_shell_set_panel_position,
+};
+
+static void desktop_shell_resource_destroy(struct wl_resource *resource)
+{
+	/* Its surfaces go with the client. A lock stays until the next shell
+	 * client unlocks it. */
+	struct wet_shell *shell = wl_resource_get_user_data(resource);
+
+	shell->resource = NULL;
+}
+
+static void desktop_shell_bind(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id)
+{
+	struct wet_shell *shell = data;
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client, &weston_desktop_shell_interface,
+		version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	if (client != shell->client || shell->resource) {
+		wl_resource_post_error(resource, WL_DISPLAY_ERROR_INVALID_OBJECT,
+			"permission to bind desktop_shell denied");
+		wl_resource_destroy(resource);
+		return;
+	}
+	wl_resource_set_implementation(resource, &desktop_shell_implementation,
+		shell, desktop_shell_resource_destroy);
+	shell->resource = resource;
+
+	if (shell->server->locked)
+		weston_desktop_shell_send_prepare_lock_surface(resource);
+}
+
+static void shell_client_destroy(struct wl_listener *listener, void *data)
+{
+	struct wet_shell *shell = wl_container_of(listener, shell, client_destroy);
+
+	wl_list_remove(&shell->client_destroy.link);
+	shell->client = NULL;
+}
+
+bool shell_launch(struct wet_server *server, const char *path)
+{
+	struct wet_shell *shell = server->shell;
+
+	shell->client = client_launch(server, path);
+	if (!shell->client)
+		return false;
+	shell->client_destroy.notify = shell_client_destroy;
+	wl_client_add_destroy_listener(shell->client, &shell->client_destroy);
+	return true;
+}
+
+bool shell_has_client(struct wet_server *server)
+{
+	return server->shell && server->shell->resource;
+}
+
+void shell_lock(struct wet_server *server)
+{
+	/* The shell client draws the lock screen and unlocks */
+	if (!shell_has_client(server) || server->locked)
+		return;
+	shell_set_locked(server, true);
+	weston_desktop_shell_send_prepare_lock_surface(server->shell->resource);
+}
+
+static void shell_layout_change(struct wl_listener *listener, void *data)
+{
+	struct wet_shell *shell = wl_container_of(listener, shell, layout_change);
+	struct wet_shell_surface *shell_surface;
+
+	wl_list_for_each(shell_surface, &shell->surfaces, link)
+		shell_surface_place(shell_surface);
+}
+
+bool shell_init(struct wet_server *server)
+{
+	struct wet_shell *shell;
+
+	shell = calloc(1, sizeof(*shell));
+	if (!shell)
+		return false;
+	shell->server = server;
+	wl_list_init(&shell->surfaces);
+	shell->panel_position = WESTON_DESKTOP_SHELL_PANEL_POSITION_TOP;
+
+	if (!wl_global_create(server->wl_display,
+			&weston_desktop_shell_interface, 1, shell,
+			desktop_shell_bind)) {
+		printf("failed to create the desktop shell interface\n");
+		free(shell);
+		return false;
+	}
+
+	shell->layout_change.notify = shell_layout_change;
+	wl_signal_add(&server->output_layout->events.change,
+		&shell->layout_change);
+	server->shell = shell;
+	return true;
+}
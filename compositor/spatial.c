@@ -0,0 +1,273 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+
+#include <weston-pro.h>
+
+/*
+ * A uniform grid over layout coordinates holding the bounds of every mapped
+ * view, popups and subsurfaces included. Hit-testing then only asks the scene
+ * graph about the few views overlapping the cell under the pointer, in
+ * stacking order, instead of walking the whole scene. Should a view fail to
+ * get its entries allocated, lookups go back to walking the scene until it
+ * gets them.
+ */
+
+/* 256x256 layout pixels per cell */
+#define SPATIAL_CELL_SHIFT 8
+/* Views covering more cells than this are kept on a separate list which
+ * every lookup checks, rather than spread over thousands of buckets. */
+#define SPATIAL_MAX_CELLS 1024
+#define SPATIAL_MAX_CANDIDATES 32
+
+struct wet_spatial_entry {
+	struct wl_list link; /* bucket or wet_server.spatial_large */
+	struct wl_list view_link; /* wet_view.spatial.entries */
+	struct wet_view *view;
+	int cx, cy;
+};
+
+static int spatial_cell(int v)
+{
+	/* Floor division, layout coordinates can be negative */
+	return v >= 0 ? v >> SPATIAL_CELL_SHIFT :
+		-((-v + (1 << SPATIAL_CELL_SHIFT) - 1) >> SPATIAL_CELL_SHIFT);
+}
+
+static int floor_to_int(double v)
+{
+	int i = (int)v;
+
+	return i - (v < i);
+}
+
+static struct wl_list *spatial_bucket(struct wet_server *server, int cx, int cy)
+{
+	uint32_t hash = (uint32_t)cx * 73856093u ^ (uint32_t)cy * 19349663u;
+
+	return &server->spatial_buckets[hash & (WET_SPATIAL_BUCKETS - 1)];
+}
+
+static void extents_iterator(struct wlr_surface *surface, int sx, int sy,
+		void *data)
+{
+	struct wlr_box *box = data;
+	int x2, y2;
+
+	if (surface->current.width <= 0 || surface->current.height <= 0)
+		return;
+
+	if (wlr_box_empty(box)) {
+		*box = (struct wlr_box){ sx, sy, surface->current.width,
+			surface->current.height };
+		return;
+	}
+
+	x2 = box->x + box->width;
+	y2 = box->y + box->height;
+	if (sx + surface->current.width > x2)
+		x2 = sx + surface->current.width;
+	if (sy + surface->current.height > y2)
+		y2 = sy + surface->current.height;
+	if (sx < box->x)
+		box->x = sx;
+	if (sy < box->y)
+		box->y = sy;
+	box->width = x2 - box->x;
+	box->height = y2 - box->y;
+}
+
+void spatial_init(struct wet_server *server)
+{
+	int i;
+
+	for (i = 0; i < WET_SPATIAL_BUCKETS; i++)
+		wl_list_init(&server->spatial_buckets[i]);
+	wl_list_init(&server->spatial_large);
+	server->spatial_failed = 0;
+}
+
+static void spatial_view_clear(struct wet_view *view)
+{
+	struct wet_spatial_entry *entry, *tmp;
+
+	wl_list_for_each_safe(entry, tmp, &view->spatial.entries, view_link) {
+		wl_list_remove(&entry->link);
+		wl_list_remove(&entry->view_link);
+		free(entry);
+	}
+	view->spatial.box = (struct wlr_box){ 0 };
+	view->spatial.indexed = false;
+}
+
+static void spatial_view_set_failed(struct wet_view *view, bool failed)
+{
+	if (view->spatial.failed == failed)
+		return;
+	view->spatial.failed = failed;
+	view->server->spatial_failed += failed ? 1 : -1;
+}
+
+void spatial_view_remove(struct wet_view *view)
+{
+	spatial_view_clear(view);
+	spatial_view_set_failed(view, false);
+}
+
+void spatial_view_update(struct wet_view *view)
+{
+	struct wet_server *server = view->server;
+	struct wet_spatial_entry *entry, *tmp;
+	struct wlr_box box = { 0 };
+	struct wl_list old;
+	int lx = 0, ly = 0;
+	int cx0, cy0, cx1, cy1, cx, cy;
+	bool large, failed = false;
+
+	if (view->scene_node->parent)
+		wlr_scene_node_coords(view->scene_node->parent, &lx, &ly);
+	wlr_scene_node_for_each_surface(view->scene_node, extents_iterator, &box);
+	if (wlr_box_empty(&box)) {
+		spatial_view_remove(view);
+		return;
+	}
+	box.x += lx;
+	box.y += ly;
+	view->spatial.box = box;
+
+	cx0 = spatial_cell(box.x);
+	cy0 = spatial_cell(box.y);
+	cx1 = spatial_cell(box.x + box.width - 1);
+	cy1 = spatial_cell(box.y + box.height - 1);
+	large = (int64_t)(cx1 - cx0 + 1) * (cy1 - cy0 + 1) > SPATIAL_MAX_CELLS;
+
+	/* Most moves and commits stay within the same cells */
+	if (view->spatial.indexed && view->spatial.large == large &&
+			(large || (cx0 == view->spatial.cx0 &&
+			 cy0 == view->spatial.cy0 && cx1 == view->spatial.cx1 &&
+			 cy1 == view->spatial.cy1)))
+		return;
+
+	/* Reuse the entries we already have, they only change buckets */
+	wl_list_init(&old);
+	wl_list_insert_list(&old, &view->spatial.entries);
+	wl_list_init(&view->spatial.entries);
+	wl_list_for_each(entry, &old, view_link)
+		wl_list_remove(&entry->link);
+
+	if (large)
+		cx0 = cx1 = cy0 = cy1 = INT_MIN;
+	for (cy = cy0; cy <= cy1; cy++) {
+		for (cx = cx0; cx <= cx1; cx++) {
+			if (!wl_list_empty(&old)) {
+				entry = wl_container_of(old.next, entry, view_link);
+				wl_list_remove(&entry->view_link);
+			} else {
+				entry = calloc(1, sizeof(*entry));
+				if (!entry) {
+					failed = true;
+					continue;
+				}
+				entry->view = view;
+			}
+			entry->cx = cx;
+			entry->cy = cy;
+			wl_list_insert(large ? &server->spatial_large :
+				spatial_bucket(server, cx, cy), &entry->link);
+			wl_list_insert(&view->spatial.entries, &entry->view_link);
+		}
+	}
+
+	wl_list_for_each_safe(entry, tmp, &old, view_link)
+		free(entry);
+
+	/* Missing from some of its cells, better in none of them */
+	if (failed) {
+		spatial_view_clear(view);
+		spatial_view_set_failed(view, true);
+		return;
+	}
+	spatial_view_set_failed(view, false);
+
+	view->spatial.cx0 = cx0;
+	view->spatial.cy0 = cy0;
+	view->spatial.cx1 = cx1;
+	view->spatial.cy1 = cy1;
+	view->spatial.large = large;
+	view->spatial.indexed = true;
+}
+
+static int add_candidates(struct wl_list *list, int cx, int cy, double lx,
+		double ly, struct wet_view **candidates, int n)
+{
+	struct wet_spatial_entry *entry;
+	int i;
+
+	wl_list_for_each(entry, list, link) {
+		if (entry->cx != cx || entry->cy != cy ||
+				!wlr_box_contains_point(&entry->view->spatial.box,
+					lx, ly))
+			continue;
+		if (n == SPATIAL_MAX_CANDIDATES)
+			return -1;
+
+		/* Insertion sort, topmost first */
+		for (i = n; i > 0 &&
+				candidates[i - 1]->stack < entry->view->stack; i--)
+			candidates[i] = candidates[i - 1];
+		candidates[i] = entry->view;
+		n++;
+	}
+
+	return n;
+}
+
+bool spatial_view_at(struct wet_server *server, double lx, double ly,
+		struct wet_view **view, struct wlr_surface **surface,
+		double *sx, double *sy)
+{
+	struct wet_view *candidates[SPATIAL_MAX_CANDIDATES];
+	struct wlr_scene_node *node, *parent;
+	int px, py;
+	int cx = spatial_cell(floor_to_int(lx));
+	int cy = spatial_cell(floor_to_int(ly));
+	int n, i;
+
+	*view = NULL;
+
+	if (server->spatial_failed > 0)
+		return false;
+
+	n = add_candidates(spatial_bucket(server, cx, cy), cx, cy, lx, ly,
+		candidates, 0);
+	if (n >= 0)
+		n = add_candidates(&server->spatial_large, INT_MIN, INT_MIN,
+			lx, ly, candidates, n);
+	/* Too many views stacked on this point, let the caller walk the
+	 * scene instead */
+	if (n < 0)
+		return false;
+
+	for (i = 0; i < n; i++) {
+		/* wlr_scene_node_at() wants coordinates relative to the parent */
+		px = py = 0;
+		parent = candidates[i]->scene_node->parent;
+		if (parent)
+			wlr_scene_node_coords(parent, &px, &py);
+		node = wlr_scene_node_at(candidates[i]->scene_node,
+			lx - px, ly - py, sx, sy);
+		if (node == NULL)
+			continue;
+		if (node->type != WLR_SCENE_NODE_SURFACE)
+			break;
+		*surface = wlr_scene_surface_from_node(node)->surface;
+		*view = candidates[i];
+		break;
+	}
+
+	return true;
+}
@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+
+#include <weston-pro.h>
+
+void histogram_add(struct wet_histogram *histogram, int64_t nsec)
+{
+	uint64_t usec = nsec > 0 ? nsec / 1000 : 0;
+	int i = 0;
+
+	while (usec > 1 && i < WET_HISTOGRAM_BUCKETS - 1) {
+		usec >>= 1;
+		i++;
+	}
+	histogram->buckets[i]++;
+	histogram->count++;
+	if (nsec > 0) {
+		histogram->sum_nsec += nsec;
+		if ((uint64_t)nsec > histogram->max_nsec)
+			histogram->max_nsec = nsec;
+		histogram->sum_sq_msec += (nsec / 1e6) * (nsec / 1e6);
+	}
+}
+
+double histogram_percentile(const struct wet_histogram *histogram,
+		double p)
+{
+	/* Upper bound of the bucket holding the percentile, in ms */
+	uint64_t rank = histogram->count * p, seen = 0;
+	int i;
+
+	for (i = 0; i < WET_HISTOGRAM_BUCKETS - 1; i++) {
+		seen += histogram->buckets[i];
+		if (seen > rank)
+			break;
+	}
+	if (i == WET_HISTOGRAM_BUCKETS - 1)
+		return histogram->max_nsec / 1e6;
+	return (2ull << i) / 1e3;
+}
+
+void histogram_print(FILE *f, const char *name,
+		const struct wet_histogram *histogram)
+{
+	double mean, variance;
+
+	if (histogram->count == 0) {
+		fprintf(f, "%s: no samples\n", name);
+		return;
+	}
+
+	mean = histogram->sum_nsec / 1e6 / histogram->count;
+	variance = histogram->sum_sq_msec / histogram->count - mean * mean;
+	fprintf(f, "%s: %" PRIu64 " samples, mean %.2f ms, sd %.2f ms, "
+		"p50 < %.2f ms, p90 < %.2f ms, p99 < %.2f ms, max %.2f ms\n",
+		name, histogram->count, mean,
+		variance > 0 ? sqrt(variance) : 0.0,
+		histogram_percentile(histogram, 0.5),
+		histogram_percentile(histogram, 0.9),
+		histogram_percentile(histogram, 0.99),
+		histogram->max_nsec / 1e6);
+}
+
+void startup_mark(struct wet_server *server, const char *phase)
+{
+	/* Called as each startup phase ends, the last one being the first
+	 * frame */
+	struct wet_startup *startup = &server->startup;
+	struct timespec now;
+
+	if (startup->count == WET_STARTUP_PHASES)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	startup->phases[startup->count].name = phase;
+	startup->phases[startup->count].nsec =
+		(int64_t)(now.tv_sec - startup->start.tv_sec) * 1000000000 +
+		(now.tv_nsec - startup->start.tv_nsec);
+	startup->count++;
+}
+
+void startup_print(struct wet_server *server, FILE *f)
+{
+	const struct wet_startup *startup = &server->startup;
+	int64_t prev = 0;
+	int i;
+
+	if (startup->count == 0)
+		return;
+
+	fprintf(f, "startup:");
+	for (i = 0; i < startup->count; i++) {
+		fprintf(f, "%s %s %.2f ms", i ? "," : "",
+			startup->phases[i].name,
+			(startup->phases[i].nsec - prev) / 1e6);
+		prev = startup->phases[i].nsec;
+	}
+	fprintf(f, ", total %.2f ms\n", prev / 1e6);
+}
+
+void server_dump_stats(struct wet_server *server, FILE *f)
+{
+	/* Human readable dump of the runtime counters, sent on SIGUSR2 */
+	static const char *fallback_names[WET_SCANOUT_FALLBACK_COUNT] = {
+		[WET_SCANOUT_NO_SURFACE] = "no-surface",
+		[WET_SCANOUT_MULTIPLE_SURFACES] = "multiple-surfaces",
+		[WET_SCANOUT_GEOMETRY] = "geometry",
+		[WET_SCANOUT_TRANSFORM] = "transform",
+		[WET_SCANOUT_REJECTED] = "rejected",
+	};
+	struct wet_output *output;
+	struct wet_view *view;
+	struct wet_client *client;
+	char name[64];
+	int i;
+
+	startup_print(server, f);
+	watchdog_dump(server, f);
+	fprintf(f, "keymap sends: %" PRIu64 "\n", server->stats.keymap_sends);
+	fprintf(f, "transactions: %" PRIu64 ", %" PRIu64 " timed out\n",
+		server->stats.transactions, server->stats.transaction_timeouts);
+	histogram_print(f, "transaction latency",
+		&server->stats.transaction_latency);
+	if (server->tiling)
+		fprintf(f, "tiling: %" PRIu64 " nodes arranged, %" PRIu64
+			" views configured\n", server->stats.tile_nodes_arranged,
+			server->stats.tile_views_configured);
+	if (server->hmi)
+		fprintf(f, "hmi: %" PRIu64 " mode switches, %d applications\n",
+			server->stats.hmi_mode_switches,
+			hmi_surface_count(server));
+	if (server->stats.ime_keys || server->stats.ime_commits) {
+		fprintf(f, "ime: %" PRIu64 " keys, %" PRIu64 " commits\n",
+			server->stats.ime_keys, server->stats.ime_commits);
+		histogram_print(f, "keystroke-to-preedit",
+			&server->stats.ime_latency);
+	}
+
+	if (server->render_pool)
+		fprintf(f, "render: %d threads, %" PRIu64 " frames in %" PRIu64
+			" tiles\n", server->render_threads,
+			server->stats.render_parallel_frames,
+			server->stats.render_tiles);
+	histogram_print(f, "render time", &server->stats.render_time);
+
+	wl_list_for_each(output, &server->outputs, link) {
+		fprintf(f, "output %s: %" PRIu64 " scanout frames, composited:",
+			output->wlr_output->name, output->scanout_frames);
+		for (i = 0; i < WET_SCANOUT_FALLBACK_COUNT; i++)
+			fprintf(f, " %s %" PRIu64, fallback_names[i],
+				output->composited_frames[i]);
+		fprintf(f, "\n");
+	}
+
+	wl_list_for_each(view, &server->views, link) {
+		fprintf(f, "view \"%s\": %" PRIu64 " frame callbacks, withheld: "
+			"occluded %" PRIu64 " offscreen %" PRIu64
+			" background %" PRIu64 "\n",
+			view->xdg_surface->toplevel->title ?
+				view->xdg_surface->toplevel->title : "",
+			view->frames.sent, view->frames.occluded,
+			view->frames.offscreen, view->frames.background);
+	}
+
+	wl_list_for_each(client, &server->clients, link) {
+		snprintf(name, sizeof(name), "client %d commit-to-present",
+			(int)client->pid);
+		histogram_print(f, name, &client->present_latency);
+		fprintf(f, "client %d: %" PRIu64 " presented, %" PRIu64
+			" missed\n", (int)client->pid, client->presented,
+			client->missed);
+		client_dump(client, f);
+	}
+	fflush(f);
+}
@@ -0,0 +1,514 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <wlr/types/wlr_input_method_v2.h>
+#include <wlr/types/wlr_virtual_keyboard_v1.h>
+
+#include <weston-pro.h>
+#include "text-input-unstable-v2-protocol.h"
+
+/*
+ * Relays between the text inputs of clients (zwp_text_input_v2) and one
+ * input method (zwp_input_method_v2, implemented by wlroots).
+ *
+ * The text input of the client with keyboard focus that enabled itself is
+ * the active one: the input method is activated for it, and while the input
+ * method holds its keyboard grab every key goes there instead of to the
+ * client. Preedit and commit strings are passed on straight from the input
+ * method's commit handler, in the same dispatch and without copies, so they
+ * leave with the next flush of the event loop.
+ *
+ * The time from a key press handed to the input method to the commit it
+ * results in is kept in stats.ime_latency.
+ */
+
+struct wet_text_input {
+	struct wl_list link;
+	struct wet_text_input_relay *relay;
+	struct wl_resource *resource;
+	/* Has keyboard focus, we sent enter */
+	struct wlr_surface *focused;
+	bool enabled;
+	/* What the input method was last told about this text input */
+	bool preedit;
+	char *surrounding_text;
+	int32_t cursor, anchor;
+	uint32_t content_hint, content_purpose;
+};
+
+struct wet_text_input_relay {
+	struct wet_server *server;
+	struct wl_list text_inputs; /* wet_text_input.link */
+	struct wet_text_input *active;
+	struct wlr_input_method_v2 *input_method;
+	struct wlr_input_method_manager_v2 *input_method_mgr;
+	/* A key press the input method didn't answer yet */
+	bool key_pending;
+	struct timespec key_time;
+
+	struct wl_listener focus_change;
+	struct wl_listener new_input_method;
+	struct wl_listener input_method_commit;
+	struct wl_listener input_method_grab;
+	struct wl_listener input_method_destroy;
+};
+
+static void relay_send_state(struct wet_text_input_relay *relay)
+{
+	/* The whole state, the input method applies it on done */
+	struct wlr_input_method_v2 *input_method = relay->input_method;
+	struct wet_text_input *text_input = relay->active;
+
+	if (text_input->surrounding_text)
+		wlr_input_method_v2_send_surrounding_text(input_method,
+			text_input->surrounding_text, text_input->cursor,
+			text_input->anchor);
+	wlr_input_method_v2_send_content_type(input_method,
+		text_input->content_hint, text_input->content_purpose);
+	wlr_input_method_v2_send_done(input_method);
+}
+
+static void relay_set_active(struct wet_text_input_relay *relay,
+		struct wet_text_input *text_input)
+{
+	if (relay->active == text_input)
+		return;
+
+	relay->active = text_input;
+	relay->key_pending = false;
+	if (!relay->input_method)
+		return;
+	if (text_input) {
+		wlr_input_method_v2_send_activate(relay->input_method);
+		relay_send_state(relay);
+	} else {
+		wlr_input_method_v2_send_deactivate(relay->input_method);
+		wlr_input_method_v2_send_done(relay->input_method);
+	}
+}
+
+static struct wet_text_input *relay_find_active(
+		struct wet_text_input_relay *relay)
+{
+	struct wet_text_input *text_input;
+
+	wl_list_for_each(text_input, &relay->text_inputs, link) {
+		if (text_input->enabled && text_input->focused)
+			return text_input;
+	}
+	return NULL;
+}
+
+static struct wlr_input_method_keyboard_grab_v2 *relay_get_grab(
+		struct wet_server *server, struct wlr_input_device *device)
+{
+	/* Keys the input method sends back through a virtual keyboard of its
+	 * own must reach the client, not loop */
+	struct wet_text_input_relay *relay = server->text_input;
+	struct wlr_input_method_keyboard_grab_v2 *grab;
+	struct wlr_virtual_keyboard_v1 *virtual_keyboard;
+
+	if (!relay || !relay->input_method || !relay->active)
+		return NULL;
+	grab = relay->input_method->keyboard_grab;
+	if (!grab)
+		return NULL;
+	virtual_keyboard = wlr_input_device_get_virtual_keyboard(device);
+	if (virtual_keyboard && wl_resource_get_client(
+			virtual_keyboard->resource) ==
+			wl_resource_get_client(grab->resource))
+		return NULL;
+	return grab;
+}
+
+bool text_input_handle_key(struct wet_server *server,
+		struct wlr_input_device *device,
+		struct wlr_event_keyboard_key *event)
+{
+	struct wlr_input_method_keyboard_grab_v2 *grab =
+		relay_get_grab(server, device);
+
+	if (!grab)
+		return false;
+
+	if (event->state == WL_KEYBOARD_KEY_STATE_PRESSED) {
+		clock_gettime(CLOCK_MONOTONIC, &server->text_input->key_time);
+		server->text_input->key_pending = true;
+		server->stats.ime_keys++;
+	}
+	wlr_input_method_keyboard_grab_v2_set_keyboard(grab, device->keyboard);
+	wlr_input_method_keyboard_grab_v2_send_key(grab, event->time_msec,
+		event->keycode, event->state);
+	return true;
+}
+
+bool text_input_handle_modifiers(struct wet_server *server,
+		struct wlr_input_device *device)
+{
+	struct wlr_input_method_keyboard_grab_v2 *grab =
+		relay_get_grab(server, device);
+
+	if (!grab)
+		return false;
+
+	wlr_input_method_keyboard_grab_v2_set_keyboard(grab, device->keyboard);
+	wlr_input_method_keyboard_grab_v2_send_modifiers(grab,
+		&device->keyboard->modifiers);
+	return true;
+}
+
+static void input_method_handle_commit(struct wl_listener *listener,
+		void *data)
+{
+	struct wet_text_input_relay *relay =
+		wl_container_of(listener, relay, input_method_commit);
+	struct wlr_input_method_v2_state *state = &relay->input_method->current;
+	struct wet_text_input *text_input = relay->active;
+	struct wet_server *server = relay->server;
+	struct timespec now;
+
+	if (!text_input)
+		return;
+
+	if (state->delete.before_length || state->delete.after_length)
+		zwp_text_input_v2_send_delete_surrounding_text(
+			text_input->resource, state->delete.before_length,
+			state->delete.after_length);
+	if (state->commit_text)
+		zwp_text_input_v2_send_commit_string(text_input->resource,
+			state->commit_text);
+	/* An empty preedit only to clear the one the client shows */
+	if (state->preedit.text || text_input->preedit) {
+		zwp_text_input_v2_send_preedit_cursor(text_input->resource,
+			state->preedit.cursor_begin);
+		zwp_text_input_v2_send_preedit_string(text_input->resource,
+			state->preedit.text ? state->preedit.text : "", "");
+	}
+	text_input->preedit = state->preedit.text != NULL;
+	server->stats.ime_commits++;
+
+	/* A key the input method swallowed without a change doesn't count,
+	 * it would charge its wait to the next one */
+	if (relay->key_pending && (state->commit_text ||
+			state->preedit.text)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		histogram_add(&server->stats.ime_latency,
+			(int64_t)(now.tv_sec - relay->key_time.tv_sec) *
+			1000000000 + (now.tv_nsec - relay->key_time.tv_nsec));
+	}
+	relay->key_pending = false;
+}
+
+static void input_method_handle_grab(struct wl_listener *listener,
+		void *data)
+{
+	/* The input method learns the keymap from the seat keyboard */
+	struct wet_text_input_relay *relay =
+		wl_container_of(listener, relay, input_method_grab);
+	struct wlr_input_method_keyboard_grab_v2 *grab = data;
+	struct wlr_keyboard *keyboard =
+		wlr_seat_get_keyboard(relay->server->seat);
+
+	if (keyboard)
+		wlr_input_method_keyboard_grab_v2_set_keyboard(grab, keyboard);
+}
+
+static void input_method_handle_destroy(struct wl_listener *listener,
+		void *data)
+{
+	struct wet_text_input_relay *relay =
+		wl_container_of(listener, relay, input_method_destroy);
+
+	wl_list_remove(&relay->input_method_commit.link);
+	wl_list_remove(&relay->input_method_grab.link);
+	wl_list_remove(&relay->input_method_destroy.link);
+	relay->input_method = NULL;
+	relay->key_pending = false;
+}
+
+static void relay_new_input_method(struct wl_listener *listener, void *data)
+{
+	struct wet_text_input_relay *relay =
+		wl_container_of(listener, relay, new_input_method);
+	struct wlr_input_method_v2 *input_method = data;
+
+	/* One input method at a time, the others are told right away */
+	if (relay->input_method || input_method->seat != relay->server->seat) {
+		wlr_input_method_v2_send_unavailable(input_method);
+		return;
+	}
+
+	relay->input_method = input_method;
+	relay->input_method_commit.notify = input_method_handle_commit;
+	wl_signal_add(&input_method->events.commit, &relay->input_method_commit);
+	relay->input_method_grab.notify = input_method_handle_grab;
+	wl_signal_add(&input_method->events.grab_keyboard,
+		&relay->input_method_grab);
+	relay->input_method_destroy.notify = input_method_handle_destroy;
+	wl_signal_add(&input_method->events.destroy,
+		&relay->input_method_destroy);
+
+	if (relay->active) {
+		wlr_input_method_v2_send_activate(input_method);
+		relay_send_state(relay);
+	}
+}
+
+static void relay_focus_change(struct wl_listener *listener, void *data)
+{
+	/* Text inputs follow the keyboard focus of their client */
+	struct wet_text_input_relay *relay =
+		wl_container_of(listener, relay, focus_change);
+	struct wlr_seat_keyboard_focus_change_event *event = data;
+	struct wet_text_input *text_input;
+	struct wl_client *client = event->new_surface ?
+		wl_resource_get_client(event->new_surface->resource) : NULL;
+	uint32_t serial;
+
+	wl_list_for_each(text_input, &relay->text_inputs, link) {
+		if (text_input->focused) {
+			serial = wl_display_next_serial(relay->server->wl_display);
+			zwp_text_input_v2_send_leave(text_input->resource, serial,
+				text_input->focused->resource);
+			text_input->focused = NULL;
+			/* Enabled again by the client on its next enter */
+			text_input->enabled = false;
+			text_input->preedit = false;
+		}
+		if (client && wl_resource_get_client(text_input->resource) ==
+				client) {
+			serial = wl_display_next_serial(relay->server->wl_display);
+			zwp_text_input_v2_send_enter(text_input->resource, serial,
+				event->new_surface->resource);
+			text_input->focused = event->new_surface;
+		}
+	}
+	relay_set_active(relay, relay_find_active(relay));
+}
+
+static void text_input_enable(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *surface)
+{
+	struct wet_text_input *text_input = wl_resource_get_user_data(resource);
+
+	if (!text_input)
+		return;
+	text_input->enabled = true;
+	relay_set_active(text_input->relay, relay_find_active(text_input->relay));
+}
+
+static void text_input_disable(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *surface)
+{
+	struct wet_text_input *text_input = wl_resource_get_user_data(resource);
+
+	if (!text_input)
+		return;
+	text_input->enabled = false;
+	text_input->preedit = false;
+	relay_set_active(text_input->relay, relay_find_active(text_input->relay));
+}
+
+static void text_input_show_input_panel(struct wl_client *client,
+		struct wl_resource *resource)
+{
+	/* input-method-v2 has no panel to show */
+}
+
+static void text_input_hide_input_panel(struct wl_client *client,
+		struct wl_resource *resource)
+{
+}
+
+static void text_input_set_surrounding_text(struct wl_client *client,
+		struct wl_resource *resource, const char *text, int32_t cursor,
+		int32_t anchor)
+{
+	/* Kept until update_state, the input method wants it with the rest */
+	struct wet_text_input *text_input = wl_resource_get_user_data(resource);
+	char *copy;
+
+	if (!text_input)
+		return;
+	copy = strdup(text);
+	if (!copy) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+	free(text_input->surrounding_text);
+	text_input->surrounding_text = copy;
+	text_input->cursor = cursor;
+	text_input->anchor = anchor;
+}
+
+static void text_input_set_content_type(struct wl_client *client,
+		struct wl_resource *resource, uint32_t hint, uint32_t purpose)
+{
+	struct wet_text_input *text_input = wl_resource_get_user_data(resource);
+
+	if (!text_input)
+		return;
+	text_input->content_hint = hint;
+	text_input->content_purpose = purpose;
+}
+
+static void text_input_set_cursor_rectangle(struct wl_client *client,
+		struct wl_resource *resource, int32_t x, int32_t y, int32_t width,
+		int32_t height)
+{
+	/* Only used to place input method popups, which we don't show */
+}
+
+static void text_input_set_preferred_language(struct wl_client *client,
+		struct wl_resource *resource, const char *language)
+{
+}
+
+static void text_input_update_state(struct wl_client *client,
+		struct wl_resource *resource, uint32_t serial, uint32_t reason)
+{
+	struct wet_text_input *text_input = wl_resource_get_user_data(resource);
+	struct wet_text_input_relay *relay;
+
+	if (!text_input)
+		return;
+	relay = text_input->relay;
+	if (relay->active == text_input && relay->input_method)
+		relay_send_state(relay);
+}
+
+static void text_input_destroy(struct wl_client *client,
+		struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct zwp_text_input_v2_interface text_input_implementation = {
+	.destroy = text_input_destroy,
+	.enable = text_input_enable,
+	.disable = text_input_disable,
+	.show_input_panel = text_input_show_input_panel,
+	.hide_input_panel = text_input_hide_input_panel,
+	.set_surrounding_text = text_input_set_surrounding_text,
+	.set_content_type = text_input_set_content_type,
+	.set_cursor_rectangle = text_input_set_cursor_rectangle,
+	.set_preferred_language = text_input_set_preferred_language,
+	.update_state = text_input_update_state,
+};
+
+static void text_input_resource_destroy(struct wl_resource *resource)
+{
+	struct wet_text_input *text_input = wl_resource_get_user_data(resource);
+	struct wet_text_input_relay *relay;
+
+	if (!text_input)
+		return;
+	relay = text_input->relay;
+	wl_list_remove(&text_input->link);
+	if (relay->active == text_input)
+		relay_set_active(relay, relay_find_active(relay));
+	free(text_input->surrounding_text);
+	free(text_input);
+}
+
+static void text_input_manager_get_text_input(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id,
+		struct wl_resource *seat)
+{
+	struct wet_text_input_relay *relay = wl_resource_get_user_data(resource);
+	struct wlr_surface *focused =
+		relay->server->seat->keyboard_state.focused_surface;
+	struct wet_text_input *text_input;
+	struct wl_resource *text_input_resource;
+
+	text_input_resource = wl_resource_create(client,
+		&zwp_text_input_v2_interface, wl_resource_get_version(resource),
+		id);
+	if (!text_input_resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	text_input = calloc(1, sizeof(*text_input));
+	if (!text_input) {
+		wl_resource_set_implementation(text_input_resource,
+			&text_input_implementation, NULL, NULL);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	text_input->relay = relay;
+	text_input->resource = text_input_resource;
+	wl_resource_set_implementation(text_input_resource,
+		&text_input_implementation, text_input,
+		text_input_resource_destroy);
+	wl_list_insert(&relay->text_inputs, &text_input->link);
+
+	/* The client may already have keyboard focus, there is one seat */
+	if (focused && wl_resource_get_client(focused->resource) == client) {
+		zwp_text_input_v2_send_enter(text_input_resource,
+			wl_display_next_serial(relay->server->wl_display),
+			focused->resource);
+		text_input->focused = focused;
+	}
+}
+
+static void text_input_manager_destroy(struct wl_client *client,
+		struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct zwp_text_input_manager_v2_interface text_input_manager_implementation = {
+	.destroy = text_input_manager_destroy,
+	.get_text_input = text_input_manager_get_text_input,
+};
+
+static void text_input_manager_bind(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client, &zwp_text_input_manager_v2_interface,
+		version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource,
+		&text_input_manager_implementation, data, NULL);
+}
+
+bool text_input_init(struct wet_server *server)
+{
+	struct wet_text_input_relay *relay;
+
+	relay = calloc(1, sizeof(*relay));
+	if (!relay)
+		return false;
+	relay->server = server;
+	wl_list_init(&relay->text_inputs);
+
+	relay->input_method_mgr =
+		wlr_input_method_manager_v2_create(server->wl_display);
+	if (!relay->input_method_mgr ||
+			!wl_global_create(server->wl_display,
+				&zwp_text_input_manager_v2_interface, 1, relay,
+				text_input_manager_bind)) {
+		printf("failed to create the text input interfaces\n");
+		free(relay);
+		return false;
+	}
+
+	relay->new_input_method.notify = relay_new_input_method;
+	wl_signal_add(&relay->input_method_mgr->events.input_method,
+		&relay->new_input_method);
+	relay->focus_change.notify = relay_focus_change;
+	wl_signal_add(&server->seat->keyboard_state.events.focus_change,
+		&relay->focus_change);
+	server->text_input = relay;
+	return true;
+}
@@ -0,0 +1,333 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#include <stdlib.h>
+
+#include <weston-pro.h>
+
+/*
+ * Optional tiling: every output has a tree of containers splitting their
+ * box between their children, by weight, side by side or stacked. Views
+ * are the leaves.
+ *
+ * Relayout is incremental. A map, unmap or weight change marks the
+ * container it touches and its ancestors dirty, and tile_arrange() only
+ * descends into dirty containers and into nodes whose box changed. Views
+ * whose geometry ends up the same are left alone; the others are moved
+ * and resized together in one layout transaction.
+ */
+
+enum wet_tile_split {
+	TILE_SPLIT_HORIZONTAL,
+	TILE_SPLIT_VERTICAL,
+};
+
+struct wet_tile {
+	struct wl_list link; /* parent's children */
+	struct wet_tile *parent;
+	/* Leaves have a view, containers children */
+	struct wet_view *view;
+	struct wl_list children;
+	enum wet_tile_split split;
+	double weight;
+	/* Box assigned by the last arrange */
+	struct wlr_box box;
+	bool dirty;
+};
+
+static bool box_equal(const struct wlr_box *a, const struct wlr_box *b)
+{
+	return a->x == b->x && a->y == b->y &&
+		a->width == b->width && a->height == b->height;
+}
+
+static struct wet_tile *tile_create(struct wet_tile *parent,
+		struct wl_list *after)
+{
+	struct wet_tile *tile = calloc(1, sizeof(*tile));
+
+	if (!tile)
+		return NULL;
+	tile->parent = parent;
+	tile->weight = 1.0;
+	wl_list_init(&tile->children);
+	if (after)
+		wl_list_insert(after, &tile->link);
+	else
+		wl_list_init(&tile->link);
+	return tile;
+}
+
+static void tile_mark_dirty(struct wet_tile *tile)
+{
+	for (; tile && !tile->dirty; tile = tile->parent)
+		tile->dirty = true;
+}
+
+static void tile_arrange_node(struct wet_server *server, struct wet_tile *tile,
+		const struct wlr_box *box, struct wet_transaction **transaction)
+{
+	struct wet_tile *child;
+	struct wlr_box child_box, geometry;
+	double total = 0, used = 0;
+	int size, offset, end;
+
+	if (!tile->dirty && box_equal(box, &tile->box))
+		return;
+	server->stats.tile_nodes_arranged++;
+	tile->box = *box;
+	tile->dirty = false;
+
+	if (tile->view) {
+		/* A fullscreen view keeps its output, it finds its tile again
+		 * when it leaves fullscreen */
+		if (tile->view->fullscreen)
+			return;
+		view_get_geometry(tile->view, &geometry);
+		if (box_equal(box, &geometry))
+			return;
+		if (!*transaction)
+			*transaction = transaction_create(server);
+		if (*transaction &&
+				transaction_add_view(*transaction, tile->view, box))
+			server->stats.tile_views_configured++;
+		return;
+	}
+
+	wl_list_for_each(child, &tile->children, link)
+		total += child->weight;
+
+	size = tile->split == TILE_SPLIT_HORIZONTAL ? box->width : box->height;
+	offset = 0;
+	wl_list_for_each(child, &tile->children, link) {
+		/* Round the running edge, not every size, so rounding errors
+		 * never add up to a gap */
+		used += child->weight;
+		end = child->link.next == &tile->children ? size :
+			(int)(size * used / total + 0.5);
+
+		child_box = *box;
+		if (tile->split == TILE_SPLIT_HORIZONTAL) {
+			child_box.x += offset;
+			child_box.width = end - offset;
+		} else {
+			child_box.y += offset;
+			child_box.height = end - offset;
+		}
+		offset = end;
+		tile_arrange_node(server, child, &child_box, transaction);
+	}
+}
+
+void tile_arrange(struct wet_server *server)
+{
+	struct wet_transaction *transaction = NULL;
+	struct wet_output *output;
+	struct wlr_box box;
+
+	if (!server->tiling)
+		return;
+
+	/* Tiles share what the panels leave of each output */
+	wl_list_for_each(output, &server->outputs, link) {
+		if (output->tile_root && shell_get_usable_box(server,
+				output->wlr_output, &box))
+			tile_arrange_node(server, output->tile_root, &box,
+				&transaction);
+	}
+
+	if (transaction)
+		transaction_commit(transaction);
+}
+
+static struct wet_tile *tile_output_root(struct wet_output *output)
+{
+	if (!output->tile_root) {
+		output->tile_root = tile_create(NULL, NULL);
+		if (output->tile_root)
+			output->tile_root->split =
+				output->wlr_output->width >=
+				output->wlr_output->height ?
+					TILE_SPLIT_HORIZONTAL : TILE_SPLIT_VERTICAL;
+	}
+	return output->tile_root;
+}
+
+static void tile_insert_view(struct wet_view *view, struct wet_tile *parent,
+		struct wl_list *after)
+{
+	view->tile = tile_create(parent, after);
+	if (!view->tile)
+		return;
+	view->tile->view = view;
+	tile_mark_dirty(parent);
+}
+
+static void tile_view_place(struct wet_view *view)
+{
+	/* Next to the focused view, or on the output under the cursor */
+	struct wet_server *server = view->server;
+	struct wlr_surface *focused = server->seat->keyboard_state.focused_surface;
+	struct wlr_output *wlr_output;
+	struct wet_output *output = NULL, *candidate;
+	struct wet_view *other;
+	struct wet_tile *root;
+
+	wl_list_for_each(other, &server->views, link) {
+		if (other != view && other->tile &&
+				other->xdg_surface->surface == focused) {
+			tile_insert_view(view, other->tile->parent,
+				&other->tile->link);
+			return;
+		}
+	}
+
+	wlr_output = wlr_output_layout_output_at(server->output_layout,
+		server->cursor->x, server->cursor->y);
+	wl_list_for_each(candidate, &server->outputs, link) {
+		if (candidate->wlr_output == wlr_output)
+			output = candidate;
+	}
+	if (!output && !wl_list_empty(&server->outputs))
+		output = wl_container_of(server->outputs.next, output, link);
+	if (!output)
+		return;
+
+	root = tile_output_root(output);
+	if (root)
+		tile_insert_view(view, root, root->children.prev);
+}
+
+void tile_view_map(struct wet_view *view)
+{
+	/* Before the view gets focus, it goes next to the focused one */
+	if (!view->server->tiling || view->tile)
+		return;
+
+	tile_view_place(view);
+	tile_arrange(view->server);
+}
+
+static void tile_remove(struct wet_tile *tile)
+{
+	/* Containers emptied along the way go too, output roots stay */
+	struct wet_tile *parent = tile->parent;
+
+	wl_list_remove(&tile->link);
+	free(tile);
+
+	if (parent->parent && wl_list_empty(&parent->children)) {
+		tile_remove(parent);
+		return;
+	}
+	tile_mark_dirty(parent);
+}
+
+void tile_view_unmap(struct wet_view *view)
+{
+	if (!view->tile)
+		return;
+
+	tile_remove(view->tile);
+	view->tile = NULL;
+	tile_arrange(view->server);
+}
+
+bool tile_view_split(struct wet_view *view, bool vertical)
+{
+	/* Turn the view's tile into a container, views opened next to it
+	 * then share its space */
+	struct wet_tile *tile = view->tile, *container;
+
+	if (!tile)
+		return false;
+
+	container = tile_create(tile->parent, &tile->link);
+	if (!container)
+		return false;
+	container->split = vertical ? TILE_SPLIT_VERTICAL :
+		TILE_SPLIT_HORIZONTAL;
+	container->weight = tile->weight;
+	container->box = tile->box;
+
+	wl_list_remove(&tile->link);
+	wl_list_insert(&container->children, &tile->link);
+	tile->parent = container;
+	tile->weight = 1.0;
+	tile_mark_dirty(container);
+	return true;
+}
+
+void tile_view_rearrange(struct wet_view *view)
+{
+	/* Put the view back in its tile, e.g. after fullscreen */
+	if (!view->tile)
+		return;
+
+	view->tile->box = (struct wlr_box){ 0 };
+	tile_mark_dirty(view->tile);
+	tile_arrange(view->server);
+}
+
+bool tile_view_set_weight(struct wet_view *view, double weight)
+{
+	if (!view->tile || weight <= 0)
+		return false;
+
+	/* Takes effect with the next tile_arrange() */
+	view->tile->weight = weight;
+	tile_mark_dirty(view->tile->parent);
+	return true;
+}
+
+void tile_output_destroy(struct wet_output *output)
+{
+	/* The views move over to another output, as if they just mapped.
+	 * Called once the output left server->outputs. */
+	struct wet_server *server = output->server;
+	struct wet_view *view;
+	struct wet_tile *root = output->tile_root;
+
+	if (!root)
+		return;
+
+	output->tile_root = NULL;
+	wl_list_for_each(view, &server->views, link) {
+		struct wet_tile *tile = view->tile;
+
+		while (tile && tile->parent)
+			tile = tile->parent;
+		if (tile != root)
+			continue;
+		tile_remove(view->tile);
+		view->tile = NULL;
+	}
+	free(root);
+
+	wl_list_for_each(view, &server->views, link) {
+		if (!view->tile)
+			tile_view_place(view);
+	}
+	tile_arrange(server);
+}
+
+static void tile_layout_change(struct wl_listener *listener, void *data)
+{
+	struct wet_server *server =
+		wl_container_of(listener, server, tile_layout_change);
+
+	/* Only roots whose output box changed get arranged again */
+	tile_arrange(server);
+}
+
+void tile_init(struct wet_server *server)
+{
+	if (!server->tiling)
+		return;
+
+	server->tile_layout_change.notify = tile_layout_change;
+	wl_signal_add(&server->output_layout->events.change,
+		&server->tile_layout_change);
+}
@@ -0,0 +1,477 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <weston-pro.h>
+
+/*
+ * Spans of the frame, input and shell paths in Chrome's trace event JSON,
+ * which chrome://tracing and ui.perfetto.dev both open. Every thread
+ * records into a ring of its own without taking a lock, keeping the last
+ * TRACE_EVENTS events, like a flight recorder. trace_dump() writes them all
+ * out, on SIGUSR2 and at exit. It forks, and the child writes the rings as
+ * they were at that point while the compositor goes on.
+ *
+ * Streaming (-X) instead has a thread drain the rings into the file every
+ * TRACE_STREAM_INTERVAL ms until exit. Events a thread records faster than
+ * that are lost, the oldest first.
+ */
+
+#define TRACE_EVENTS 32768
+#define TRACE_THREADS 64
+#define TRACE_STREAM_INTERVAL 100
+
+struct trace_event {
+	/* Index + 1 once written, 0 while being written */
+	uint64_t seq;
+	uint64_t ts;
+	/* Spans only */
+	uint64_t dur;
+	const char *name;
+	/* Appended to the name after a dot, request names for example */
+	const char *detail;
+	/* The tag, with a number or a string */
+	const char *key;
+	uint64_t id;
+	char value[16];
+	bool instant;
+};
+
+struct trace_buffer {
+	pid_t tid;
+	const char *thread_name;
+	/* Only written by the owning thread */
+	uint64_t head;
+	struct trace_event events[TRACE_EVENTS];
+};
+
+static struct {
+	bool enabled;
+	char *path;
+	pthread_mutex_t lock;
+	struct trace_buffer *buffers[TRACE_THREADS];
+	int buffer_count;
+	/* Child writing the last dump */
+	pid_t writer;
+	/* Streaming only */
+	bool stream;
+	FILE *stream_file;
+	pthread_t stream_thread;
+	int stream_stop;
+	/* Next event of each buffer to write, and whether it was named */
+	uint64_t stream_next[TRACE_THREADS];
+	bool stream_named[TRACE_THREADS];
+} trace = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct trace_buffer *trace_local;
+
+static uint64_t trace_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static struct trace_buffer *trace_get_buffer(void)
+{
+	struct trace_buffer *buffer = trace_local;
+
+	if (buffer)
+		return buffer;
+
+	/* Once per thread, the only time we lock */
+	buffer = calloc(1, sizeof(*buffer));
+	if (!buffer)
+		return NULL;
+	buffer->tid = syscall(SYS_gettid);
+	buffer->thread_name = buffer->tid == getpid() ? "main" : "worker";
+
+	pthread_mutex_lock(&trace.lock);
+	if (trace.buffer_count < TRACE_THREADS) {
+		trace.buffers[trace.buffer_count++] = buffer;
+	} else {
+		free(buffer);
+		buffer = NULL;
+	}
+	pthread_mutex_unlock(&trace.lock);
+
+	trace_local = buffer;
+	return buffer;
+}
+
+static struct trace_event *trace_event_begin(struct trace_buffer *buffer)
+{
+	struct trace_event *event = &buffer->events[buffer->head % TRACE_EVENTS];
+
+	/* trace_dump() skips events it sees half written */
+	__atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return event;
+}
+
+static void trace_event_end(struct trace_buffer *buffer,
+		struct trace_event *event)
+{
+	__atomic_store_n(&event->seq, buffer->head + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&buffer->head, buffer->head + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_record(struct trace_buffer *buffer, const char *name,
+		const char *detail, uint64_t ts, uint64_t dur, bool instant,
+		const char *key, uint64_t id, const char *value)
+{
+	struct trace_event *event = trace_event_begin(buffer);
+
+	event->ts = ts;
+	event->dur = dur;
+	event->name = name;
+	event->detail = detail;
+	event->key = key;
+	event->id = id;
+	event->instant = instant;
+	if (value) {
+		strncpy(event->value, value, sizeof(event->value) - 1);
+		event->value[sizeof(event->value) - 1] = '\0';
+	} else {
+		event->value[0] = '\0';
+	}
+	trace_event_end(buffer, event);
+}
+
+bool trace_enabled(void)
+{
+	return trace.enabled;
+}
+
+void trace_thread_name(const char *name)
+{
+	struct trace_buffer *buffer;
+
+	if (!trace.enabled)
+		return;
+	buffer = trace_get_buffer();
+	if (buffer)
+		buffer->thread_name = name;
+}
+
+struct wet_trace_span trace_begin(const char *name)
+{
+	struct wet_trace_span span = { .name = name };
+
+	if (trace.enabled)
+		span.start = trace_now();
+	return span;
+}
+
+void trace_end(struct wet_trace_span *span, const char *key, uint64_t id)
+{
+	struct trace_buffer *buffer;
+
+	if (span->start == 0 || !(buffer = trace_get_buffer()))
+		return;
+	trace_record(buffer, span->name, NULL, span->start,
+		trace_now() - span->start, false, key, id, NULL);
+}
+
+void trace_end_str(struct wet_trace_span *span, const char *key,
+		const char *value)
+{
+	struct trace_buffer *buffer;
+
+	if (span->start == 0 || !(buffer = trace_get_buffer()))
+		return;
+	trace_record(buffer, span->name, NULL, span->start,
+		trace_now() - span->start, false, key, 0, value);
+}
+
+static void trace_protocol_logger(void *user_data,
+		enum wl_protocol_logger_type direction,
+		const struct wl_protocol_logger_message *message)
+{
+	/* Called right before libwayland runs the request, there is no hook
+	 * after it, so requests are instants between the spans they cause */
+	struct trace_buffer *buffer;
+	pid_t pid;
+
+	if (direction != WL_PROTOCOL_LOGGER_REQUEST ||
+			!(buffer = trace_get_buffer()))
+		return;
+	wl_client_get_credentials(wl_resource_get_client(message->resource),
+		&pid, NULL, NULL);
+	trace_record(buffer, wl_resource_get_class(message->resource),
+		message->message->name, trace_now(), 0, true, "client", pid,
+		NULL);
+}
+
+static void trace_stream_drain(void);
+
+static void *trace_stream_run(void *data)
+{
+	struct timespec interval = {
+		.tv_nsec = TRACE_STREAM_INTERVAL * 1000000,
+	};
+
+	while (!__atomic_load_n(&trace.stream_stop, __ATOMIC_RELAXED)) {
+		nanosleep(&interval, NULL);
+		trace_stream_drain();
+	}
+	return NULL;
+}
+
+static bool trace_stream_start(void)
+{
+	sigset_t all, old;
+	int ret;
+
+	trace.stream_file = fopen(trace.path, "w");
+	if (!trace.stream_file) {
+		printf("failed to write the trace to %s\n", trace.path);
+		return false;
+	}
+	fprintf(trace.stream_file,
+		"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+	/* Signals are for the main loop, which may not have blocked them
+	 * yet */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&trace.stream_thread, NULL, trace_stream_run,
+		NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		printf("failed to start the trace thread\n");
+		fclose(trace.stream_file);
+		trace.stream_file = NULL;
+		return false;
+	}
+	return true;
+}
+
+bool trace_init(const char *path, bool stream)
+{
+	trace.path = strdup(path);
+	if (!trace.path)
+		return false;
+	trace.stream = stream;
+	if (stream && !trace_stream_start()) {
+		free(trace.path);
+		trace.path = NULL;
+		return false;
+	}
+	trace.enabled = true;
+	return true;
+}
+
+void trace_add_display(struct wl_display *display)
+{
+	if (trace.enabled)
+		wl_display_add_protocol_logger(display, trace_protocol_logger,
+			NULL);
+}
+
+static void trace_write_string(FILE *f, const char *str)
+{
+	/* Names come from us and protocol XML, tags from clients */
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fputc('\\', f);
+		if ((unsigned char)*str >= 0x20)
+			fputc(*str, f);
+	}
+}
+
+static void trace_write_name(FILE *f, struct trace_buffer *buffer,
+		pid_t pid, bool first)
+{
+	fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+		"\"tid\":%d,\"args\":{\"name\":\"%s\"}}", first ? "" : ",",
+		(int)pid, (int)buffer->tid, buffer->thread_name);
+}
+
+static void trace_write_events(FILE *f, struct trace_buffer *buffer,
+		pid_t pid, uint64_t i, uint64_t head)
+{
+	struct trace_event *slot, event;
+
+	/* Anything older has been written over */
+	if (head - i > TRACE_EVENTS)
+		i = head - TRACE_EVENTS;
+	for (; i < head; i++) {
+		/* The thread may be writing over the oldest ones right now */
+		slot = &buffer->events[i % TRACE_EVENTS];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != i + 1)
+			continue;
+		memcpy(&event, slot, sizeof(event));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != i + 1)
+			continue;
+		event.value[sizeof(event.value) - 1] = '\0';
+
+		fprintf(f, ",\n{\"name\":\"");
+		trace_write_string(f, event.name);
+		if (event.detail) {
+			fputc('.', f);
+			trace_write_string(f, event.detail);
+		}
+		fprintf(f, "\",\"cat\":\"weston-pro\",\"pid\":%d,\"tid\":%d,"
+			"\"ts\":%.3f", (int)pid, (int)buffer->tid,
+			event.ts / 1e3);
+		if (event.instant)
+			fprintf(f, ",\"ph\":\"i\",\"s\":\"t\"");
+		else
+			fprintf(f, ",\"ph\":\"X\",\"dur\":%.3f",
+				event.dur / 1e3);
+		if (event.key) {
+			fprintf(f, ",\"args\":{\"%s\":", event.key);
+			if (event.value[0]) {
+				fputc('"', f);
+				trace_write_string(f, event.value);
+				fputc('"', f);
+			} else {
+				fprintf(f, "%" PRIu64, event.id);
+			}
+			fputc('}', f);
+		}
+		fputc('}', f);
+	}
+}
+
+static int trace_buffer_count(void)
+{
+	int count;
+
+	pthread_mutex_lock(&trace.lock);
+	count = trace.buffer_count;
+	pthread_mutex_unlock(&trace.lock);
+	return count;
+}
+
+static void trace_stream_drain(void)
+{
+	/* Only from the trace thread, or once it is gone */
+	FILE *f = trace.stream_file;
+	pid_t pid = getpid();
+	uint64_t head;
+	int i, count = trace_buffer_count();
+
+	for (i = 0; i < count; i++) {
+		if (!trace.stream_named[i]) {
+			trace_write_name(f, trace.buffers[i], pid, i == 0);
+			trace.stream_named[i] = true;
+		}
+		head = __atomic_load_n(&trace.buffers[i]->head,
+			__ATOMIC_ACQUIRE);
+		trace_write_events(f, trace.buffers[i], pid,
+			trace.stream_next[i], head);
+		trace.stream_next[i] = head;
+	}
+	fflush(f);
+}
+
+static bool trace_write(pid_t pid, int count)
+{
+	uint64_t head;
+	FILE *f;
+	int i;
+
+	f = fopen(trace.path, "w");
+	if (!f) {
+		printf("failed to write the trace to %s\n", trace.path);
+		return false;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (i = 0; i < count; i++) {
+		head = __atomic_load_n(&trace.buffers[i]->head,
+			__ATOMIC_ACQUIRE);
+		trace_write_name(f, trace.buffers[i], pid, i == 0);
+		trace_write_events(f, trace.buffers[i], pid, 0, head);
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+
+	printf("trace written to %s\n", trace.path);
+	return true;
+}
+
+bool trace_dump(void)
+{
+	pid_t pid = getpid(), writer;
+	int count;
+	bool ret;
+
+	if (!trace.enabled)
+		return false;
+	/* Already on its way to the file */
+	if (trace.stream)
+		return true;
+
+	if (trace.writer > 0) {
+		if (waitpid(trace.writer, NULL, WNOHANG) == 0) {
+			printf("still writing the last trace to %s\n",
+			       trace.path);
+			return false;
+		}
+		trace.writer = 0;
+	}
+
+	/* Read now, the lock may be held by another thread when we fork */
+	count = trace_buffer_count();
+	fflush(stdout);
+	writer = fork();
+	if (writer == 0) {
+		/* Sees the rings as they were at the fork */
+		ret = trace_write(pid, count);
+		fflush(stdout);
+		_exit(ret ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	if (writer < 0)
+		return trace_write(pid, count);
+	trace.writer = writer;
+	return true;
+}
+
+void trace_finish(void)
+{
+	/* Every other thread must be gone */
+	int i;
+
+	if (!trace.enabled)
+		return;
+	trace.enabled = false;
+	if (trace.writer > 0) {
+		waitpid(trace.writer, NULL, 0);
+		trace.writer = 0;
+	}
+	if (trace.stream) {
+		__atomic_store_n(&trace.stream_stop, 1, __ATOMIC_RELAXED);
+		pthread_join(trace.stream_thread, NULL);
+		trace_stream_drain();
+		fprintf(trace.stream_file, "\n]}\n");
+		fclose(trace.stream_file);
+		trace.stream_file = NULL;
+		printf("trace written to %s\n", trace.path);
+	}
+	for (i = 0; i < trace.buffer_count; i++)
+		free(trace.buffers[i]);
+	trace.buffer_count = 0;
+	trace_local = NULL;
+	free(trace.path);
+	trace.path = NULL;
+}
@@ -0,0 +1,379 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include <wlr/types/wlr_buffer.h>
+
+#include <weston-pro.h>
+
+/*
+ * A transaction moves and resizes a set of views as one. Committing it
+ * sends a configure to every view whose size changes, then waits until
+ * each of them committed a buffer for it, or until transaction_timeout
+ * milliseconds went by. Only then are all the positions set, in a single
+ * scene update.
+ *
+ * Meanwhile its views are held, like sway does: the buffers they showed
+ * when the transaction started are put in their place in the scene, and
+ * their live trees wait in a disabled tree, where clients still get frame
+ * callbacks and input. So the views never show up half resized or in their
+ * new size at the old position, while everything else, the cursor
+ * included, keeps being drawn.
+ *
+ * One transaction is in flight at a time, later ones queue behind it.
+ */
+
+struct wet_transaction_entry {
+	struct wl_list link; /* wet_transaction.entries */
+	struct wl_list view_link; /* wet_view.transactions */
+	struct wet_transaction *transaction;
+	struct wet_view *view;
+	/* Target window geometry in layout coordinates */
+	struct wlr_box geometry;
+	/* Configure we wait for, 0 once the view is ready */
+	uint32_t serial;
+	bool acked;
+};
+
+struct wet_transaction {
+	struct wl_list link; /* wet_server.transactions */
+	struct wet_server *server;
+	struct wl_list entries;
+	int waiting;
+	struct wl_event_source *timer;
+	struct timespec start;
+};
+
+static void transaction_start(struct wet_transaction *transaction);
+
+static void snapshot_iterator(struct wlr_surface *surface, int sx, int sy,
+		void *data)
+{
+	/* Locking the buffer keeps wlroots from updating it in place */
+	struct wlr_scene_tree *snapshot = data;
+	struct wlr_scene_buffer *scene_buffer;
+
+	if (!surface->buffer)
+		return;
+	scene_buffer = wlr_scene_buffer_create(&snapshot->node,
+		&surface->buffer->base);
+	if (!scene_buffer)
+		return;
+	wlr_scene_buffer_set_dest_size(scene_buffer, surface->current.width,
+		surface->current.height);
+	wlr_scene_node_set_position(&scene_buffer->node, sx, sy);
+}
+
+static void view_hold(struct wet_view *view)
+{
+	/* Failing that, the view just shows its new state early */
+	struct wet_server *server = view->server;
+	struct wlr_scene_tree *snapshot;
+
+	if (view->snapshot || !view->mapped)
+		return;
+	snapshot = wlr_scene_tree_create(&server->view_tree->node);
+	if (!snapshot)
+		return;
+	/* Surface positions come with the view's, the view tree and the
+	 * held tree both sit at the origin */
+	wlr_scene_node_for_each_surface(view->scene_node, snapshot_iterator,
+		snapshot);
+	wlr_scene_node_set_enabled(&snapshot->node,
+		view->scene_node->state.enabled);
+	wlr_scene_node_place_above(&snapshot->node, view->scene_node);
+	wlr_scene_node_reparent(view->scene_node, &server->held_tree->node);
+	view->snapshot = snapshot;
+}
+
+static void view_release(struct wet_view *view)
+{
+	struct wet_server *server = view->server;
+
+	if (!view->snapshot)
+		return;
+	wlr_scene_node_reparent(view->scene_node, &server->view_tree->node);
+	wlr_scene_node_place_above(view->scene_node, &view->snapshot->node);
+	wlr_scene_node_destroy(&view->snapshot->node);
+	view->snapshot = NULL;
+}
+
+static void entry_destroy(struct wet_transaction_entry *entry)
+{
+	wl_list_remove(&entry->link);
+	wl_list_remove(&entry->view_link);
+	free(entry);
+}
+
+static void transaction_destroy(struct wet_transaction *transaction)
+{
+	struct wet_transaction_entry *entry, *tmp;
+
+	wl_list_for_each_safe(entry, tmp, &transaction->entries, link)
+		entry_destroy(entry);
+	if (transaction->timer)
+		wl_event_source_remove(transaction->timer);
+	wl_list_remove(&transaction->link);
+	free(transaction);
+}
+
+static void transaction_apply(struct wet_transaction *transaction)
+{
+	struct wet_server *server = transaction->server;
+	struct wet_transaction_entry *entry;
+	struct wet_transaction *next;
+	struct wet_output *output;
+	struct wlr_box geo;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	histogram_add(&server->stats.transaction_latency,
+		(int64_t)(now.tv_sec - transaction->start.tv_sec) * 1000000000 +
+		(now.tv_nsec - transaction->start.tv_nsec));
+	server->stats.transactions++;
+
+	/* Place the window geometry the clients actually committed, and
+	 * show them all at once */
+	wl_list_for_each(entry, &transaction->entries, link) {
+		wlr_xdg_surface_get_geometry(entry->view->xdg_surface, &geo);
+		view_set_position(entry->view, entry->geometry.x - geo.x,
+			entry->geometry.y - geo.y);
+	}
+	wl_list_for_each(entry, &transaction->entries, link)
+		view_release(entry->view);
+	views_update_visibility(server);
+
+	transaction_destroy(transaction);
+
+	/* The damage of the swap doesn't always reach an output that was
+	 * idle meanwhile */
+	wl_list_for_each(output, &server->outputs, link)
+		wlr_output_schedule_frame(output->wlr_output);
+
+	if (!wl_list_empty(&server->transactions)) {
+		next = wl_container_of(server->transactions.next, next, link);
+		transaction_start(next);
+	}
+}
+
+static int transaction_timeout(void *data)
+{
+	struct wet_transaction *transaction = data;
+
+	transaction->server->stats.transaction_timeouts++;
+	transaction_apply(transaction);
+	return 0;
+}
+
+static void entry_ready(struct wet_transaction_entry *entry)
+{
+	struct wet_transaction *transaction = entry->transaction;
+
+	entry->serial = 0;
+	if (--transaction->waiting == 0)
+		transaction_apply(transaction);
+}
+
+static void transaction_start(struct wet_transaction *transaction)
+{
+	struct wet_server *server = transaction->server;
+	struct wet_transaction_entry *entry;
+	struct wet_view *view;
+	struct wlr_box geo;
+
+	clock_gettime(CLOCK_MONOTONIC, &transaction->start);
+
+	wl_list_for_each(entry, &transaction->entries, link) {
+		view = entry->view;
+		/* The transaction takes over from any resize in progress */
+		view->resize.serial = 0;
+		view->resize.pending = false;
+
+		wlr_xdg_surface_get_geometry(view->xdg_surface, &geo);
+		if (!view->mapped || (geo.width == entry->geometry.width &&
+				geo.height == entry->geometry.height))
+			continue;
+		entry->serial = wlr_xdg_toplevel_set_size(view->xdg_surface,
+			entry->geometry.width, entry->geometry.height);
+		transaction->waiting++;
+	}
+
+	if (transaction->waiting == 0) {
+		transaction_apply(transaction);
+		return;
+	}
+
+	transaction->timer = wl_event_loop_add_timer(
+		wl_display_get_event_loop(server->wl_display),
+		transaction_timeout, transaction);
+	if (!transaction->timer) {
+		transaction_apply(transaction);
+		return;
+	}
+	wl_event_source_timer_update(transaction->timer,
+		server->transaction_timeout > 0 ?
+			server->transaction_timeout : 1);
+
+	/* Views that only move are held too, they move with the rest */
+	wl_list_for_each(entry, &transaction->entries, link)
+		view_hold(entry->view);
+}
+
+struct wet_transaction *transaction_create(struct wet_server *server)
+{
+	struct wet_transaction *transaction;
+
+	transaction = calloc(1, sizeof(*transaction));
+	if (!transaction)
+		return NULL;
+	transaction->server = server;
+	wl_list_init(&transaction->entries);
+	wl_list_init(&transaction->link);
+	return transaction;
+}
+
+bool transaction_add_view(struct wet_transaction *transaction,
+		struct wet_view *view, const struct wlr_box *geometry)
+{
+	struct wet_transaction_entry *entry;
+
+	wl_list_for_each(entry, &transaction->entries, link) {
+		if (entry->view == view) {
+			entry->geometry = *geometry;
+			return true;
+		}
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return false;
+	entry->transaction = transaction;
+	entry->view = view;
+	entry->geometry = *geometry;
+	wl_list_insert(transaction->entries.prev, &entry->link);
+	wl_list_insert(&view->transactions, &entry->view_link);
+	return true;
+}
+
+void transaction_get_geometry(struct wet_transaction *transaction,
+		struct wet_view *view, struct wlr_box *geometry)
+{
+	/* Where the transaction puts the view so far */
+	struct wet_transaction_entry *entry;
+
+	wl_list_for_each(entry, &transaction->entries, link) {
+		if (entry->view == view) {
+			*geometry = entry->geometry;
+			return;
+		}
+	}
+	view_get_geometry(view, geometry);
+}
+
+void transaction_commit(struct wet_transaction *transaction)
+{
+	struct wet_server *server = transaction->server;
+	bool idle = wl_list_empty(&server->transactions);
+
+	wl_list_insert(server->transactions.prev, &transaction->link);
+	if (idle)
+		transaction_start(transaction);
+}
+
+bool transaction_holds_output(struct wet_server *server,
+		struct wlr_output *output)
+{
+	/* Whether the output shows a held view, that is scene buffers
+	 * rather than surfaces */
+	struct wet_transaction_entry *entry;
+	struct wet_transaction *head;
+	struct wlr_box *output_box, box, intersection;
+
+	if (wl_list_empty(&server->transactions))
+		return false;
+	head = wl_container_of(server->transactions.next, head, link);
+	output_box = wlr_output_layout_get_box(server->output_layout, output);
+	if (!output_box)
+		return false;
+
+	wl_list_for_each(entry, &head->entries, link) {
+		if (!entry->view->snapshot)
+			continue;
+		view_get_geometry(entry->view, &box);
+		if (wlr_box_intersection(&intersection, output_box, &box))
+			return true;
+	}
+	return false;
+}
+
+void transaction_view_raise(struct wet_view *view)
+{
+	if (view->snapshot)
+		wlr_scene_node_raise_to_top(&view->snapshot->node);
+}
+
+void transaction_view_set_enabled(struct wet_view *view, bool enabled)
+{
+	if (view->snapshot)
+		wlr_scene_node_set_enabled(&view->snapshot->node, enabled);
+}
+
+static struct wet_transaction_entry *view_in_flight(struct wet_view *view)
+{
+	/* The entry of the in-flight transaction that still waits for us */
+	struct wet_transaction_entry *entry;
+	struct wet_transaction *head;
+
+	if (wl_list_empty(&view->server->transactions))
+		return NULL;
+	head = wl_container_of(view->server->transactions.next, head, link);
+
+	wl_list_for_each(entry, &view->transactions, view_link) {
+		if (entry->transaction == head && entry->serial != 0)
+			return entry;
+	}
+	return NULL;
+}
+
+void transaction_view_ack(struct wet_view *view, uint32_t serial)
+{
+	struct wet_transaction_entry *entry = view_in_flight(view);
+
+	if (entry && (int32_t)(serial - entry->serial) >= 0)
+		entry->acked = true;
+}
+
+void transaction_view_commit(struct wet_view *view)
+{
+	/* The first commit after the ack carries the new size */
+	struct wet_transaction_entry *entry = view_in_flight(view);
+
+	if (entry && entry->acked)
+		entry_ready(entry);
+}
+
+void transaction_view_remove(struct wet_view *view)
+{
+	/* Unmapped or destroyed: nothing to wait for or to place anymore */
+	struct wet_transaction_entry *entry;
+	struct wet_transaction *transaction;
+	bool waiting;
+
+	view_release(view);
+
+	/* Applying one transaction may start and apply the next, which drops
+	 * entries of ours too, so always take the first one left */
+	while (!wl_list_empty(&view->transactions)) {
+		entry = wl_container_of(view->transactions.next, entry,
+			view_link);
+		transaction = entry->transaction;
+		waiting = entry->serial != 0;
+		entry_destroy(entry);
+		if (waiting && --transaction->waiting == 0)
+			transaction_apply(transaction);
+	}
+}
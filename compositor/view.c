@@ -3,11 +3,32 @@
  * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
  */
 
+#include <wlr/util/edges.h>
+
 #include <weston-pro.h>
 
+static void deactivate_focused(struct wlr_seat *seat) {
+	/*
+	 * Deactivate the previously focused surface. This lets the client know
+	 * it no longer has focus and the client will repaint accordingly, e.g.
+	 * stop displaying a caret. Only toplevels have an activated state, ivi
+	 * surfaces don't.
+	 */
+	struct wlr_surface *prev_surface = seat->keyboard_state.focused_surface;
+	struct wlr_xdg_surface *previous;
+
+	if (!prev_surface || !wlr_surface_is_xdg_surface(prev_surface)) {
+		return;
+	}
+	previous = wlr_xdg_surface_from_wlr_surface(prev_surface);
+	if (previous->role == WLR_XDG_SURFACE_ROLE_TOPLEVEL) {
+		wlr_xdg_toplevel_set_activated(previous, false);
+	}
+}
+
 void focus_view(struct wet_view *view, struct wlr_surface *surface) {
 	/* Note: this function only deals with keyboard focus. */
-	if (view == NULL) {
+	if (view == NULL || view->server->locked) {
 		return;
 	}
 	struct wet_server *server = view->server;
@@ -17,21 +38,10 @@ void focus_view(struct wet_view *view, struct wlr_surface *surface) {
 		/* Don't re-focus an already focused surface. */
 		return;
 	}
-	if (prev_surface) {
-		/*
-		 * Deactivate the previously focused surface. This lets the client know
-		 * it no longer has focus and the client will repaint accordingly, e.g.
-		 * stop displaying a caret.
-		 */
-		struct wlr_xdg_surface *previous = wlr_xdg_surface_from_wlr_surface(
-					seat->keyboard_state.focused_surface);
-		wlr_xdg_toplevel_set_activated(previous, false);
-	}
+	deactivate_focused(seat);
 	struct wlr_keyboard *keyboard = wlr_seat_get_keyboard(seat);
 	/* Move the view to the front */
-	wlr_scene_node_raise_to_top(view->scene_node);
-	wl_list_remove(&view->link);
-	wl_list_insert(&server->views, &view->link);
+	view_raise(view);
 	/* Activate the new surface */
 	wlr_xdg_toplevel_set_activated(view->xdg_surface, true);
 	/*
@@ -41,4 +51,293 @@ void focus_view(struct wet_view *view, struct wlr_surface *surface) {
 	 */
 	wlr_seat_keyboard_notify_enter(seat, view->xdg_surface->surface,
 		keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
+	ipc_send_event(server, "focus %u", view->id);
+}
+
+void focus_surface(struct wet_server *server, struct wlr_surface *surface) {
+	/* Keyboard focus for surfaces without a view, e.g. ivi ones. Their
+	 * stacking is up to the layer they are on. */
+	struct wlr_seat *seat = server->seat;
+	struct wlr_keyboard *keyboard;
+
+	if (surface == NULL ||
+			surface == seat->keyboard_state.focused_surface) {
+		return;
+	}
+	deactivate_focused(seat);
+	keyboard = wlr_seat_get_keyboard(seat);
+	wlr_seat_keyboard_notify_enter(seat, surface,
+		keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
+}
+
+void view_raise(struct wet_view *view) {
+	/* Stacking only, keyboard focus stays where it is */
+	struct wet_server *server = view->server;
+
+	wlr_scene_node_raise_to_top(view->scene_node);
+	transaction_view_raise(view);
+	view->stack = ++server->stack_seq;
+	if (view->mapped) {
+		wl_list_remove(&view->link);
+		wl_list_insert(&server->views, &view->link);
+	}
+	views_update_visibility(server);
+}
+
+void view_set_position(struct wet_view *view, int x, int y) {
+	/* Every view move goes through here so the spatial index follows */
+	view->x = x;
+	view->y = y;
+	wlr_scene_node_set_position(view->scene_node, x, y);
+	if (view->mapped) {
+		spatial_view_update(view);
+	}
+}
+
+static void view_apply_resize_position(struct wet_view *view) {
+	/* Place the window geometry the client actually committed against the
+	 * edges that must not move. */
+	struct wlr_box geo_box;
+	int x, y;
+
+	wlr_xdg_surface_get_geometry(view->xdg_surface, &geo_box);
+	x = view->resize.anchor_x - geo_box.x;
+	if (view->resize.edges & WLR_EDGE_LEFT) {
+		x -= geo_box.width;
+	}
+	y = view->resize.anchor_y - geo_box.y;
+	if (view->resize.edges & WLR_EDGE_TOP) {
+		y -= geo_box.height;
+	}
+	view_set_position(view, x, y);
+}
+
+static int view_resize_timeout(void *data) {
+	/* The client sat on its configure for transaction_timeout, give up on
+	 * it and send the size it missed meanwhile, if any */
+	struct wet_view *view = data;
+
+	if (view->resize.serial != 0 && view->resize.pending &&
+			view->mapped) {
+		view->resize.serial = 0;
+		view_resize(view, view->resize.anchor_x, view->resize.anchor_y,
+			view->resize.edges, view->resize.width, view->resize.height);
+	}
+	return 0;
+}
+
+void view_resize(struct wet_view *view, int anchor_x, int anchor_y,
+		uint32_t edges, int width, int height) {
+	/*
+	 * Ask the client for a new size, keeping the given edges in place.
+	 * anchor_x is the right edge when resizing from the left, the left edge
+	 * otherwise, and likewise for anchor_y.
+	 *
+	 * Only one configure is kept in flight per view. Sizes requested while
+	 * the client is still busy with the previous one are coalesced and only
+	 * the latest is sent once it committed, so slow clients are not
+	 * flooded. A client that hasn't answered within transaction_timeout
+	 * doesn't hold the latest size back: a timer gives up on its
+	 * configure and sends it anyway, like transactions do. The position
+	 * only changes in view_resize_committed(), in the same frame as the
+	 * buffer of the new size.
+	 */
+	struct wet_server *server = view->server;
+
+	view->resize.anchor_x = anchor_x;
+	view->resize.anchor_y = anchor_y;
+	view->resize.edges = edges;
+	view->resize.width = width;
+	view->resize.height = height;
+
+	if (view->resize.serial != 0) {
+		view->resize.pending = true;
+		return;
+	}
+
+	/* A late ack of a configure given up on is older than the new serial
+	 * and doesn't count, see xdg_surface_ack_configure() */
+	view->resize.pending = false;
+	view->resize.acked = false;
+	view->resize.serial = wlr_xdg_toplevel_set_size(view->xdg_surface,
+		width, height);
+
+	if (!view->resize.timer) {
+		view->resize.timer = wl_event_loop_add_timer(
+			wl_display_get_event_loop(server->wl_display),
+			view_resize_timeout, view);
+	}
+	if (view->resize.timer) {
+		wl_event_source_timer_update(view->resize.timer,
+			server->transaction_timeout > 0 ?
+				server->transaction_timeout : 1);
+	}
+}
+
+void view_resize_committed(struct wet_view *view) {
+	/* Called on every commit of the view, after wlroots latched the new
+	 * state and before anything gets rendered. */
+	if (view->resize.serial == 0 || !view->resize.acked) {
+		return;
+	}
+
+	view->resize.serial = 0;
+	view_apply_resize_position(view);
+	if (view->resize.pending) {
+		view_resize(view, view->resize.anchor_x, view->resize.anchor_y,
+			view->resize.edges, view->resize.width, view->resize.height);
+	}
+}
+
+void view_get_geometry(struct wet_view *view, struct wlr_box *box) {
+	/* The window geometry in layout coordinates, without CSD shadows */
+	wlr_xdg_surface_get_geometry(view->xdg_surface, box);
+	box->x += view->x;
+	box->y += view->y;
+}
+
+static struct wlr_output *view_get_output(struct wet_view *view) {
+	/* The output under the center of the view, or any output at all */
+	struct wet_server *server = view->server;
+	struct wlr_box box;
+	struct wlr_output *output;
+
+	view_get_geometry(view, &box);
+	output = wlr_output_layout_output_at(server->output_layout,
+		box.x + box.width / 2, box.y + box.height / 2);
+	if (!output) {
+		output = wlr_output_layout_get_center_output(server->output_layout);
+	}
+	return output;
+}
+
+static void view_restore_geometry(struct wet_view *view) {
+	struct wlr_box *box = &view->saved_geometry;
+
+	view_resize(view, box->x, box->y, 0, box->width, box->height);
+}
+
+void view_set_fullscreen(struct wet_view *view, bool fullscreen,
+		struct wlr_output *output) {
+	/*
+	 * A fullscreen view covers its output alone: views stacked below it on
+	 * that output are disabled in the scene, which lets wlr_scene scan the
+	 * client buffer out directly instead of compositing.
+	 */
+	struct wet_server *server = view->server;
+	struct wlr_box *box;
+
+	if (fullscreen) {
+		if (!output) {
+			output = view_get_output(view);
+		}
+		box = output ? wlr_output_layout_get_box(server->output_layout,
+			output) : NULL;
+		if (!box) {
+			/* Nowhere to go, but the client still wants a configure */
+			wlr_xdg_surface_schedule_configure(view->xdg_surface);
+			return;
+		}
+		if (!view->fullscreen && !view->maximized) {
+			view_get_geometry(view, &view->saved_geometry);
+		}
+		view->fullscreen = true;
+		view->fullscreen_output = output;
+		wlr_xdg_toplevel_set_fullscreen(view->xdg_surface, true);
+		view_resize(view, box->x, box->y, 0, box->width, box->height);
+		if (view->mapped) {
+			focus_view(view, view->xdg_surface->surface);
+		}
+	} else {
+		if (!view->fullscreen) {
+			wlr_xdg_surface_schedule_configure(view->xdg_surface);
+			return;
+		}
+		view->fullscreen = false;
+		view->fullscreen_output = NULL;
+		wlr_xdg_toplevel_set_fullscreen(view->xdg_surface, false);
+		if (view->tile) {
+			tile_view_rearrange(view);
+		} else if (view->maximized) {
+			view->maximized = false;
+			view_set_maximized(view, true);
+		} else {
+			view_restore_geometry(view);
+		}
+	}
+
+	views_update_visibility(server);
+}
+
+void view_set_maximized(struct wet_view *view, bool maximized) {
+	struct wet_server *server = view->server;
+	struct wlr_output *output;
+	struct wlr_box usable;
+
+	if (view->fullscreen || view->maximized == maximized) {
+		/* Fullscreen wins, it is restored to maximized when it ends */
+		if (view->fullscreen) {
+			view->maximized = maximized;
+		}
+		wlr_xdg_surface_schedule_configure(view->xdg_surface);
+		return;
+	}
+
+	if (maximized) {
+		/* Maximized views leave the panel alone */
+		output = view_get_output(view);
+		if (!output || !shell_get_usable_box(server, output, &usable)) {
+			wlr_xdg_surface_schedule_configure(view->xdg_surface);
+			return;
+		}
+		view_get_geometry(view, &view->saved_geometry);
+		view->maximized = true;
+		wlr_xdg_toplevel_set_maximized(view->xdg_surface, true);
+		view_resize(view, usable.x, usable.y, 0, usable.width,
+			usable.height);
+	} else {
+		view->maximized = false;
+		wlr_xdg_toplevel_set_maximized(view->xdg_surface, false);
+		view_restore_geometry(view);
+	}
+}
+
+static bool view_is_covered(struct wet_view *view) {
+	/* Whether a fullscreen view above this one shares its output */
+	struct wet_server *server = view->server;
+	struct wet_view *fullscreen;
+	struct wlr_box *output_box, box, intersection;
+
+	view_get_geometry(view, &box);
+	wl_list_for_each(fullscreen, &server->views, link) {
+		if (fullscreen == view || !fullscreen->fullscreen ||
+				fullscreen->stack < view->stack) {
+			continue;
+		}
+		output_box = wlr_output_layout_get_box(server->output_layout,
+			fullscreen->fullscreen_output);
+		if (output_box &&
+				wlr_box_intersection(&intersection, output_box, &box)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void views_update_visibility(struct wet_server *server) {
+	/* Called whenever stacking, fullscreen state or positions change */
+	struct wet_view *view;
+	bool visible;
+
+	wl_list_for_each(view, &server->views, link) {
+		visible = !view_is_covered(view);
+		if (view->scene_node->state.enabled == visible) {
+			continue;
+		}
+		wlr_scene_node_set_enabled(view->scene_node, visible);
+		transaction_view_set_enabled(view, visible);
+		/* Disabled nodes have no bounds in the spatial index */
+		spatial_view_update(view);
+	}
+	shell_update_visibility(server);
 }
@@ -0,0 +1,336 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) 2023 He Yong <hyyoxhk@163.com>
+ */
+
+#include "config.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <weston-pro.h>
+
+/*
+ * Event loop stall detector. server_run() times every dispatch of the event
+ * loop. A thread of ours checks on the dispatch in progress and, once it
+ * runs past the threshold, interrupts the main thread with SIGPROF to take
+ * a backtrace of whatever is blocking it. When the dispatch is over the
+ * stall is logged and counted against its call site: the innermost frame
+ * in our own code, which addr2line turns into a function and line.
+ *
+ * backtrace() isn't async-signal-safe, it may load libgcc and take the
+ * loader lock the interrupted code holds. The handler walks the frame
+ * pointers from the interrupted context instead, which is why we build
+ * with -fno-omit-frame-pointer. Libraries built without them show up as
+ * their innermost frame only, or cut the walk short.
+ */
+
+#define WATCHDOG_SIGNAL SIGPROF
+#define WATCHDOG_FRAMES 32
+#define WATCHDOG_SITES 64
+
+struct watchdog_site {
+	/* NULL for stalls over before we got a backtrace */
+	void *address;
+	char name[80];
+	struct wet_histogram stalls;
+};
+
+struct wet_watchdog {
+	struct wet_server *server;
+	int64_t threshold_nsec;
+	pthread_t thread;
+	pthread_t main_thread;
+	/* The main thread's stack, frame pointers outside of it end a walk */
+	uintptr_t stack_low, stack_high;
+	bool stop;
+
+	/* Odd while dispatching, only written by the main thread */
+	uint64_t seq;
+	uint64_t start;
+	/* Dispatch the watchdog asked a backtrace of, and got one of */
+	uint64_t requested_seq;
+	uint64_t sampled_seq;
+	void *frames[WATCHDOG_FRAMES];
+	int frame_count;
+
+	uint64_t dispatches;
+	struct watchdog_site sites[WATCHDOG_SITES];
+	int site_count;
+};
+
+/* For the signal handler */
+static struct wet_watchdog *watchdog_instance;
+
+static uint64_t watchdog_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int watchdog_walk_stack(struct wet_watchdog *watchdog,
+		const ucontext_t *context)
+{
+	/* Each frame starts with the caller's frame pointer followed by the
+	 * return address, on x86_64 and aarch64 alike. Frames go up the
+	 * stack, anything else is not a frame pointer. */
+	uintptr_t pc, fp, *frame;
+	int count = 0;
+
+#if defined(__x86_64__)
+	pc = context->uc_mcontext.gregs[REG_RIP];
+	fp = context->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+	pc = context->uc_mcontext.pc;
+	fp = context->uc_mcontext.regs[29];
+#else
+	/* No frame layout we know, stalls go to the unknown site */
+	return 0;
+#endif
+
+	watchdog->frames[count++] = (void *)pc;
+	while (count < WATCHDOG_FRAMES && fp >= watchdog->stack_low &&
+			fp + 2 * sizeof(uintptr_t) <= watchdog->stack_high &&
+			fp % sizeof(uintptr_t) == 0) {
+		frame = (uintptr_t *)fp;
+		if (frame[1] == 0)
+			break;
+		watchdog->frames[count++] = (void *)frame[1];
+		if (frame[0] <= fp)
+			break;
+		fp = frame[0];
+	}
+	return count;
+}
+
+static void watchdog_handle_signal(int signal_number, siginfo_t *info,
+		void *context)
+{
+	/* On the main thread, in the middle of the stalled dispatch */
+	struct wet_watchdog *watchdog = watchdog_instance;
+	int saved_errno = errno;
+	uint64_t seq;
+
+	if (!watchdog)
+		return;
+	seq = watchdog->seq;
+	if ((seq & 1) && __atomic_load_n(&watchdog->requested_seq,
+			__ATOMIC_ACQUIRE) == seq) {
+		watchdog->frame_count = watchdog_walk_stack(watchdog,
+			context);
+		watchdog->sampled_seq = seq;
+	}
+	errno = saved_errno;
+}
+
+static void *watchdog_thread(void *data)
+{
+	struct wet_watchdog *watchdog = data;
+	int64_t period = watchdog->threshold_nsec / 4;
+	struct timespec sleep;
+	uint64_t seq, start, last = 0;
+
+	if (period < 1000000)
+		period = 1000000;
+	sleep.tv_sec = period / 1000000000;
+	sleep.tv_nsec = period % 1000000000;
+
+	while (!__atomic_load_n(&watchdog->stop, __ATOMIC_RELAXED)) {
+		nanosleep(&sleep, NULL);
+
+		seq = __atomic_load_n(&watchdog->seq, __ATOMIC_ACQUIRE);
+		if (!(seq & 1) || seq == last)
+			continue;
+		start = __atomic_load_n(&watchdog->start, __ATOMIC_RELAXED);
+		if ((int64_t)(watchdog_now() - start) < watchdog->threshold_nsec)
+			continue;
+
+		/* Once per stall, the first backtrace is the interesting
+		 * one and the signal interrupts blocking calls */
+		last = seq;
+		__atomic_store_n(&watchdog->requested_seq, seq,
+			__ATOMIC_RELEASE);
+		pthread_kill(watchdog->main_thread, WATCHDOG_SIGNAL);
+	}
+
+	return NULL;
+}
+
+static struct watchdog_site *watchdog_get_site(struct wet_watchdog *watchdog,
+		void **frames, int count)
+{
+	/* frames[0] is where the main thread was interrupted */
+	struct watchdog_site *site;
+	void *address = NULL;
+	Dl_info self, info;
+	const char *object;
+	int i;
+
+	if (count > 0 && dladdr((void *)watchdog_handle_signal, &self)) {
+		for (i = 0; i < count; i++) {
+			if (dladdr(frames[i], &info) &&
+					info.dli_fbase == self.dli_fbase) {
+				address = frames[i];
+				break;
+			}
+		}
+		/* Not through our code at all */
+		if (!address)
+			address = frames[0];
+	}
+
+	for (i = 0; i < watchdog->site_count; i++)
+		if (watchdog->sites[i].address == address)
+			return &watchdog->sites[i];
+	/* Full, the last one takes the rest */
+	if (watchdog->site_count == WATCHDOG_SITES)
+		return &watchdog->sites[WATCHDOG_SITES - 1];
+
+	site = &watchdog->sites[watchdog->site_count++];
+	site->address = address;
+	if (!address) {
+		snprintf(site->name, sizeof(site->name), "unknown");
+	} else if (!dladdr(address, &info)) {
+		snprintf(site->name, sizeof(site->name), "%p", address);
+	} else if (info.dli_sname) {
+		snprintf(site->name, sizeof(site->name), "%s+0x%lx",
+			info.dli_sname, (unsigned long)((char *)address -
+				(char *)info.dli_saddr));
+	} else {
+		/* Our static functions, for addr2line -f -e */
+		object = strrchr(info.dli_fname, '/');
+		snprintf(site->name, sizeof(site->name), "%s+0x%lx",
+			object ? object + 1 : info.dli_fname,
+			(unsigned long)((char *)address -
+				(char *)info.dli_fbase));
+	}
+	return site;
+}
+
+void watchdog_dispatch_begin(struct wet_server *server)
+{
+	struct wet_watchdog *watchdog = server->watchdog;
+
+	__atomic_store_n(&watchdog->start, watchdog_now(), __ATOMIC_RELAXED);
+	__atomic_store_n(&watchdog->seq, watchdog->seq + 1, __ATOMIC_RELEASE);
+}
+
+void watchdog_dispatch_end(struct wet_server *server)
+{
+	struct wet_watchdog *watchdog = server->watchdog;
+	uint64_t seq = watchdog->seq;
+	int64_t elapsed = watchdog_now() - watchdog->start;
+	struct watchdog_site *site;
+	int count;
+
+	__atomic_store_n(&watchdog->seq, seq + 1, __ATOMIC_RELEASE);
+	watchdog->dispatches++;
+	if (elapsed < watchdog->threshold_nsec)
+		return;
+
+	count = watchdog->sampled_seq == seq ? watchdog->frame_count : 0;
+	site = watchdog_get_site(watchdog, watchdog->frames, count);
+	histogram_add(&site->stalls, elapsed);
+
+	printf("stall: event loop blocked for %.1f ms in %s\n",
+	       elapsed / 1e6, site->name);
+	fflush(stdout);
+	if (count > 0)
+		backtrace_symbols_fd(watchdog->frames, count, STDOUT_FILENO);
+	ipc_send_event(server, "stall %.1f %s", elapsed / 1e6, site->name);
+}
+
+bool watchdog_init(struct wet_server *server)
+{
+	struct wet_watchdog *watchdog;
+	struct sigaction action = { 0 };
+	pthread_attr_t attr;
+	void *stack;
+	size_t stack_size;
+
+	if (server->stall_threshold <= 0)
+		return true;
+
+	watchdog = calloc(1, sizeof(*watchdog));
+	if (!watchdog)
+		return false;
+	watchdog->server = server;
+	watchdog->threshold_nsec = (int64_t)server->stall_threshold * 1000000;
+	watchdog->main_thread = pthread_self();
+	/* Without it stalls still get their interrupted address */
+	if (pthread_getattr_np(watchdog->main_thread, &attr) == 0) {
+		if (pthread_attr_getstack(&attr, &stack, &stack_size) == 0) {
+			watchdog->stack_low = (uintptr_t)stack;
+			watchdog->stack_high = (uintptr_t)stack + stack_size;
+		}
+		pthread_attr_destroy(&attr);
+	}
+
+	watchdog_instance = watchdog;
+	action.sa_sigaction = watchdog_handle_signal;
+	action.sa_flags = SA_RESTART | SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(WATCHDOG_SIGNAL, &action, NULL) < 0)
+		goto failed;
+
+	if (pthread_create(&watchdog->thread, NULL, watchdog_thread,
+			watchdog) != 0)
+		goto failed;
+
+	server->watchdog = watchdog;
+	return true;
+
+failed:
+	printf("failed to start the stall watchdog\n");
+	watchdog_instance = NULL;
+	free(watchdog);
+	return false;
+}
+
+void watchdog_finish(struct wet_server *server)
+{
+	struct wet_watchdog *watchdog = server->watchdog;
+
+	if (!watchdog)
+		return;
+
+	__atomic_store_n(&watchdog->stop, true, __ATOMIC_RELAXED);
+	pthread_join(watchdog->thread, NULL);
+	signal(WATCHDOG_SIGNAL, SIG_DFL);
+	watchdog_instance = NULL;
+	server->watchdog = NULL;
+	free(watchdog);
+}
+
+void watchdog_dump(struct wet_server *server, FILE *f)
+{
+	struct wet_watchdog *watchdog = server->watchdog;
+	char name[128];
+	uint64_t stalls = 0;
+	int i;
+
+	if (!watchdog)
+		return;
+
+	for (i = 0; i < watchdog->site_count; i++)
+		stalls += watchdog->sites[i].stalls.count;
+	fprintf(f, "stalls: %" PRIu64 " of %" PRIu64 " dispatches over %d ms\n",
+		stalls, watchdog->dispatches, server->stall_threshold);
+	for (i = 0; i < watchdog->site_count; i++) {
+		snprintf(name, sizeof(name), "stall in %s",
+			watchdog->sites[i].name);
+		histogram_print(f, name, &watchdog->sites[i].stalls);
+	}
+}
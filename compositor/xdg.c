@@ -26,6 +26,10 @@ static void begin_interactive(struct wet_view *view,
 		/* Deny move/resize requests from unfocused clients. */
 		return;
 	}
+	if (view->tile) {
+		/* The tiling layout decides where tiled views go */
+		return;
+	}
 	server->grabbed_view = view;
 	server->cursor_mode = mode;
 
@@ -48,6 +52,9 @@ static void begin_interactive(struct wet_view *view,
 		server->grab_geobox.y += view->y;
 
 		server->resize_edges = edges;
+		/* Don't wait on a configure from an earlier grab */
+		view->resize.serial = 0;
+		view->resize.pending = false;
 	}
 }
 
@@ -74,35 +81,303 @@ static void xdg_toplevel_request_resize(
 	begin_interactive(view, CURSOR_RESIZE, event->edges);
 }
 
+static void xdg_toplevel_request_maximize(
+		struct wl_listener *listener, void *data) {
+	struct wet_view *view = wl_container_of(listener, view, request_maximize);
+	view_set_maximized(view, view->xdg_surface->toplevel->requested.maximized);
+}
+
+static void xdg_toplevel_request_fullscreen(
+		struct wl_listener *listener, void *data) {
+	struct wet_view *view = wl_container_of(listener, view, request_fullscreen);
+	struct wlr_xdg_toplevel *toplevel = view->xdg_surface->toplevel;
+
+	view_set_fullscreen(view, toplevel->requested.fullscreen,
+		toplevel->requested.fullscreen_output);
+}
+
+/*
+ * Synchronized subsurfaces are applied with the toplevel's commit, which
+ * updates the view's bounds. Desynchronized ones commit on their own, and
+ * any subsurface may map or unmap, so they are followed too.
+ */
+struct wet_subsurface {
+	struct wl_list link; /* wet_view.subsurfaces */
+	/* NULL once the view is gone */
+	struct wet_view *view;
+	struct wlr_subsurface *subsurface;
+	struct wl_listener map;
+	struct wl_listener unmap;
+	struct wl_listener commit;
+	struct wl_listener new_subsurface;
+	struct wl_listener destroy;
+};
+
+static void subsurface_create(struct wet_view *view,
+		struct wlr_subsurface *wlr_subsurface);
+
+static void subsurface_update(struct wet_subsurface *subsurface) {
+	if (subsurface->view && subsurface->view->mapped) {
+		spatial_view_update(subsurface->view);
+	}
+}
+
+static void subsurface_handle_map(struct wl_listener *listener, void *data) {
+	struct wet_subsurface *subsurface =
+		wl_container_of(listener, subsurface, map);
+
+	subsurface_update(subsurface);
+}
+
+static void subsurface_handle_unmap(struct wl_listener *listener, void *data) {
+	struct wet_subsurface *subsurface =
+		wl_container_of(listener, subsurface, unmap);
+
+	subsurface_update(subsurface);
+}
+
+static void subsurface_handle_commit(struct wl_listener *listener, void *data) {
+	struct wet_subsurface *subsurface =
+		wl_container_of(listener, subsurface, commit);
+
+	subsurface_update(subsurface);
+}
+
+static void subsurface_handle_new_subsurface(struct wl_listener *listener,
+		void *data) {
+	struct wet_subsurface *subsurface =
+		wl_container_of(listener, subsurface, new_subsurface);
+
+	if (subsurface->view) {
+		subsurface_create(subsurface->view, data);
+	}
+}
+
+static void subsurface_handle_destroy(struct wl_listener *listener,
+		void *data) {
+	struct wet_subsurface *subsurface =
+		wl_container_of(listener, subsurface, destroy);
+
+	wl_list_remove(&subsurface->map.link);
+	wl_list_remove(&subsurface->unmap.link);
+	wl_list_remove(&subsurface->commit.link);
+	wl_list_remove(&subsurface->new_subsurface.link);
+	wl_list_remove(&subsurface->destroy.link);
+	wl_list_remove(&subsurface->link);
+	free(subsurface);
+}
+
+static void subsurface_create(struct wet_view *view,
+		struct wlr_subsurface *wlr_subsurface) {
+	/* Only costs hit-testing accuracy should it fail */
+	struct wet_subsurface *subsurface = calloc(1, sizeof(*subsurface));
+
+	if (!subsurface) {
+		return;
+	}
+	subsurface->view = view;
+	subsurface->subsurface = wlr_subsurface;
+	subsurface->map.notify = subsurface_handle_map;
+	wl_signal_add(&wlr_subsurface->events.map, &subsurface->map);
+	subsurface->unmap.notify = subsurface_handle_unmap;
+	wl_signal_add(&wlr_subsurface->events.unmap, &subsurface->unmap);
+	subsurface->commit.notify = subsurface_handle_commit;
+	wl_signal_add(&wlr_subsurface->surface->events.commit,
+		&subsurface->commit);
+	subsurface->new_subsurface.notify = subsurface_handle_new_subsurface;
+	wl_signal_add(&wlr_subsurface->surface->events.new_subsurface,
+		&subsurface->new_subsurface);
+	subsurface->destroy.notify = subsurface_handle_destroy;
+	wl_signal_add(&wlr_subsurface->events.destroy, &subsurface->destroy);
+	wl_list_insert(&view->subsurfaces, &subsurface->link);
+}
+
+static void xdg_toplevel_new_subsurface(struct wl_listener *listener,
+		void *data) {
+	struct wet_view *view = wl_container_of(listener, view, new_subsurface);
+
+	subsurface_create(view, data);
+}
+
 static void xdg_toplevel_map(struct wl_listener *listener, void *data) {
 	/* Called when the surface is mapped, or ready to display on-screen. */
 	struct wet_view *view = wl_container_of(listener, view, map);
+	struct wet_trace_span span = trace_begin("xdg_toplevel_map");
 
 	wl_list_insert(&view->server->views, &view->link);
+	view->mapped = true;
+	ipc_send_event(view->server, "map %u %s", view->id,
+		view->xdg_surface->toplevel->title ?
+			view->xdg_surface->toplevel->title : "");
 
+	tile_view_map(view);
 	focus_view(view, view->xdg_surface->surface);
+	spatial_view_update(view);
+	trace_end(&span, "view", view->id);
 }
 
 static void xdg_toplevel_unmap(struct wl_listener *listener, void *data) {
 	/* Called when the surface is unmapped, and should no longer be shown. */
 	struct wet_view *view = wl_container_of(listener, view, unmap);
+	struct wet_trace_span span = trace_begin("xdg_toplevel_unmap");
 
+	view->mapped = false;
+	/* The client starts over with a fresh initial commit when it maps
+	 * again, states included */
+	view->fullscreen = false;
+	view->fullscreen_output = NULL;
+	view->maximized = false;
+	transaction_view_remove(view);
+	tile_view_unmap(view);
+	spatial_view_remove(view);
 	wl_list_remove(&view->link);
+	/* Whatever a fullscreen view was hiding comes back */
+	views_update_visibility(view->server);
+	ipc_send_event(view->server, "unmap %u", view->id);
+	trace_end(&span, "view", view->id);
+}
+
+static void xdg_toplevel_commit(struct wl_listener *listener, void *data) {
+	/* Called on every commit of the toplevel's surface, the size may have
+	 * changed. */
+	struct wet_view *view = wl_container_of(listener, view, commit);
+	struct wet_trace_span span = trace_begin("xdg_toplevel_commit");
+
+	if (view->commit_time.tv_sec == 0)
+		clock_gettime(CLOCK_MONOTONIC, &view->commit_time);
+	view_resize_committed(view);
+	transaction_view_commit(view);
+	if (view->mapped) {
+		spatial_view_update(view);
+	}
+	trace_end(&span, "view", view->id);
+}
+
+static void xdg_surface_ack_configure(struct wl_listener *listener, void *data) {
+	/* Acking a configure implicitly acks all the earlier ones too */
+	struct wet_view *view = wl_container_of(listener, view, ack_configure);
+	struct wlr_xdg_surface_configure *configure = data;
+
+	if (view->resize.serial != 0 &&
+			(int32_t)(configure->serial - view->resize.serial) >= 0) {
+		view->resize.acked = true;
+	}
+	transaction_view_ack(view, configure->serial);
 }
 
 static void xdg_toplevel_destroy(struct wl_listener *listener, void *data) {
 	/* Called when the surface is destroyed and should never be shown again. */
 	struct wet_view *view = wl_container_of(listener, view, destroy);
+	struct wet_popup *popup, *tmp;
+	struct wet_subsurface *subsurface, *subsurface_tmp;
+
+	/* Popups may outlive us by a few listeners, tell them we are gone */
+	wl_list_for_each_safe(popup, tmp, &view->popups, link) {
+		popup->view = NULL;
+		wl_list_remove(&popup->link);
+		wl_list_init(&popup->link);
+	}
+	/* Subsurfaces too, they are destroyed with their own resource */
+	wl_list_for_each_safe(subsurface, subsurface_tmp, &view->subsurfaces,
+			link) {
+		subsurface->view = NULL;
+		wl_list_remove(&subsurface->link);
+		wl_list_init(&subsurface->link);
+	}
+	transaction_view_remove(view);
+	spatial_view_remove(view);
+	if (view->resize.timer) {
+		wl_event_source_remove(view->resize.timer);
+	}
 
 	wl_list_remove(&view->map.link);
 	wl_list_remove(&view->unmap.link);
 	wl_list_remove(&view->destroy.link);
+	wl_list_remove(&view->commit.link);
+	wl_list_remove(&view->ack_configure.link);
+	wl_list_remove(&view->new_subsurface.link);
 	wl_list_remove(&view->request_move.link);
 	wl_list_remove(&view->request_resize.link);
+	wl_list_remove(&view->request_maximize.link);
+	wl_list_remove(&view->request_fullscreen.link);
 
+	client_account(view->server,
+		wl_resource_get_client(view->xdg_surface->resource),
+		WET_CLIENT_NODES, -1);
 	free(view);
 }
 
+static void xdg_popup_update(struct wl_listener *listener, void *data) {
+	/* Popups extend the bounds of the view they belong to */
+	struct wet_popup *popup = wl_container_of(listener, popup, commit);
+
+	if (popup->view && popup->view->mapped) {
+		spatial_view_update(popup->view);
+	}
+}
+
+static void xdg_popup_map(struct wl_listener *listener, void *data) {
+	struct wet_popup *popup = wl_container_of(listener, popup, map);
+
+	xdg_popup_update(&popup->commit, data);
+}
+
+static void xdg_popup_unmap(struct wl_listener *listener, void *data) {
+	struct wet_popup *popup = wl_container_of(listener, popup, unmap);
+
+	xdg_popup_update(&popup->commit, data);
+}
+
+static void xdg_popup_destroy(struct wl_listener *listener, void *data) {
+	struct wet_popup *popup = wl_container_of(listener, popup, destroy);
+
+	wl_list_remove(&popup->map.link);
+	wl_list_remove(&popup->unmap.link);
+	wl_list_remove(&popup->commit.link);
+	wl_list_remove(&popup->destroy.link);
+	wl_list_remove(&popup->link);
+	client_account(popup->server,
+		wl_resource_get_client(popup->xdg_surface->resource),
+		WET_CLIENT_NODES, -1);
+	free(popup);
+}
+
+static void server_new_xdg_popup(struct wet_server *server,
+		struct wlr_xdg_surface *xdg_surface,
+		struct wlr_scene_node *parent_node) {
+	struct wet_popup *popup = calloc(1, sizeof(struct wet_popup));
+	struct wlr_scene_node *node = parent_node;
+
+	if (!popup) {
+		/* Its scene node is still there, but not accounted for */
+		client_account(server, wl_resource_get_client(
+			xdg_surface->resource), WET_CLIENT_NODES, -1);
+		return;
+	}
+	popup->server = server;
+	popup->xdg_surface = xdg_surface;
+
+	/* Find the view at the root of the popup tree */
+	while (node != NULL && node->data == NULL) {
+		node = node->parent;
+	}
+	if (node) {
+		popup->view = node->data;
+		wl_list_insert(&popup->view->popups, &popup->link);
+	} else {
+		wl_list_init(&popup->link);
+	}
+
+	popup->map.notify = xdg_popup_map;
+	wl_signal_add(&xdg_surface->events.map, &popup->map);
+	popup->unmap.notify = xdg_popup_unmap;
+	wl_signal_add(&xdg_surface->events.unmap, &popup->unmap);
+	popup->commit.notify = xdg_popup_update;
+	wl_signal_add(&xdg_surface->surface->events.commit, &popup->commit);
+	popup->destroy.notify = xdg_popup_destroy;
+	wl_signal_add(&xdg_surface->events.destroy, &popup->destroy);
+}
+
 void server_new_xdg_surface(struct wl_listener *listener, void *data) {
 	/* This event is raised when wlr_xdg_shell receives a new xdg surface from a
 	 * client, either a toplevel (application window) or popup. */
@@ -110,6 +385,12 @@ void server_new_xdg_surface(struct wl_listener *listener, void *data) {
 		wl_container_of(listener, server, new_xdg_surface);
 	struct wlr_xdg_surface *xdg_surface = data;
 
+	/* Past the hard limit the client is disconnected, nothing to add */
+	if (!client_account(server, wl_resource_get_client(xdg_surface->resource),
+			WET_CLIENT_NODES, 1)) {
+		return;
+	}
+
 	/* We must add xdg popups to the scene graph so they get rendered. The
 	 * wlroots scene graph provides a helper for this, but to use it we must
 	 * provide the proper parent scene node of the xdg popup. To enable this,
@@ -121,6 +402,7 @@ void server_new_xdg_surface(struct wl_listener *listener, void *data) {
 		struct wlr_scene_node *parent_node = parent->data;
 		xdg_surface->data = wlr_scene_xdg_surface_create(
 			parent_node, xdg_surface);
+		server_new_xdg_popup(server, xdg_surface, parent_node);
 		return;
 	}
 	assert(xdg_surface->role == WLR_XDG_SURFACE_ROLE_TOPLEVEL);
@@ -131,8 +413,14 @@ void server_new_xdg_surface(struct wl_listener *listener, void *data) {
 	view->server = server;
 	view->xdg_surface = xdg_surface;
 	view->scene_node = wlr_scene_xdg_surface_create(
-			&view->server->scene->node, view->xdg_surface);
+			&view->server->view_tree->node, view->xdg_surface);
 	view->scene_node->data = view;
+	view->stack = ++server->stack_seq;
+	view->id = ++server->view_id_seq;
+	wl_list_init(&view->popups);
+	wl_list_init(&view->subsurfaces);
+	wl_list_init(&view->spatial.entries);
+	wl_list_init(&view->transactions);
 	xdg_surface->data = view->scene_node;
 
 	/* Listen to the various events it can emit */
@@ -142,6 +430,13 @@ void server_new_xdg_surface(struct wl_listener *listener, void *data) {
 	wl_signal_add(&xdg_surface->events.unmap, &view->unmap);
 	view->destroy.notify = xdg_toplevel_destroy;
 	wl_signal_add(&xdg_surface->events.destroy, &view->destroy);
+	view->commit.notify = xdg_toplevel_commit;
+	wl_signal_add(&xdg_surface->surface->events.commit, &view->commit);
+	view->ack_configure.notify = xdg_surface_ack_configure;
+	wl_signal_add(&xdg_surface->events.ack_configure, &view->ack_configure);
+	view->new_subsurface.notify = xdg_toplevel_new_subsurface;
+	wl_signal_add(&xdg_surface->surface->events.new_subsurface,
+		&view->new_subsurface);
 
 	/* cotd */
 	struct wlr_xdg_toplevel *toplevel = xdg_surface->toplevel;
@@ -149,4 +444,9 @@ void server_new_xdg_surface(struct wl_listener *listener, void *data) {
 	wl_signal_add(&toplevel->events.request_move, &view->request_move);
 	view->request_resize.notify = xdg_toplevel_request_resize;
 	wl_signal_add(&toplevel->events.request_resize, &view->request_resize);
+	view->request_maximize.notify = xdg_toplevel_request_maximize;
+	wl_signal_add(&toplevel->events.request_maximize, &view->request_maximize);
+	view->request_fullscreen.notify = xdg_toplevel_request_fullscreen;
+	wl_signal_add(&toplevel->events.request_fullscreen,
+		&view->request_fullscreen);
 }
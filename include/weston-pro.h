@@ -7,8 +7,13 @@
 #define WESTON_SERVER_H
 
 #include "config.h"
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
 #include <wayland-server-core.h>
 #include <wlr/backend.h>
+#include <wlr/backend/headless.h>
+#include <wlr/backend/multi.h>
 #include <wlr/render/allocator.h>
 #include <wlr/render/wlr_renderer.h>
 #include <wlr/types/wlr_cursor.h>
@@ -19,12 +24,15 @@
 #include <wlr/types/wlr_output.h>
 #include <wlr/types/wlr_output_layout.h>
 #include <wlr/types/wlr_pointer.h>
+#include <wlr/types/wlr_presentation_time.h>
 #include <wlr/types/wlr_scene.h>
 #include <wlr/types/wlr_seat.h>
 #include <wlr/types/wlr_xcursor_manager.h>
 #include <wlr/types/wlr_xdg_shell.h>
 #include <wlr/util/box.h>
 
+#define WET_SPATIAL_BUCKETS 1024
+
 /* For brevity's sake, struct members are annotated where they are used. */
 enum wet_cursor_mode {
 	CURSOR_PASSTHROUGH,
@@ -32,30 +40,177 @@ enum wet_cursor_mode {
 	CURSOR_RESIZE,
 };
 
+/* Why an output frame was composited instead of scanned out directly */
+enum wet_scanout_fallback {
+	WET_SCANOUT_NO_SURFACE,
+	WET_SCANOUT_MULTIPLE_SURFACES,
+	WET_SCANOUT_GEOMETRY,
+	WET_SCANOUT_TRANSFORM,
+	/* Eligible as far as we can tell, refused by the scene or backend */
+	WET_SCANOUT_REJECTED,
+	WET_SCANOUT_FALLBACK_COUNT,
+};
+
+/* Log2 buckets of microseconds: bucket i holds [2^i, 2^(i+1)) us, except
+ * bucket 0 which holds [0, 2) us, and the last one everything above */
+#define WET_HISTOGRAM_BUCKETS 24
+
+struct wet_histogram {
+	uint64_t buckets[WET_HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t sum_nsec;
+	uint64_t max_nsec;
+	/* For the standard deviation */
+	double sum_sq_msec;
+};
+
+/* Counters reported by server_dump_stats() */
+struct wet_stats {
+	/* Keymaps sent to clients because the seat keyboard changed */
+	uint64_t keymap_sends;
+	/* Layout transactions applied, and how many gave up waiting */
+	uint64_t transactions;
+	uint64_t transaction_timeouts;
+	struct wet_histogram transaction_latency;
+	/* Tiling: tree nodes visited by relayouts, views they configured */
+	uint64_t tile_nodes_arranged;
+	uint64_t tile_views_configured;
+	/* HMI layout mode changes */
+	uint64_t hmi_mode_switches;
+	/* Key presses routed to the input method, its commits, and the time
+	 * from a key press to the preedit or commit string it produced */
+	uint64_t ime_keys;
+	uint64_t ime_commits;
+	struct wet_histogram ime_latency;
+	/* Frames composited on the render threads, the tiles they were cut
+	 * into, and how long committed frames took to render */
+	uint64_t render_parallel_frames;
+	uint64_t render_tiles;
+	struct wet_histogram render_time;
+	/* Events from every device, see metrics.c */
+	uint64_t pointer_events;
+	uint64_t key_events;
+};
+
+/* What clients are accounted for, see client.c */
+enum wet_client_resource {
+	WET_CLIENT_SURFACES,
+	/* Scene nodes created for views, popups, ivi and shell surfaces */
+	WET_CLIENT_NODES,
+	/* Bytes of wl_shm pools */
+	WET_CLIENT_SHM_BYTES,
+	/* Bytes of the buffers currently attached to surfaces */
+	WET_CLIENT_BUFFER_BYTES,
+	WET_CLIENT_RESOURCE_COUNT,
+};
+
+/* 0 for no limit. Past soft we warn, past hard the client is
+ * disconnected. */
+struct wet_client_limit {
+	uint64_t soft;
+	uint64_t hard;
+};
+
+/* See trace_begin(), start is 0 when not tracing */
+struct wet_trace_span {
+	const char *name;
+	uint64_t start;
+};
+
+#define WET_STARTUP_PHASES 16
+
+/* Where the time from main() to the first frame went, see startup_mark() */
+struct wet_startup {
+	struct timespec start;
+	struct {
+		const char *name;
+		/* Since start */
+		int64_t nsec;
+	} phases[WET_STARTUP_PHASES];
+	int count;
+	bool first_frame;
+};
+
 struct wet_server {
 	struct wl_display *wl_display;
+	/* WAYLAND_DISPLAY, set by server_listen() */
+	char *socket;
 	struct wlr_backend *backend;
+	/* Part of backend, hosts the virtual outputs */
+	struct wlr_backend *headless_backend;
 	struct wlr_renderer *renderer;
+	/* Threads compositing pixman frames, main one included. Set before
+	 * server_init(), see render.c */
+	int render_threads;
+	struct wet_render_pool *render_pool;
 	struct wlr_allocator *allocator;
 	struct wlr_scene *scene;
+	/* Scene layers from the bottom up, see shell.c and ivi.c */
+	struct wlr_scene_tree *background_tree;
+	struct wlr_scene_tree *view_tree;
+	/* Disabled, the live trees of views a transaction holds, see
+	 * transaction.c */
+	struct wlr_scene_tree *held_tree;
+	struct wlr_scene_tree *panel_tree;
+	struct wlr_scene_tree *ivi_tree;
+	struct wlr_scene_tree *lock_tree;
+	/* weston_desktop_shell, see shell.c */
+	struct wet_shell *shell;
+	/* Only the lock screen gets input */
+	bool locked;
+	struct wl_list ivi_screens;
+	struct wl_list ivi_layers;
+	struct wl_list ivi_placements;
+	struct wl_list ivi_surfaces;
+	struct wl_listener ivi_layout_change;
+	/* Offer ivi_application, set before server_init() */
+	bool ivi_enabled;
+	/* HMI controller, see hmi.c. Set hmi_enabled before server_init(). */
+	bool hmi_enabled;
+	struct wet_hmi *hmi;
 
 	struct wlr_xdg_shell *xdg_shell;
 	struct wl_listener new_xdg_surface;
 	struct wl_list views;
+	/* Bumped every time a view is raised, see wet_view.stack */
+	uint32_t stack_seq;
+
+	/* Spatial index of mapped views for hit-testing, see spatial.c */
+	struct wl_list spatial_buckets[WET_SPATIAL_BUCKETS];
+	struct wl_list spatial_large;
+	/* Views the index is missing, lookups walk the scene meanwhile */
+	int spatial_failed;
 
 	struct wlr_cursor *cursor;
 	struct wlr_xcursor_manager *cursor_mgr;
+	/* The theme is only loaded when first shown */
+	bool cursor_theme_loaded;
 	struct wl_listener cursor_motion;
 	struct wl_listener cursor_motion_absolute;
 	struct wl_listener cursor_button;
 	struct wl_listener cursor_axis;
 	struct wl_listener cursor_frame;
+	/* Defer motion handling to the next pointer frame */
+	bool coalesce_motion;
+	bool motion_pending;
+	uint32_t motion_time;
 
 	struct wlr_seat *seat;
 	struct wl_listener new_input;
 	struct wl_listener request_cursor;
 	struct wl_listener request_set_selection;
 	struct wl_list keyboards;
+	/* Keyboards sharing a keymap are merged behind this one */
+	struct wlr_keyboard_group *keyboard_group;
+	struct wet_keyboard *group_keyboard;
+	struct wlr_virtual_keyboard_manager_v1 *virtual_keyboard_mgr;
+	struct wl_listener new_virtual_keyboard;
+	/* text-input-v2 to input method relay, see text-input.c */
+	struct wet_text_input_relay *text_input;
+	/* Shared by all keyboards, see keyboad.c */
+	struct xkb_context *xkb_context;
+	struct wl_list keymaps;
+	const char *keymap_cache_dir;
 	enum wet_cursor_mode cursor_mode;
 	struct wet_view *grabbed_view;
 	double grab_x, grab_y;
@@ -65,6 +220,81 @@ struct wet_server {
 	struct wlr_output_layout *output_layout;
 	struct wl_list outputs;
 	struct wl_listener new_output;
+	/* Milliseconds before the predicted vblank at which outputs repaint,
+	 * 0 repaints as soon as the frame event fires. */
+	int repaint_window;
+	/* Frame callbacks per second for views without keyboard focus, 0 for
+	 * no cap */
+	int background_fps;
+
+	/* Event loop dispatches longer than this many milliseconds are
+	 * reported, 0 for none. Set before server_init(), see watchdog.c */
+	int stall_threshold;
+	struct wet_watchdog *watchdog;
+	/* server_run() returns once set, see server_terminate() */
+	bool terminated;
+
+	/* Control socket, see ipc.c */
+	int ipc_fd;
+	char *ipc_path;
+	struct wl_event_source *ipc_source;
+	struct wl_list ipc_clients;
+	uint32_t view_id_seq;
+	/* Prometheus text socket, see metrics.c */
+	struct wet_metrics *metrics;
+
+	/* wet_transaction.link, the first one is in flight */
+	struct wl_list transactions;
+	/* Milliseconds to wait for clients before applying anyway */
+	int transaction_timeout;
+
+	/* Mapped views are tiled, see tile.c */
+	bool tiling;
+	struct wl_listener tile_layout_change;
+
+	struct wlr_presentation *presentation;
+	/* wet_client.link, every connected client */
+	struct wl_list clients;
+	struct wl_listener client_created;
+	struct wl_listener new_surface;
+	struct wet_client_limit client_limits[WET_CLIENT_RESOURCE_COUNT];
+
+	struct wet_stats stats;
+	struct wet_startup startup;
+};
+
+/* Per-client bookkeeping, created on connection */
+struct wet_client {
+	struct wl_list link;
+	struct wet_server *server;
+	struct wl_client *wl_client;
+	struct wl_listener destroy;
+	struct wl_listener resource_created;
+	pid_t pid;
+
+	/* By wet_client_resource */
+	uint64_t usage[WET_CLIENT_RESOURCE_COUNT];
+	uint64_t peak[WET_CLIENT_RESOURCE_COUNT];
+	/* Warned about the soft limit already */
+	bool over_soft[WET_CLIENT_RESOURCE_COUNT];
+	/* Size of the wl_shm pool being created, see client_shm_logger() */
+	int32_t pending_pool_size;
+
+	/* Toplevel commits, from the commit to the vblank showing them */
+	struct wet_histogram present_latency;
+	uint64_t presented;
+	/* Shown at least one refresh later than the first vblank after the
+	 * commit */
+	uint64_t missed;
+};
+
+/* A virtual output: WIDTHxHEIGHT[@HZ][+X,Y] */
+struct wet_output_spec {
+	int width, height;
+	/* mHz, 0 for the backend default */
+	int refresh;
+	bool has_position;
+	int x, y;
 };
 
 struct wet_output {
@@ -72,19 +302,138 @@ struct wet_output {
 	struct wet_server *server;
 	struct wlr_output *wlr_output;
 	struct wl_listener frame;
+	struct wl_listener present;
+	struct wl_listener destroy;
+
+	/* Repaint scheduling, see output_frame() */
+	struct wl_event_source *repaint_timer;
+	bool repaint_scheduled;
+	struct timespec last_present;
+	struct timespec next_vblank;
+	int refresh_nsec;
+	int64_t render_nsec;
+	/* When the frame last committed to the output started rendering,
+	 * commits after that aren't in it */
+	struct timespec frame_start;
+
+	/* Tiling tree, NULL until a view is tiled here */
+	struct wet_tile *tile_root;
+
+	/* Committed frames, by how they reached the screen */
+	uint64_t scanout_frames;
+	uint64_t composited_frames[WET_SCANOUT_FALLBACK_COUNT];
+	/* Repaints which committed nothing, and frames presented a vblank
+	 * after the one aimed for */
+	uint64_t skipped_frames;
+	uint64_t late_frames;
 };
 
 struct wet_view {
 	struct wl_list link;
 	struct wet_server *server;
+	/* Stable name for the control socket, never reused */
+	uint32_t id;
 	struct wlr_xdg_surface *xdg_surface;
 	struct wlr_scene_node *scene_node;
 	struct wl_listener map;
 	struct wl_listener unmap;
 	struct wl_listener destroy;
+	struct wl_listener commit;
+	struct wl_listener ack_configure;
 	struct wl_listener request_move;
 	struct wl_listener request_resize;
+	struct wl_listener request_maximize;
+	struct wl_listener request_fullscreen;
+	struct wl_listener new_subsurface;
 	int x, y;
+	bool maximized;
+	bool fullscreen;
+	struct wlr_output *fullscreen_output;
+	/* Layout geometry to go back to when leaving maximized/fullscreen */
+	struct wlr_box saved_geometry;
+	bool mapped;
+	/* Stacking order, higher is closer to the top */
+	uint32_t stack;
+	struct wl_list popups;
+	/* What the view looked like when a transaction took it, shown in
+	 * its place until the transaction is applied */
+	struct wlr_scene_tree *snapshot;
+	/* Subsurfaces, see xdg.c */
+	struct wl_list subsurfaces;
+
+	/* Size changes in flight, see view_resize() */
+	struct {
+		/* Outstanding configure, 0 if none */
+		uint32_t serial;
+		bool acked;
+		/* Gives up on the outstanding configure, see view_resize() */
+		struct wl_event_source *timer;
+		/* A newer size waits for the outstanding configure */
+		bool pending;
+		int width, height;
+		/* Layout coordinates of the edges that stay put */
+		int anchor_x, anchor_y;
+		uint32_t edges;
+	} resize;
+
+	struct {
+		/* Layout coordinates of the whole surface tree */
+		struct wlr_box box;
+		struct wl_list entries;
+		int cx0, cy0, cx1, cy1;
+		bool large;
+		bool indexed;
+		/* Mapped but out of the index, entries couldn't be allocated */
+		bool failed;
+	} spatial;
+
+	/* Leaf of the tiling tree, NULL for floating views */
+	struct wet_tile *tile;
+
+	/* wet_transaction_entry.view_link */
+	struct wl_list transactions;
+
+	/* First commit not presented yet, zero if none */
+	struct timespec commit_time;
+
+	/* Frame callbacks, see output_send_frame_done() */
+	struct {
+		struct timespec last_done;
+		uint64_t sent;
+		/* Withheld, per frame of an output the view is on, and of the
+		 * first output for views on none */
+		uint64_t occluded;
+		uint64_t offscreen;
+		uint64_t background;
+	} frames;
+};
+
+struct wet_popup {
+	struct wl_list link;
+	struct wet_server *server;
+	/* The toplevel at the root of the popup tree, NULL once it is gone */
+	struct wet_view *view;
+	struct wlr_xdg_surface *xdg_surface;
+	struct wl_listener map;
+	struct wl_listener unmap;
+	struct wl_listener commit;
+	struct wl_listener destroy;
+};
+
+struct wet_ivi_surface {
+	struct wl_list link; /* wet_server.ivi_surfaces */
+	struct wet_server *server;
+	uint32_t ivi_id;
+	struct wl_resource *resource;
+	struct wlr_surface *surface;
+	/* NULL once wlroots destroyed it with the surface */
+	struct wlr_scene_node *node;
+	struct wl_listener surface_destroy;
+	struct wl_listener node_destroy;
+	/* Last configured size */
+	int width, height;
+	/* Laid out by the HMI controller, see hmi.c */
+	struct wet_hmi_surface *hmi;
 };
 
 struct wet_keyboard {
@@ -94,22 +443,275 @@ struct wet_keyboard {
 
 	struct wl_listener modifiers;
 	struct wl_listener key;
+	struct wl_listener destroy;
 };
 
 bool server_init(struct wet_server *server);
 
+bool server_listen(struct wet_server *server, int socket_fd);
+
 bool server_start(struct wet_server *server);
 
+void server_run(struct wet_server *server);
+
+void server_terminate(struct wet_server *server);
+
+void server_dump_stats(struct wet_server *server, FILE *f);
+
+void startup_mark(struct wet_server *server, const char *phase);
+
+void startup_print(struct wet_server *server, FILE *f);
+
+bool watchdog_init(struct wet_server *server);
+
+void watchdog_finish(struct wet_server *server);
+
+void watchdog_dispatch_begin(struct wet_server *server);
+
+void watchdog_dispatch_end(struct wet_server *server);
+
+void watchdog_dump(struct wet_server *server, FILE *f);
+
+bool trace_init(const char *path, bool stream);
+
+void trace_add_display(struct wl_display *display);
+
+bool trace_enabled(void);
+
+void trace_thread_name(const char *name);
+
+struct wet_trace_span trace_begin(const char *name);
+
+void trace_end(struct wet_trace_span *span, const char *key, uint64_t id);
+
+void trace_end_str(struct wet_trace_span *span, const char *key,
+		const char *value);
+
+bool trace_dump(void);
+
+void trace_finish(void);
+
+void histogram_add(struct wet_histogram *histogram, int64_t nsec);
+
+double histogram_percentile(const struct wet_histogram *histogram,
+		double p);
+
+void histogram_print(FILE *f, const char *name,
+		const struct wet_histogram *histogram);
+
+struct wet_client *client_get(struct wet_server *server,
+		struct wl_client *wl_client);
+
+void client_view_presented(struct wet_view *view, int64_t latency_nsec,
+		bool missed);
+
+bool client_init(struct wet_server *server, struct wlr_compositor *compositor);
+
+/* Adds delta to the usage of the client. An increase past the hard limit
+ * isn't counted, the client is disconnected and false returned. */
+bool client_account(struct wet_server *server, struct wl_client *wl_client,
+		enum wet_client_resource resource, int64_t delta);
+
+/* <resource>=<soft>[:<hard>], resource being one of surfaces, nodes, shm
+ * or buffers, sizes taking a K, M or G suffix */
+struct wl_client *client_launch(struct wet_server *server, const char *path);
+
+bool client_parse_limit(const char *spec, enum wet_client_resource *resource,
+		struct wet_client_limit *limit);
+
+void client_dump(struct wet_client *client, FILE *f);
+
 bool output_init(struct wet_server *server);
 
-void seat_init(struct wet_server *server);
+bool render_init(struct wet_server *server);
+
+void render_finish(struct wet_server *server);
+
+bool render_output_commit(struct wet_server *server,
+		struct wlr_scene_output *scene_output);
+
+bool output_parse_spec(const char *str, struct wet_output_spec *spec);
+
+struct wet_output *output_add_virtual(struct wet_server *server,
+		const struct wet_output_spec *spec);
+
+bool output_remove_virtual(struct wet_output *output);
+
+struct wet_output *output_find(struct wet_server *server, const char *name);
+
+bool seat_init(struct wet_server *server);
 
 void cursor_init(struct wet_server *server);
 
-void keyboard_init(struct wet_server *server);
+bool keyboard_init(struct wet_server *server);
+
+bool text_input_init(struct wet_server *server);
+
+/* Whether the key or modifiers went to the input method's keyboard grab
+ * rather than the focused client */
+bool text_input_handle_key(struct wet_server *server,
+		struct wlr_input_device *device,
+		struct wlr_event_keyboard_key *event);
+
+bool text_input_handle_modifiers(struct wet_server *server,
+		struct wlr_input_device *device);
+
+struct xkb_keymap *keyboard_get_keymap(struct wet_server *server,
+		const struct xkb_rule_names *names);
 
 void focus_view(struct wet_view *view, struct wlr_surface *surface);
 
+void focus_surface(struct wet_server *server, struct wlr_surface *surface);
+
+void view_raise(struct wet_view *view);
+
+void view_set_position(struct wet_view *view, int x, int y);
+
+void view_resize(struct wet_view *view, int anchor_x, int anchor_y,
+		uint32_t edges, int width, int height);
+
+void view_resize_committed(struct wet_view *view);
+
+void view_get_geometry(struct wet_view *view, struct wlr_box *box);
+
+void view_set_fullscreen(struct wet_view *view, bool fullscreen,
+		struct wlr_output *output);
+
+void view_set_maximized(struct wet_view *view, bool maximized);
+
+void views_update_visibility(struct wet_server *server);
+
+struct wet_view *desktop_view_at(struct wet_server *server, double lx, double ly,
+		struct wlr_surface **surface, double *sx, double *sy);
+
+struct wet_view *desktop_view_at_scene(struct wet_server *server,
+		double lx, double ly, struct wlr_surface **surface,
+		double *sx, double *sy);
+
+void spatial_init(struct wet_server *server);
+
+void spatial_view_update(struct wet_view *view);
+
+void spatial_view_remove(struct wet_view *view);
+
+bool spatial_view_at(struct wet_server *server, double lx, double ly,
+		struct wet_view **view, struct wlr_surface **surface,
+		double *sx, double *sy);
+
+struct wet_transaction *transaction_create(struct wet_server *server);
+
+bool transaction_add_view(struct wet_transaction *transaction,
+		struct wet_view *view, const struct wlr_box *geometry);
+
+void transaction_get_geometry(struct wet_transaction *transaction,
+		struct wet_view *view, struct wlr_box *geometry);
+
+void transaction_commit(struct wet_transaction *transaction);
+
+bool transaction_holds_output(struct wet_server *server,
+		struct wlr_output *output);
+
+void transaction_view_raise(struct wet_view *view);
+
+void transaction_view_set_enabled(struct wet_view *view, bool enabled);
+
+void transaction_view_ack(struct wet_view *view, uint32_t serial);
+
+void transaction_view_commit(struct wet_view *view);
+
+void transaction_view_remove(struct wet_view *view);
+
+void tile_init(struct wet_server *server);
+
+void tile_arrange(struct wet_server *server);
+
+void tile_view_map(struct wet_view *view);
+
+void tile_view_unmap(struct wet_view *view);
+
+bool tile_view_split(struct wet_view *view, bool vertical);
+
+bool tile_view_set_weight(struct wet_view *view, double weight);
+
+void tile_view_rearrange(struct wet_view *view);
+
+void tile_output_destroy(struct wet_output *output);
+
+bool shell_init(struct wet_server *server);
+
+bool shell_launch(struct wet_server *server, const char *path);
+
+bool shell_has_client(struct wet_server *server);
+
+void shell_lock(struct wet_server *server);
+
+bool shell_surface_accepts_focus(struct wlr_surface *surface);
+
+bool shell_get_usable_box(struct wet_server *server, struct wlr_output *output,
+		struct wlr_box *box);
+
+void shell_update_visibility(struct wet_server *server);
+
+void shell_send_frame_done(struct wet_server *server, struct wlr_output *output,
+		const struct wlr_box *output_box, const struct timespec *now);
+
+bool ivi_init(struct wet_server *server);
+
+bool ivi_load_config(struct wet_server *server, const char *path);
+
+bool ivi_layer_set_screen(struct wet_server *server, uint32_t id,
+		const char *screen_name);
+
+bool ivi_layer_set_visible(struct wet_server *server, uint32_t id,
+		bool visible);
+
+bool ivi_set_placement(struct wet_server *server, uint32_t ivi_id,
+		uint32_t layer_id, const struct wlr_box *box);
+
+void ivi_update_screens(struct wet_server *server);
+
+struct wlr_scene_tree *ivi_layer_get_tree(struct wet_server *server,
+		uint32_t id);
+
+bool ivi_layer_get_size(struct wet_server *server, uint32_t id,
+		int *width, int *height);
+
+void ivi_surface_configure(struct wet_ivi_surface *ivi_surface,
+		int width, int height);
+
+struct wlr_surface *ivi_surface_at(struct wet_server *server, double lx,
+		double ly, double *sx, double *sy);
+
+void ivi_send_frame_done(struct wet_server *server,
+		const struct wlr_box *output_box, const struct timespec *now);
+
+bool hmi_init(struct wet_server *server);
+
+bool hmi_launch(struct wet_server *server, const char *path);
+
+void hmi_arrange(struct wet_server *server);
+
+bool hmi_surface_add(struct wet_ivi_surface *ivi_surface);
+
+void hmi_surface_remove(struct wet_ivi_surface *ivi_surface);
+
+int hmi_surface_count(struct wet_server *server);
+
+bool hmi_switch_mode(struct wet_server *server, uint32_t mode);
+
+bool hmi_set_home(struct wet_server *server, bool home);
+
+bool ipc_init(struct wet_server *server, const char *socket_name);
+
+void ipc_finish(struct wet_server *server);
+
+bool metrics_init(struct wet_server *server, const char *socket_name);
+
+void metrics_finish(struct wet_server *server);
+
+void ipc_send_event(struct wet_server *server, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
 void server_new_xdg_surface(struct wl_listener *listener, void *data);
 
 #endif